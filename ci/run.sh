@@ -46,7 +46,7 @@ popd
 PATH=${INSTALL_DIR}/bin:$PATH
 
 # list of tests to run
-tests="zlog_test_backend_lmdb zlog_test_backend_ram"
+tests="zlog_test_backend_lmdb zlog_test_backend_ram zlog_test_allocations_ram"
 
 # run ceph backend tests
 export CEPH_CONF=/tmp/micro-osd/ceph.conf
@@ -0,0 +1,358 @@
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <time.h>
+#include <hdr_histogram.h>
+#include "libseq/libseqr.h"
+
+/*
+ * Sequencer load generator.
+ *
+ * Drives SeqrClient::CheckTail from a number of threads against a running
+ * zlog-seqr, and reports the throughput and latency of each combination of
+ * operation, number of logs, and number of client channels as JSON on
+ * stdout. The sequencer must be started with --create-logs so that it can
+ * create the benchmark logs in its own backend instance, for example:
+ *
+ *   zlog-seqr --port 5678 --nthreads 4 --create-logs
+ *   zlog_seqr_bench --port 5678 --logs 1,16 --channels 1,4
+ *
+ * The stream_next and stream_read operations pass stream ids, and require a
+ * sequencer built with STREAMING_SUPPORT and run with --streams.
+ */
+
+namespace po = boost::program_options;
+
+// stream ids that the stream operations pick from
+static const uint64_t max_stream_ids = 64;
+
+static inline uint64_t getns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static std::vector<int> parse_list(const std::string& list)
+{
+  std::vector<int> out;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    int val = std::stoi(item);
+    if (val <= 0) {
+      std::cerr << "invalid list value " << item << std::endl;
+      exit(1);
+    }
+    out.push_back(val);
+  }
+  return out;
+}
+
+static std::vector<std::string> parse_ops(const std::string& list)
+{
+  std::vector<std::string> out;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item != "next" && item != "read" &&
+        item != "stream_next" && item != "stream_read") {
+      std::cerr << "invalid op " << item << std::endl;
+      exit(1);
+    }
+    out.push_back(item);
+  }
+  return out;
+}
+
+struct Config {
+  std::string op;
+  int num_logs;
+  int num_channels;
+};
+
+struct Result {
+  uint64_t ops;
+  uint64_t errors;
+  uint64_t elapsed_ns;
+  struct hdr_histogram *histogram;
+};
+
+class Bench {
+ public:
+  Bench(const std::string& host, const std::string& port,
+      const std::map<std::string, std::string>& meta,
+      const std::string& prefix, int num_threads, int runtime,
+      int num_streams, int protocol) :
+    host_(host), port_(port), meta_(meta), prefix_(prefix),
+    num_threads_(num_threads), runtime_(runtime),
+    num_streams_(num_streams), protocol_(protocol)
+  {}
+
+  int Run(const Config& config, Result *result) {
+    zlog::SeqrClient client(host_.c_str(), port_.c_str(), epoch,
+        config.num_channels, protocol_);
+    client.Connect();
+
+    // the sequencer initializes a log on first use, so that isn't measured
+    for (int i = 0; i < config.num_logs; i++) {
+      int ret = WaitForLog(client, log_name(i));
+      if (ret)
+        return ret;
+    }
+
+    std::vector<struct hdr_histogram*> histograms(num_threads_);
+    std::vector<uint64_t> ops(num_threads_);
+    std::vector<uint64_t> errors(num_threads_);
+
+    stop_ = false;
+    std::vector<std::thread> threads;
+    const uint64_t start_ns = getns();
+    for (int i = 0; i < num_threads_; i++) {
+      hdr_init(1, INT64_C(10000000000), 3, &histograms[i]);
+      threads.emplace_back(&Bench::Client, this, std::ref(client),
+          std::cref(config), i, histograms[i], &ops[i], &errors[i]);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(runtime_));
+    stop_ = true;
+
+    for (auto& thread : threads)
+      thread.join();
+    const uint64_t end_ns = getns();
+
+    hdr_init(1, INT64_C(10000000000), 3, &result->histogram);
+    result->ops = 0;
+    result->errors = 0;
+    result->elapsed_ns = end_ns - start_ns;
+    for (int i = 0; i < num_threads_; i++) {
+      hdr_add(result->histogram, histograms[i]);
+      hdr_close(histograms[i]);
+      result->ops += ops[i];
+      result->errors += errors[i];
+    }
+
+    return 0;
+  }
+
+ private:
+  // the benchmark doesn't track views, so it claims the newest epoch
+  static const uint64_t epoch = std::numeric_limits<uint32_t>::max();
+
+  std::string log_name(int index) const {
+    std::stringstream ss;
+    ss << prefix_ << "." << index;
+    return ss.str();
+  }
+
+  int WaitForLog(zlog::SeqrClient& client, const std::string& name) {
+    for (;;) {
+      uint64_t position;
+      int ret = client.CheckTail(epoch, meta_, name, &position, false);
+      if (ret == 0)
+        return 0;
+      if (ret != -EAGAIN) {
+        std::cerr << "failed to initialize log " << name
+          << " ret " << ret << std::endl;
+        return ret;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  void Client(zlog::SeqrClient& client, const Config& config, int id,
+      struct hdr_histogram *histogram, uint64_t *pops, uint64_t *perrors) {
+    const bool next = config.op == "next" || config.op == "stream_next";
+    const bool streams = config.op == "stream_next" ||
+      config.op == "stream_read";
+
+    std::set<uint64_t> stream_ids;
+    for (int i = 0; i < num_streams_; i++)
+      stream_ids.insert((id * num_streams_ + i) % max_stream_ids);
+
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t count = id;
+    while (!stop_) {
+      const auto name = log_name(count++ % config.num_logs);
+
+      uint64_t position;
+      const uint64_t start_ns = getns();
+      int ret;
+      if (streams) {
+        std::map<uint64_t, std::vector<uint64_t>> backpointers;
+        ret = client.CheckTail(epoch, meta_, name, stream_ids,
+            backpointers, &position, next);
+      } else {
+        ret = client.CheckTail(epoch, meta_, name, &position, next);
+      }
+      const uint64_t latency_ns = getns() - start_ns;
+
+      if (ret) {
+        errors++;
+        continue;
+      }
+
+      hdr_record_value(histogram, latency_ns);
+      ops++;
+    }
+
+    *pops = ops;
+    *perrors = errors;
+  }
+
+  const std::string host_;
+  const std::string port_;
+  const std::map<std::string, std::string> meta_;
+  const std::string prefix_;
+  const int num_threads_;
+  const int runtime_;
+  const int num_streams_;
+  const int protocol_;
+
+  std::atomic<bool> stop_;
+};
+
+static void print_result(const Config& config, const Result& result,
+    bool last)
+{
+  auto h = result.histogram;
+  const double secs = (double)result.elapsed_ns / 1000000000.0;
+  std::cout << "    {\"op\": \"" << config.op << "\""
+    << ", \"logs\": " << config.num_logs
+    << ", \"channels\": " << config.num_channels
+    << ", \"ops\": " << result.ops
+    << ", \"errors\": " << result.errors
+    << ", \"ops_per_sec\": " << (double)result.ops / secs
+    << ", \"latency_us\": {"
+    << "\"mean\": " << hdr_mean(h) / 1000.0
+    << ", \"p50\": " << hdr_value_at_percentile(h, 50.0) / 1000.0
+    << ", \"p99\": " << hdr_value_at_percentile(h, 99.0) / 1000.0
+    << ", \"p999\": " << hdr_value_at_percentile(h, 99.9) / 1000.0
+    << ", \"max\": " << hdr_max(h) / 1000.0
+    << "}}" << (last ? "" : ",") << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string host;
+  std::string port;
+  std::string scheme;
+  std::string db_path;
+  std::string ops_list;
+  std::string logs_list;
+  std::string channels_list;
+  int num_threads;
+  int runtime;
+  int num_streams;
+  int protocol;
+
+  po::options_description opts("Sequencer benchmark options");
+  opts.add_options()
+    ("help,h", "show help message")
+    ("host", po::value<std::string>(&host)->default_value("localhost"), "Sequencer host")
+    ("port", po::value<std::string>(&port)->default_value("5678"), "Sequencer port")
+    ("scheme", po::value<std::string>(&scheme)->default_value("ram"), "Backend (ram, lmdb)")
+    ("db", po::value<std::string>(&db_path)->default_value(""), "LMDB database path")
+    ("threads,t", po::value<int>(&num_threads)->default_value(8), "Client threads")
+    ("runtime,r", po::value<int>(&runtime)->default_value(5), "Seconds per run")
+    ("ops", po::value<std::string>(&ops_list)->default_value("next,read"), "Operations (next, read, stream_next, stream_read)")
+    ("logs", po::value<std::string>(&logs_list)->default_value("1,4,16"), "Numbers of logs to sweep")
+    ("channels", po::value<std::string>(&channels_list)->default_value("1,4"), "Numbers of client channels to sweep")
+    ("streams", po::value<int>(&num_streams)->default_value(2), "Stream ids per stream operation")
+    ("protocol", po::value<int>(&protocol)->default_value(2), "Sequencer protocol version")
+  ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, opts), vm);
+
+  if (vm.count("help")) {
+    std::cout << opts << std::endl;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  if (num_threads <= 0 || runtime <= 0 || num_streams <= 0 ||
+      (protocol != 1 && protocol != 2)) {
+    std::cerr << "invalid options" << std::endl;
+    return 1;
+  }
+
+  std::map<std::string, std::string> meta;
+  meta["scheme"] = scheme;
+  if (scheme == "lmdb") {
+    if (db_path.empty()) {
+      std::cerr << "lmdb backend requires --db" << std::endl;
+      return 1;
+    }
+    meta["path"] = db_path;
+  } else if (scheme != "ram") {
+    std::cerr << "unsupported backend " << scheme << std::endl;
+    return 1;
+  }
+
+  const auto ops = parse_ops(ops_list);
+  const auto logs = parse_list(logs_list);
+  const auto channels = parse_list(channels_list);
+
+  std::vector<Config> configs;
+  for (auto& op : ops) {
+    for (auto num_logs : logs) {
+      for (auto num_channels : channels) {
+        configs.push_back(Config{op, num_logs, num_channels});
+      }
+    }
+  }
+
+  // each run uses new logs
+  std::stringstream prefix;
+  prefix << "seqr_bench." << boost::uuids::random_generator()();
+
+  Bench bench(host, port, meta, prefix.str(), num_threads, runtime,
+      num_streams, protocol);
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "{" << std::endl
+    << "  \"host\": \"" << host << "\"," << std::endl
+    << "  \"port\": \"" << port << "\"," << std::endl
+    << "  \"scheme\": \"" << scheme << "\"," << std::endl
+    << "  \"protocol\": " << protocol << "," << std::endl
+    << "  \"threads\": " << num_threads << "," << std::endl
+    << "  \"runtime_sec\": " << runtime << "," << std::endl
+    << "  \"streams\": " << num_streams << "," << std::endl
+    << "  \"results\": [" << std::endl;
+
+  for (size_t i = 0; i < configs.size(); i++) {
+    const auto& config = configs[i];
+    std::cerr << "running op " << config.op << " logs " << config.num_logs
+      << " channels " << config.num_channels << std::endl;
+
+    Result result;
+    int ret = bench.Run(config, &result);
+    if (ret) {
+      std::cerr << "benchmark failed " << ret << std::endl;
+      return 1;
+    }
+
+    print_result(config, result, i + 1 == configs.size());
+    hdr_close(result.histogram);
+  }
+
+  std::cout << "  ]" << std::endl << "}" << std::endl;
+
+  return 0;
+}
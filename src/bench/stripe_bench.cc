@@ -0,0 +1,270 @@
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <time.h>
+#include <hdr_histogram.h>
+#include "include/zlog/log.h"
+#include "libzlog/log_impl.h"
+
+/*
+ * Stripe width benchmark.
+ *
+ * Appends to one log from a number of threads, and changes the stripe width
+ * of the log between runs with the same load. The throughput and latency of
+ * each run are reported as JSON on stdout. The log is created without a
+ * sequencer host, so the benchmark process is the only writer. For example,
+ * to compare a log striped across one object with the same log widened to 16
+ * objects:
+ *
+ *   zlog_stripe_bench --scheme ceph --param pool=zlog --widths 1,16
+ *
+ * With --widen-rate the stripe is also widened by the log itself while the
+ * load runs (see Options::stripe_widen_rate), and the width at the end of
+ * each run is reported.
+ */
+
+namespace po = boost::program_options;
+
+static inline uint64_t getns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+static std::vector<int> parse_list(const std::string& list)
+{
+  std::vector<int> out;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    int val = std::stoi(item);
+    if (val <= 0) {
+      std::cerr << "invalid list value " << item << std::endl;
+      exit(1);
+    }
+    out.push_back(val);
+  }
+  return out;
+}
+
+struct Result {
+  uint64_t ops;
+  uint64_t errors;
+  uint64_t elapsed_ns;
+  struct hdr_histogram *histogram;
+};
+
+class Bench {
+ public:
+  Bench(zlog::Log *log, int num_threads, int runtime, size_t entry_size) :
+    log_(log), num_threads_(num_threads), runtime_(runtime),
+    data_(entry_size, 'x')
+  {}
+
+  void Run(Result *result) {
+    std::vector<struct hdr_histogram*> histograms(num_threads_);
+    std::vector<uint64_t> ops(num_threads_);
+    std::vector<uint64_t> errors(num_threads_);
+
+    stop_ = false;
+    std::vector<std::thread> threads;
+    const uint64_t start_ns = getns();
+    for (int i = 0; i < num_threads_; i++) {
+      hdr_init(1, INT64_C(10000000000), 3, &histograms[i]);
+      threads.emplace_back(&Bench::Client, this, histograms[i],
+          &ops[i], &errors[i]);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(runtime_));
+    stop_ = true;
+
+    for (auto& thread : threads)
+      thread.join();
+    const uint64_t end_ns = getns();
+
+    hdr_init(1, INT64_C(10000000000), 3, &result->histogram);
+    result->ops = 0;
+    result->errors = 0;
+    result->elapsed_ns = end_ns - start_ns;
+    for (int i = 0; i < num_threads_; i++) {
+      hdr_add(result->histogram, histograms[i]);
+      hdr_close(histograms[i]);
+      result->ops += ops[i];
+      result->errors += errors[i];
+    }
+  }
+
+ private:
+  void Client(struct hdr_histogram *histogram, uint64_t *pops,
+      uint64_t *perrors) {
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    while (!stop_) {
+      const uint64_t start_ns = getns();
+      int ret = log_->Append(zlog::Slice(data_));
+      const uint64_t latency_ns = getns() - start_ns;
+
+      if (ret) {
+        errors++;
+        continue;
+      }
+
+      hdr_record_value(histogram, latency_ns);
+      ops++;
+    }
+
+    *pops = ops;
+    *perrors = errors;
+  }
+
+  zlog::Log *log_;
+  const int num_threads_;
+  const int runtime_;
+  const std::string data_;
+
+  std::atomic<bool> stop_;
+};
+
+static void print_result(int width, int width_after, const Result& result,
+    bool last)
+{
+  auto h = result.histogram;
+  const double secs = (double)result.elapsed_ns / 1000000000.0;
+  std::cout << "    {\"width\": " << width
+    << ", \"width_after\": " << width_after
+    << ", \"ops\": " << result.ops
+    << ", \"errors\": " << result.errors
+    << ", \"ops_per_sec\": " << (double)result.ops / secs
+    << ", \"latency_us\": {"
+    << "\"mean\": " << hdr_mean(h) / 1000.0
+    << ", \"p50\": " << hdr_value_at_percentile(h, 50.0) / 1000.0
+    << ", \"p99\": " << hdr_value_at_percentile(h, 99.0) / 1000.0
+    << ", \"p999\": " << hdr_value_at_percentile(h, 99.9) / 1000.0
+    << ", \"max\": " << hdr_max(h) / 1000.0
+    << "}}" << (last ? "" : ",") << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string scheme;
+  std::vector<std::string> params;
+  std::string widths_list;
+  int num_threads;
+  int runtime;
+  int entry_size;
+  int entries_per_object;
+  int widen_rate;
+  int widen_max_width;
+
+  po::options_description opts("Stripe width benchmark options");
+  opts.add_options()
+    ("help,h", "show help message")
+    ("scheme", po::value<std::string>(&scheme)->default_value("ram"), "Backend (ram, lmdb, ceph)")
+    ("param", po::value<std::vector<std::string>>(&params), "Backend option key=value (repeatable)")
+    ("widths", po::value<std::string>(&widths_list)->default_value("1,4,16"), "Stripe width of each run")
+    ("threads,t", po::value<int>(&num_threads)->default_value(16), "Client threads")
+    ("runtime,r", po::value<int>(&runtime)->default_value(10), "Seconds per run")
+    ("entry-size", po::value<int>(&entry_size)->default_value(1024), "Bytes per entry")
+    ("entries-per-object", po::value<int>(&entries_per_object)->default_value(200), "Entries stored in each object")
+    ("widen-rate", po::value<int>(&widen_rate)->default_value(0), "Appends per second per object that widen the stripe (0 disables)")
+    ("widen-max-width", po::value<int>(&widen_max_width)->default_value(64), "Widest stripe the log widens to")
+  ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, opts), vm);
+
+  if (vm.count("help")) {
+    std::cout << opts << std::endl;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  if (num_threads <= 0 || runtime <= 0 || entry_size <= 0 ||
+      entries_per_object <= 0 || widen_rate < 0 || widen_max_width <= 0) {
+    std::cerr << "invalid options" << std::endl;
+    return 1;
+  }
+
+  std::map<std::string, std::string> backend_opts;
+  for (auto& param : params) {
+    auto pos = param.find('=');
+    if (pos == std::string::npos) {
+      std::cerr << "invalid param " << param << std::endl;
+      return 1;
+    }
+    backend_opts[param.substr(0, pos)] = param.substr(pos + 1);
+  }
+
+  const auto widths = parse_list(widths_list);
+
+  zlog::Options options;
+  options.width = widths[0];
+  options.entries_per_object = entries_per_object;
+  options.max_entry_size = entry_size;
+  options.stripe_widen_rate = widen_rate;
+  options.stripe_widen_max_width = widen_max_width;
+
+  // each run uses a new log
+  std::stringstream name;
+  name << "stripe_bench." << boost::uuids::random_generator()();
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(options, scheme, name.str(), backend_opts,
+      "", "", &log);
+  if (ret) {
+    std::cerr << "failed to create log " << ret << std::endl;
+    return 1;
+  }
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  Bench bench(log, num_threads, runtime, entry_size);
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "{" << std::endl
+    << "  \"scheme\": \"" << scheme << "\"," << std::endl
+    << "  \"threads\": " << num_threads << "," << std::endl
+    << "  \"runtime_sec\": " << runtime << "," << std::endl
+    << "  \"entry_size\": " << entry_size << "," << std::endl
+    << "  \"entries_per_object\": " << entries_per_object << "," << std::endl
+    << "  \"widen_rate\": " << widen_rate << "," << std::endl
+    << "  \"results\": [" << std::endl;
+
+  for (size_t i = 0; i < widths.size(); i++) {
+    const int width = widths[i];
+    if (log->StripeWidth() != width) {
+      ret = impl->SetStripeWidth(width);
+      if (ret) {
+        std::cerr << "failed to set width " << width << " ret " << ret
+          << std::endl;
+        return 1;
+      }
+    }
+
+    std::cerr << "running width " << width << std::endl;
+
+    Result result;
+    bench.Run(&result);
+
+    print_result(width, log->StripeWidth(), result, i + 1 == widths.size());
+    hdr_close(result.histogram);
+  }
+
+  std::cout << "  ]" << std::endl << "}" << std::endl;
+
+  delete log;
+
+  return 0;
+}
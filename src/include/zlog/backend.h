@@ -1,9 +1,11 @@
 #pragma once
+#include <cerrno>
 #include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include "zlog/slice.h"
 
 namespace zlog {
@@ -67,12 +69,15 @@ class Backend {
   // view management
  public:
 
-  // Read log views.
+  // Read the log views starting at epoch, up to max_views of them. Fewer
+  // views are returned when the latest view is reached, and none when epoch is
+  // past the latest view.
   //
   // -ENOENT
   //   - object not initialized (or doens't exist)
   virtual int ReadViews(const std::string& hoid,
-      uint64_t epoch, std::map<uint64_t, std::string>& views) = 0;
+      uint64_t epoch, uint32_t max_views,
+      std::map<uint64_t, std::string>& views) = 0;
 
   // Create a new view.
   //
@@ -82,6 +87,49 @@ class Backend {
   virtual int ProposeView(const std::string& hoid,
       uint64_t epoch, const std::string& view) = 0;
 
+  // Register a callback that is invoked after a view may have been added to
+  // a log, so that clients can refresh their views before an operation fails
+  // with a stale epoch. Notifications may be spurious, and several changes may
+  // be reported once. The callback may be invoked by a backend thread or by
+  // the client proposing the view, and must not block or call into the
+  // backend. On success the cookie identifies the watch.
+  //
+  // -EOPNOTSUPP
+  //   - the backend doesn't report view changes
+  virtual int WatchViews(const std::string& hoid,
+      std::function<void()> callback, uint64_t *cookie) {
+    return -EOPNOTSUPP;
+  }
+
+  // Remove a watch. The callback isn't invoked after this returns.
+  virtual int UnwatchViews(uint64_t cookie) {
+    return -EOPNOTSUPP;
+  }
+
+  // view checkpoints
+ public:
+
+  // Store an opaque checkpoint of the views of a log, replacing any existing
+  // checkpoint. A client opening the log loads the checkpoint and reads only
+  // the views that were created after it.
+  //
+  // -EOPNOTSUPP
+  //   - the backend doesn't store checkpoints
+  virtual int WriteViewCheckpoint(const std::string& hoid,
+      const std::string& data) {
+    return -EOPNOTSUPP;
+  }
+
+  // Read the view checkpoint of a log.
+  //
+  // -ENOENT
+  //   - no checkpoint has been stored
+  // -EOPNOTSUPP
+  //   - the backend doesn't store checkpoints
+  virtual int ReadViewCheckpoint(const std::string& hoid, std::string *data) {
+    return -EOPNOTSUPP;
+  }
+
   // log data interfaces
  public:
 
@@ -95,6 +143,48 @@ class Backend {
       uint64_t position, uint32_t stride, uint32_t max_size,
       std::string *data) = 0;
 
+  // Read a log entry, and pin it instead of copying it when the backend can
+  // keep its storage alive. The pin must be released before the backend is
+  // destroyed. The default copies the entry with Read().
+  //
+  // See Read() for return codes.
+  virtual int ReadPinned(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t stride, uint32_t max_size,
+      PinnedSlice *data) {
+    auto entry = std::make_shared<std::string>();
+    int ret = Read(oid, epoch, position, stride, max_size, entry.get());
+    if (ret)
+      return ret;
+    *data = PinnedSlice(std::move(entry));
+    return 0;
+  }
+
+  // Read count entries of an object, at position, position + stride, and so
+  // on, which are the positions that the object stores in a stripe of width
+  // stride. results[i] is set as the return value of Read() for the i-th
+  // position, and data[i] to its entry when results[i] is 0. The default
+  // reads each entry with Read().
+  //
+  // -ESPIPE
+  //   - stale epoch, in which case no results are returned
+  virtual int ReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data) {
+    results->assign(count, 0);
+    data->assign(count, std::string());
+    for (uint32_t i = 0; i < count; i++) {
+      int ret = Read(oid, epoch, position + (uint64_t)i * stride, stride,
+          max_size, &(*data)[i]);
+      if (ret == -ESPIPE) {
+        results->clear();
+        data->clear();
+        return ret;
+      }
+      (*results)[i] = ret;
+    }
+    return 0;
+  }
+
   // Write a log entry.
   //
   // -EROFS
@@ -135,11 +225,31 @@ class Backend {
       std::string *data, void *arg,
       std::function<void(void*, int)> callback) = 0;
 
+  // See ReadRange(). The default completes the read before returning.
+  virtual int AioReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data, void *arg,
+      std::function<void(void*, int)> callback) {
+    int ret = ReadRange(oid, epoch, position, count, stride, max_size,
+        results, data);
+    callback(arg, ret);
+    return 0;
+  }
+
   // See Write()
   virtual int AioWrite(const std::string& oid, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size,
       const Slice& data, void *arg,
       std::function<void(void*, int)> callback) = 0;
+
+  // See Seal()
+  virtual int AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+      std::function<void(void*, int)> callback) = 0;
+
+  // See MaxPos(). pos and empty are set before the callback is invoked.
+  virtual int AioMaxPos(const std::string& oid, uint64_t epoch,
+      uint64_t *pos, bool *empty, void *arg,
+      std::function<void(void*, int)> callback) = 0;
 };
 
 }
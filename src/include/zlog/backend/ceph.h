@@ -1,5 +1,8 @@
 #pragma once
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <rados/librados.hpp>
 #include "zlog/backend.h"
 
@@ -25,15 +28,30 @@ class CephBackend : public Backend {
       std::string& hoid, std::string& prefix) override;
 
   int ReadViews(const std::string& hoid, uint64_t epoch,
-      std::map<uint64_t, std::string>& views) override;
+      uint32_t max_views, std::map<uint64_t, std::string>& views) override;
 
   int ProposeView(const std::string& hoid,
       uint64_t epoch, const std::string& view) override;
 
+  int WatchViews(const std::string& hoid,
+      std::function<void()> callback, uint64_t *cookie) override;
+
+  int UnwatchViews(uint64_t cookie) override;
+
+  int WriteViewCheckpoint(const std::string& hoid,
+      const std::string& data) override;
+
+  int ReadViewCheckpoint(const std::string& hoid,
+      std::string *data) override;
+
   int Read(const std::string& oid, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size,
       std::string *data) override;
 
+  int ReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data) override;
+
   int Write(const std::string& oid, const Slice& data,
       uint64_t epoch, uint64_t position, uint32_t stride,
       uint32_t max_size) override;
@@ -60,6 +78,18 @@ class CephBackend : public Backend {
       std::string *data, void *arg,
       std::function<void(void*, int)> callback) override;
 
+  int AioReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data, void *arg,
+      std::function<void(void*, int)> callback) override;
+
+  int AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+      std::function<void(void*, int)> callback) override;
+
+  int AioMaxPos(const std::string& oid, uint64_t epoch,
+      uint64_t *pos, bool *empty, void *arg,
+      std::function<void(void*, int)> callback) override;
+
  private:
   struct AioContext {
     librados::AioCompletion *c;
@@ -67,16 +97,59 @@ class CephBackend : public Backend {
     std::function<void(void*, int)> cb;
     ::ceph::bufferlist bl;
     std::string *data;
+    int rv;
+  };
+
+  // the reads of a range are made in one operation, and each read that fails
+  // leaves the others to complete
+  struct RangeReadContext {
+    librados::AioCompletion *c;
+    void *arg;
+    std::function<void(void*, int)> cb;
+    std::vector<::ceph::bufferlist> bls;
+    std::vector<int> rvs;
+    std::vector<int> *results;
+    std::vector<std::string> *data;
+  };
+
+  static void PrepareRangeRead(librados::ObjectReadOperation& op,
+      RangeReadContext *c, uint64_t epoch, uint64_t position, uint32_t count,
+      uint32_t stride, uint32_t max_size);
+  static int FinishRangeRead(RangeReadContext *c, int ret);
+
+  // a watch on the head object of a log, which is notified when a view is
+  // proposed
+  class ViewsWatch : public librados::WatchCtx2 {
+   public:
+    ViewsWatch(librados::IoCtx *ioctx, const std::string& hoid,
+        std::function<void()> callback) :
+      ioctx_(ioctx), hoid_(hoid), callback_(std::move(callback))
+    {}
+
+    void handle_notify(uint64_t notify_id, uint64_t cookie,
+        uint64_t notifier_id, ::ceph::bufferlist& bl) override;
+
+    void handle_error(uint64_t cookie, int err) override;
+
+   private:
+    librados::IoCtx *ioctx_;
+    const std::string hoid_;
+    const std::function<void()> callback_;
   };
 
   std::map<std::string, std::string> options;
 
+  std::mutex watch_lock_;
+  std::map<uint64_t, std::unique_ptr<ViewsWatch>> watches_;
+
   librados::Rados *cluster_;
   librados::IoCtx *ioctx_;
   std::string pool_;
 
   static void aio_safe_cb_append(librados::completion_t cb, void *arg);
   static void aio_safe_cb_read(librados::completion_t cb, void *arg);
+  static void aio_safe_cb_max_pos(librados::completion_t cb, void *arg);
+  static void aio_safe_cb_read_range(librados::completion_t cb, void *arg);
 
   static std::string LinkObjectName(const std::string& name);
 
@@ -1,8 +1,15 @@
 #pragma once
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
 #include <vector>
 #include <sstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <lmdb.h>
 #include "zlog/backend.h"
 
@@ -33,15 +40,34 @@ class LMDBBackend : public Backend {
       std::string& hoid, std::string& prefix) override;
 
   int ReadViews(const std::string& hoid, uint64_t epoch,
-      std::map<uint64_t, std::string>& views) override;
+      uint32_t max_views, std::map<uint64_t, std::string>& views) override;
 
   int ProposeView(const std::string& hoid,
       uint64_t epoch, const std::string& view) override;
 
+  int WatchViews(const std::string& hoid,
+      std::function<void()> callback, uint64_t *cookie) override;
+
+  int UnwatchViews(uint64_t cookie) override;
+
+  int WriteViewCheckpoint(const std::string& hoid,
+      const std::string& data) override;
+
+  int ReadViewCheckpoint(const std::string& hoid,
+      std::string *data) override;
+
   int Read(const std::string& oid, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size,
       std::string *data) override;
 
+  int ReadPinned(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t stride, uint32_t max_size,
+      PinnedSlice *data) override;
+
+  int ReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data) override;
+
   int Write(const std::string& oid, const Slice& data,
       uint64_t epoch, uint64_t position, uint32_t stride,
       uint32_t max_size) override;
@@ -68,6 +94,13 @@ class LMDBBackend : public Backend {
       std::string *data, void *arg,
       std::function<void(void*, int)> callback) override;
 
+  int AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+      std::function<void(void*, int)> callback) override;
+
+  int AioMaxPos(const std::string& oid, uint64_t epoch,
+      uint64_t *pos, bool *empty, void *arg,
+      std::function<void(void*, int)> callback) override;
+
  private:
   std::map<std::string, std::string> options;
   MDB_env *env;
@@ -93,6 +126,37 @@ class LMDBBackend : public Backend {
     LogEntry() : trimmed(false), invalidated(false) {}
   };
 
+  // keys are built on the stack. lmdb limits keys to 511 bytes by default.
+  struct Key {
+    char buf[512];
+    size_t size;
+
+    explicit Key(const std::string& oid) : size(oid.size()) {
+      assert(size < sizeof(buf));
+      memcpy(buf, oid.data(), size);
+    }
+
+    Key(const std::string& oid, const char *suffix) : Key(oid) {
+      int ret = snprintf(buf + size, sizeof(buf) - size, "%s", suffix);
+      assert(ret >= 0 && size + ret < sizeof(buf));
+      size += ret;
+    }
+
+    Key(const std::string& oid, uint64_t position) : Key(oid) {
+      int ret = snprintf(buf + size, sizeof(buf) - size, ".%" PRIu64,
+          position);
+      assert(ret >= 0 && size + ret < sizeof(buf));
+      size += ret;
+    }
+
+    MDB_val val() const {
+      MDB_val k;
+      k.mv_size = size;
+      k.mv_data = (void*)buf;
+      return k;
+    }
+  };
+
   struct Transaction {
     MDB_txn *txn;
     LMDBBackend *be;
@@ -119,10 +183,24 @@ class LMDBBackend : public Backend {
       return mdb_txn_commit(txn);
     }
 
+    // hand off the open transaction to the caller
+    MDB_txn *Release() {
+      closed = true;
+      return txn;
+    }
+
     int Get(const std::string& key, MDB_val& val) {
       MDB_val k;
       k.mv_size = key.size();
       k.mv_data = (void*)key.data();
+      return Get(k, val);
+    }
+
+    int Get(const Key& key, MDB_val& val) {
+      return Get(key.val(), val);
+    }
+
+    int Get(MDB_val k, MDB_val& val) {
       int ret = mdb_get(txn, be->db_obj, &k, &val);
       assert(ret == 0 || ret == MDB_NOTFOUND);
       if (ret == MDB_NOTFOUND)
@@ -134,7 +212,22 @@ class LMDBBackend : public Backend {
       MDB_val k;
       k.mv_size = key.size();
       k.mv_data = (void*)key.data();
-      int flags = exclusive ? MDB_NOOVERWRITE : 0;
+      return Put(k, val, exclusive ? MDB_NOOVERWRITE : 0);
+    }
+
+    int Put(const Key& key, MDB_val& val, bool exclusive) {
+      return Put(key.val(), val, exclusive ? MDB_NOOVERWRITE : 0);
+    }
+
+    // reserve size bytes for a new value which the caller fills in through
+    // val.mv_data before the transaction is committed.
+    int Reserve(const Key& key, size_t size, MDB_val& val) {
+      val.mv_size = size;
+      val.mv_data = nullptr;
+      return Put(key.val(), val, MDB_NOOVERWRITE | MDB_RESERVE);
+    }
+
+    int Put(MDB_val k, MDB_val& val, int flags) {
       int ret = mdb_put(txn, be->db_obj, &k, &val, flags);
       assert(ret == 0 || ret == MDB_KEYEXIST);
       if (ret == MDB_KEYEXIST)
@@ -153,25 +246,32 @@ class LMDBBackend : public Backend {
 
   Transaction NewTransaction(bool read_only = false);
 
-  std::string LogEntryKey(const std::string& oid,
+  // read-only transactions that pin entries for ReadPinned. a transaction is
+  // reset when its pin is released, and kept to be renewed by a later read.
+  // null is returned when no reader slot is free.
+  MDB_txn *NewPinTransaction();
+  void ReleasePinTransaction(MDB_txn *txn);
+
+  Key LogEntryKey(const std::string& oid,
       uint64_t position)
   {
-    std::stringstream ss;
-    ss << oid << "." << position;
-    return ss.str();
+    return Key(oid, position);
   }
 
-  std::string MaxPosKey(const std::string& oid)
+  Key MaxPosKey(const std::string& oid)
   {
-    std::stringstream ss;
-    ss << oid << ".maxpos";
-    return ss.str();
+    return Key(oid, ".maxpos");
+  }
+
+  Key ObjectKey(const std::string& oid)
+  {
+    return Key(oid);
   }
 
-  std::string ObjectKey(const std::string& oid)
+  std::string ViewCheckpointKey(const std::string& oid)
   {
     std::stringstream ss;
-    ss << oid;
+    ss << oid << ".view_checkpoint";
     return ss.str();
   }
 
@@ -185,8 +285,31 @@ class LMDBBackend : public Backend {
   int CheckEpoch(Transaction& txn, uint64_t epoch, const std::string& oid,
       bool eq = false);
 
+  // the watches in this process are invoked directly. other processes are
+  // notified by rewriting the views file in the database directory, which
+  // each process with watches monitors with inotify.
+  void NotifyViews(const std::string& hoid);
+  int StartViewsFileWatch();
+  void StopViewsFileWatch();
+  void WatchViewsFile();
+
  private:
   bool closed = false;
+
+  // watches are invoked with watch_lock held, so that a watch isn't invoked
+  // once it's removed
+  std::mutex watch_lock;
+  uint64_t next_watch_cookie = 0;
+  std::map<uint64_t,
+    std::pair<std::string, std::function<void()>>> watches;
+
+  std::mutex pin_txns_lock;
+  std::vector<MDB_txn*> pin_txns;
+  static const size_t max_pin_txns = 16;
+
+  int views_file_fd = -1;
+  int views_file_stop_fd = -1;
+  std::thread views_file_thread;
 };
 
 }
@@ -15,7 +15,8 @@ namespace ram {
 class RAMBackend : public Backend {
  public:
   RAMBackend() :
-    options_{{"scheme", "ram"}}
+    options_{{"scheme", "ram"}},
+    next_watch_cookie_(0)
   {}
 
   ~RAMBackend();
@@ -31,15 +32,34 @@ class RAMBackend : public Backend {
       std::string& hoid, std::string& prefix) override;
 
   int ReadViews(const std::string& hoid, uint64_t epoch,
-      std::map<uint64_t, std::string>& views) override;
+      uint32_t max_views, std::map<uint64_t, std::string>& views) override;
 
   int ProposeView(const std::string& hoid,
       uint64_t epoch, const std::string& view) override;
 
+  int WatchViews(const std::string& hoid,
+      std::function<void()> callback, uint64_t *cookie) override;
+
+  int UnwatchViews(uint64_t cookie) override;
+
+  int WriteViewCheckpoint(const std::string& hoid,
+      const std::string& data) override;
+
+  int ReadViewCheckpoint(const std::string& hoid,
+      std::string *data) override;
+
   int Read(const std::string& oid, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size,
       std::string *data) override;
 
+  int ReadPinned(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t stride, uint32_t max_size,
+      PinnedSlice *data) override;
+
+  int ReadRange(const std::string& oid, uint64_t epoch,
+      uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data) override;
+
   int Write(const std::string& oid, const Slice& data,
       uint64_t epoch, uint64_t position, uint32_t stride,
       uint32_t max_size) override;
@@ -66,17 +86,29 @@ class RAMBackend : public Backend {
       std::string *data, void *arg,
       std::function<void(void*, int)> callback) override;
 
+  int AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+      std::function<void(void*, int)> callback) override;
+
+  int AioMaxPos(const std::string& oid, uint64_t epoch,
+      uint64_t *pos, bool *empty, void *arg,
+      std::function<void(void*, int)> callback) override;
+
  private:
   struct ProjectionObject {
-    ProjectionObject() : latest_epoch(0) {}
+    ProjectionObject() :
+      latest_epoch(0), has_view_checkpoint(false)
+    {}
     uint64_t latest_epoch;
     std::unordered_map<uint64_t, std::string> projections;
+    bool has_view_checkpoint;
+    std::string view_checkpoint;
   };
 
   struct LogEntry {
     bool trimmed;
     bool invalidated;
-    std::string data;
+    // shared with the readers that pinned the entry
+    std::shared_ptr<const std::string> data;
     LogEntry() : trimmed(false), invalidated(false) {}
   };
 
@@ -91,11 +123,20 @@ class RAMBackend : public Backend {
   int CheckEpoch(uint64_t epoch, const std::string& oid,
       bool eq, LogObject*& lobj);
 
+  void NotifyViews(const std::string& hoid);
+
  private:
   mutable std::mutex lock_;
   std::map<std::string, std::string> options_;
   std::map<std::string,
     boost::variant<ProjectionObject, LogObject>> objects_;
+
+  // watches are invoked with watch_lock_ held, so that a watch isn't invoked
+  // once it's removed
+  std::mutex watch_lock_;
+  uint64_t next_watch_cookie_;
+  std::map<uint64_t,
+    std::pair<std::string, std::function<void()>>> watches_;
 };
 
 }
@@ -3,6 +3,7 @@
 #include<sstream>
 #include<iostream>
 #include<unordered_map>
+#include<memory>
 #include<mutex>
 #include"zlog/eviction/lru.h"
 #include"zlog/eviction/arc.h"
@@ -34,9 +35,11 @@ class Cache{
 
     int put(uint64_t pos, const Slice& data);    
     int get(uint64_t* pos, std::string* data);
+    int get(uint64_t* pos, PinnedSlice* data);
     int remove(uint64_t* pos);
 
-    std::unordered_map<uint64_t, zlog_mempool::cache::string> cache_map; //FIX
+    std::unordered_map<uint64_t,
+      std::shared_ptr<const zlog_mempool::cache::string>> cache_map; //FIX
 
 
   private:
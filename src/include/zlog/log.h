@@ -1,9 +1,11 @@
 #pragma once
+#include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 #include "slice.h"
 #include "options.h"
 
@@ -22,24 +24,79 @@ class AioCompletion {
   virtual int ReturnValue() = 0;
 };
 
+// Follows a log from a position, returning the entries in position order as
+// they are written. Positions that were filled or trimmed are skipped. See
+// Log::OpenTailIterator.
+class TailIterator {
+ public:
+  virtual ~TailIterator();
+
+  // Wait for the next entry for at most timeout, and return its position and
+  // data. -ETIMEDOUT is returned if no entry was available in time, and the
+  // next call continues from the same position.
+  virtual int Next(std::chrono::milliseconds timeout, uint64_t *position,
+      std::string *data) = 0;
+
+  // The position the next entry is returned from, or after.
+  virtual uint64_t Position() const = 0;
+};
+
 class Log {
  public:
   Log() {}
   virtual ~Log();
 
+  // The position reported for an entry of a batch that wasn't appended
+  static const uint64_t invalid_position;
+
   /*
    * Synchronous API
    */
   virtual int Append(const Slice& data, uint64_t *pposition = NULL) = 0;
+  // Append each entry in data. The sequencer is contacted once for many
+  // positions rather than once per entry, and positions[i] is set to the
+  // position of data[i]. Positions are not guaranteed to be contiguous. If the
+  // append fails, positions is still set, and the entries that weren't
+  // appended have invalid_position.
+  virtual int AppendBatch(const std::vector<Slice>& data,
+      std::vector<uint64_t> *positions = NULL) = 0;
   virtual int Read(uint64_t position, std::string *data) = 0;
+  // Read an entry without copying it when the storage can be shared. The data
+  // stays valid until the slice is reset or destroyed, which must happen
+  // before the log is deleted.
+  virtual int ReadPinned(uint64_t position, PinnedSlice *data) = 0;
+  // Read the positions in [begin, end) in order. The callback is invoked for
+  // each position with 0 and the entry, with -ENODATA if the position was
+  // filled or trimmed, or with -ENOENT if it hasn't been written. Reads of
+  // the positions that follow are kept in flight across the objects of the
+  // stripe (see Options::read_range_window). A callback that returns non-zero
+  // stops the read, and its value is returned.
+  virtual int ReadRange(uint64_t begin, uint64_t end,
+      std::function<int(uint64_t, int, const Slice&)> callback) = 0;
   virtual int Fill(uint64_t position) = 0;
   virtual int CheckTail(uint64_t *pposition) = 0;
+  // Wait until the tail is past position after, that is, until after has
+  // been handed out to a writer, or until timeout expires. The tail is
+  // returned in tail, also when the wait times out with -ETIMEDOUT. A reader
+  // following the log waits on the tail it has read up to instead of polling
+  // CheckTail.
+  virtual int WaitForTail(uint64_t after, std::chrono::milliseconds timeout,
+      uint64_t *tail) = 0;
+  // Follow the log from position start. The iterator reads ahead of the
+  // entries it returns up to the tail (see Options::tail_readahead), and
+  // waits on the sequencer only once it has caught up with the tail. A
+  // position that was handed out but isn't written within
+  // Options::tail_hole_timeout_ms is filled. The iterator must be deleted
+  // before the log.
+  virtual int OpenTailIterator(uint64_t start, TailIterator **iterator) = 0;
   virtual int Trim(uint64_t position) = 0;
 
   /*
    * Asynchronous API
    */
   virtual int AioAppend(AioCompletion *c, const Slice& data, uint64_t *pposition = NULL) = 0;
+  virtual int AioAppendBatch(AioCompletion *c, const std::vector<Slice>& data,
+      std::vector<uint64_t> *positions = NULL) = 0;
   virtual int AioRead(uint64_t position, AioCompletion *c, std::string *datap) = 0;
 
   static AioCompletion *aio_create_completion();
@@ -93,4 +150,9 @@ class Log {
 
 };
 
+// Read the tails of many logs. The logs whose sequencer is the same server
+// are queried together, with a few requests rather than one per log. On
+// return tails[i] is the tail of logs[i], and the first error is returned.
+int CheckTails(const std::vector<Log*>& logs, std::vector<uint64_t> *tails);
+
 }
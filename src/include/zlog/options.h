@@ -11,9 +11,9 @@ class Statistics;
 
 struct Options {
   // Number of objects to stripe the log across. This value is used to configure
-  // a new log, and can be adjusted for a log after it has been created.
+  // a new log, and can be adjusted for a log after it has been created (see
+  // LogImpl::SetStripeWidth, zlog_tool --set-width and stripe_widen_rate).
   // TODO: create an intelligent default
-  // TODO: add reference to width adjustment api/tools
   // TODO: add option for create vs open (default and force new width)
   int width = 10;
 
@@ -21,6 +21,58 @@ struct Options {
 
   int max_entry_size = 1024;
 
+  // Number of connections opened to the sequencer. Requests are pipelined on
+  // each connection, and every thread is assigned to one of them.
+  int seqr_channels = 5;
+
+  // Sequencer protocol version. Version 2 registers the log once per
+  // connection and sends compact binary requests. Use version 1 with a
+  // sequencer that doesn't support version 2.
+  int seqr_protocol = 2;
+
+  // Number of positions reserved from the sequencer at a time and handed out
+  // locally to appends. Unused positions are filled when the lease is dropped.
+  // Values below 2 disable leases. At most 64.
+  int seqr_lease_size = 0;
+
+  // Use a sequencer in shared memory instead of the exclusive mode when a log
+  // is created or opened without a sequencer host. Processes on the same host
+  // that open the log this way share the sequencer. All writers of the log
+  // must run on one host.
+  bool seqr_shm = false;
+
+  // The next view is proposed in the background once the tail gets within
+  // this many positions of the end of the mapped log, so that appends don't
+  // wait for the map to be extended. Zero disables the background extension.
+  int map_extend_distance = 1000;
+
+  // A checkpoint of the views is written each time this many epochs have
+  // been created, so that opening the log doesn't replay every view. Zero
+  // disables view checkpoints.
+  int view_checkpoint_interval = 1000;
+
+  // The stripe width is doubled, up to stripe_widen_max_width, when the
+  // appends to the log exceed this many per second for each object in the
+  // stripe. The rate is sampled every stripe_widen_interval_ms. Zero disables
+  // widening the stripe.
+  int stripe_widen_rate = 0;
+  int stripe_widen_max_width = 64;
+  int stripe_widen_interval_ms = 1000;
+
+  // Number of backend reads kept in flight by Log::ReadRange. Each read
+  // returns the entries of one object in a stripe.
+  int read_range_window = 16;
+
+  // Number of positions that a TailIterator reads ahead of the entries it
+  // returns.
+  int tail_readahead = 1024;
+
+  // A position that has been handed out by the sequencer, and is still not
+  // written after this many milliseconds, is filled by a TailIterator waiting
+  // on it, so that a writer that failed doesn't stall the readers. Zero
+  // disables filling.
+  int tail_hole_timeout_ms = 1000;
+
   Statistics* statistics = nullptr;
   std::vector<std::string> http;
   
@@ -20,7 +20,9 @@
 #include <cstdio>
 #include <stddef.h>
 #include <string.h>
+#include <memory>
 #include <string>
+#include <utility>
 
 namespace zlog {
 
@@ -120,6 +122,30 @@ class Slice {
   // Intentionally copyable
 };
 
+// A Slice that keeps its storage alive, such as an entry held by a backend or
+// the cache, so that the data can be used without being copied. Copies of a
+// PinnedSlice share the pin, and the storage is released with the last one.
+class PinnedSlice : public Slice {
+ public:
+  PinnedSlice() {}
+
+  PinnedSlice(const char* d, size_t n, std::shared_ptr<const void> pin) :
+    Slice(d, n), pin_(std::move(pin)) { }
+
+  // Pin a string that is shared with its owner
+  explicit PinnedSlice(std::shared_ptr<const std::string> s) :
+    Slice(*s), pin_(std::move(s)) { }
+
+  // Drop the pin and refer to an empty array
+  void Reset() {
+    pin_.reset();
+    clear();
+  }
+
+ private:
+  std::shared_ptr<const void> pin_;
+};
+
 // A set of Slices that are virtually concatenated together.  'parts' points
 // to an array of Slices.  The number of elements in the array is 'num_parts'.
 struct SliceParts {
@@ -12,20 +12,31 @@ enum Tickers : uint32_t {
   CACHE_REQS,
   CACHE_MISSES,
 
+  // operations that waited for the map to be extended
+  MAP_EXTEND_STALLS,
+
   TICKER_ENUM_MAX
 };
 
 const std::vector<std::pair<Tickers, std::string>> TickersNameMap = {
 
   {CACHE_REQS, "zlog_cache_reqs"},
-  {CACHE_MISSES, "zlog_cache_misses"}
+  {CACHE_MISSES, "zlog_cache_misses"},
+  {MAP_EXTEND_STALLS, "zlog_map_extend_stalls"}
 };
 
 enum Histograms : uint32_t {
+  // time an operation waited for the map to be extended
+  MAP_EXTEND_STALL_MICROS,
+  // time to seal the stripes and find the max position of the log in a cut
+  CUT_SEAL_MICROS,
+
   HISTOGRAM_ENUM_MAX,  // TODO(ldemailly): enforce HistogramsNameMap match
 };
 
 const std::vector<std::pair<Histograms, std::string>> HistogramsNameMap = {
+  {MAP_EXTEND_STALL_MICROS, "zlog_map_extend_stall_micros"},
+  {CUT_SEAL_MICROS, "zlog_cut_seal_micros"}
 };
 
 struct HistogramData {
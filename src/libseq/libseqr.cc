@@ -1,83 +1,865 @@
+#include <algorithm>
 #include <set>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <thread>
+#include <arpa/inet.h>
 #include <boost/asio.hpp>
 #include "libseqr.h"
+#include "seqr_frame.h"
 #include "proto/zlog.pb.h"
 
 namespace zlog {
 
+namespace {
+
+// the event loop shared by all sequencer clients. it is never torn down:
+// clients may be released from within one of its own handlers, and requests
+// may still be draining when the process exits.
+class EventLoop {
+ public:
+  EventLoop() :
+    work_(io_service_),
+    thread_([this] { io_service_.run(); })
+  {}
+
+  boost::asio::io_service& io_service() {
+    return io_service_;
+  }
+
+  bool InLoopThread() const {
+    return std::this_thread::get_id() == thread_.get_id();
+  }
+
+ private:
+  boost::asio::io_service io_service_;
+  boost::asio::io_service::work work_;
+  std::thread thread_;
+};
+
+EventLoop& event_loop()
+{
+  static EventLoop *loop = new EventLoop;
+  return *loop;
+}
+
+// threads are assigned to channels round robin the first time they submit a
+// request. a thread sticks to its channel, which spreads threads evenly over
+// the channels and keeps the requests of one thread in order.
+unsigned thread_slot()
+{
+  static std::atomic<unsigned> next_slot(0);
+  static thread_local unsigned slot = next_slot++;
+  return slot;
+}
+
+// a handler whose memory comes from a HandlerMemory. the handler keeps the
+// owner of the memory alive.
+template <typename Memory, typename Handler>
+class MemoryHandler {
+ public:
+  MemoryHandler(Memory& memory, Handler handler) :
+    memory_(memory), handler_(std::move(handler))
+  {}
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+  friend void *asio_handler_allocate(size_t size, MemoryHandler *h) {
+    return h->memory_.allocate(size);
+  }
+
+  friend void asio_handler_deallocate(void *p, size_t size,
+      MemoryHandler *h) {
+    h->memory_.deallocate(p);
+  }
+
+ private:
+  Memory& memory_;
+  Handler handler_;
+};
+
+template <typename Memory, typename Handler>
+MemoryHandler<Memory, Handler> make_handler(Memory& memory, Handler handler)
+{
+  return MemoryHandler<Memory, Handler>(memory, std::move(handler));
+}
+
+// a buffer sequence that refers to a vector of buffers. async_write keeps a
+// copy of its buffer sequence, and copying the vector would allocate.
+class BufferView {
+ public:
+  typedef boost::asio::const_buffer value_type;
+  typedef std::vector<boost::asio::const_buffer>::const_iterator
+    const_iterator;
+
+  explicit BufferView(const std::vector<boost::asio::const_buffer>& buffers) :
+    buffers_(&buffers)
+  {}
+
+  const_iterator begin() const {
+    return buffers_->begin();
+  }
+
+  const_iterator end() const {
+    return buffers_->end();
+  }
+
+ private:
+  const std::vector<boost::asio::const_buffer> *buffers_;
+};
+
+// waits for count asynchronous requests to complete, and returns the first
+// error. a callback running on the event loop thread may make a synchronous
+// request, in which case the loop is driven from here until the replies
+// arrive.
+class Waiter {
+ public:
+  explicit Waiter(size_t count = 1) : count_(count), ret_(0) {}
+
+  void complete(int ret) {
+    std::lock_guard<std::mutex> l(lock_);
+    if (!ret_)
+      ret_ = ret;
+    if (--count_ == 0)
+      cond_.notify_one();
+  }
+
+  int wait() {
+    auto& loop = event_loop();
+    if (loop.InLoopThread()) {
+      while (count_ > 0)
+        loop.io_service().run_one();
+      return ret_;
+    }
+
+    std::unique_lock<std::mutex> l(lock_);
+    cond_.wait(l, [this] { return count_ == 0; });
+    return ret_;
+  }
+
+ private:
+  std::mutex lock_;
+  std::condition_variable cond_;
+  size_t count_;
+  int ret_;
+};
+
+}
+
+static int frame_status(uint8_t status)
+{
+  switch (status) {
+    case zlog_proto::MSeqReply::OK:
+      return 0;
+    case zlog_proto::MSeqReply::INIT_LOG:
+      return -EAGAIN;
+    case zlog_proto::MSeqReply::STALE_EPOCH:
+      return -ERANGE;
+    default:
+      return -EIO;
+  }
+}
+
+// a request expects either a protobuf reply or, for protocol version 2
+// requests, a fixed size reply frame. the reply to a check tail or wait tail
+// request is handed to tail_done, which avoids wrapping the caller's
+// callback.
+struct SeqrClient::Request {
+  uint64_t id;
+  char buffer[1024];
+  size_t size;
+  std::function<void(int, zlog_proto::MSeqReply&)> done;
+  std::function<void(int, const seqr_frame::Reply&)> frame_done;
+  CheckTailCallback tail_done;
+
+  void complete(int ret, const seqr_frame::Reply& reply) {
+    if (tail_done) {
+      if (!ret)
+        ret = frame_status(reply.status);
+      tail_done(ret, ret ? 0 : reply.value);
+    } else {
+      frame_done(ret, reply);
+    }
+  }
+
+  void fail(int ret) {
+    if (done) {
+      zlog_proto::MSeqReply reply;
+      done(ret, reply);
+    } else {
+      seqr_frame::Reply reply;
+      complete(ret, reply);
+    }
+  }
+};
+
+SeqrClient::channel::~channel()
+{
+  for (auto r : free_requests)
+    delete r;
+}
+
+SeqrClient::Request *SeqrClient::NewRequest(
+    const std::shared_ptr<channel>& chan)
+{
+  {
+    std::lock_guard<std::mutex> l(chan->lock);
+    if (!chan->free_requests.empty()) {
+      Request *r = chan->free_requests.back();
+      chan->free_requests.pop_back();
+      return r;
+    }
+  }
+  return new Request;
+}
+
+// the callbacks are released first since they may hold a reference to the
+// channel.
+void SeqrClient::FreeRequest(const std::shared_ptr<channel>& chan,
+    Request *r)
+{
+  r->done = nullptr;
+  r->frame_done = nullptr;
+  r->tail_done = nullptr;
+
+  {
+    std::lock_guard<std::mutex> l(chan->lock);
+    if (chan->free_requests.size() < max_free_requests) {
+      chan->free_requests.push_back(r);
+      return;
+    }
+  }
+  delete r;
+}
+
+SeqrClient::~SeqrClient()
+{
+  // closing the socket cancels any outstanding operation, and the handlers
+  // release the channel.
+  for (auto chan : channels_) {
+    event_loop().io_service().post([chan] {
+      boost::system::error_code err;
+      chan->socket_.close(err);
+    });
+  }
+}
+
 void SeqrClient::Connect() {
-  for (channel *chan : channels_) {
-    boost::asio::ip::tcp::resolver resolver(chan->io_service_);
-    boost::asio::ip::tcp::resolver::query query(
-        boost::asio::ip::tcp::v4(), host_.c_str(), port_);
-    boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve(query);
+  auto& io_service = event_loop().io_service();
+  boost::asio::ip::tcp::resolver resolver(io_service);
+  boost::asio::ip::tcp::resolver::query query(
+      boost::asio::ip::tcp::v4(), host_.c_str(), port_);
+  boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve(query);
+  for (int i = 0; i < num_channels_; i++) {
+    auto chan = std::make_shared<channel>(io_service);
     chan->socket_.connect(*iterator);
+    channels_.push_back(chan);
+    io_service.post([chan] { StartRead(chan); });
   }
 }
 
-int SeqrClient::CheckTail(uint64_t epoch,
+void SeqrClient::Submit(zlog_proto::MSeqRequest& req,
+    std::function<void(int, zlog_proto::MSeqReply&)> done)
+{
+  if (channels_.empty()) {
+    zlog_proto::MSeqReply reply;
+    done(-ENOTCONN, reply);
+    return;
+  }
+
+  auto chan = channels_[thread_slot() % channels_.size()];
+
+  Request *r = NewRequest(chan);
+  r->done = std::move(done);
+
+  Submit(chan, r, &req);
+}
+
+// queue a request on a channel. a protobuf request is serialized once it has
+// been assigned an id, otherwise the request buffer holds an encoded frame
+// and only the id is filled in.
+void SeqrClient::Submit(std::shared_ptr<channel> chan, Request *r,
+    zlog_proto::MSeqRequest *req)
+{
+  bool start = false;
+  int ret = 0;
+  {
+    // ids are assigned in queue order, which is also the order in which the
+    // requests are written. servers that don't echo the id reply in order.
+    std::lock_guard<std::mutex> l(chan->lock);
+
+    if (chan->failed) {
+      ret = -EIO;
+    } else {
+      r->id = chan->next_id++;
+
+      if (req) {
+        req->set_id(r->id);
+
+        // serialize header and protobuf message
+        uint32_t msg_size = req->ByteSize();
+        uint32_t be_msg_size = htonl(msg_size);
+        r->size = msg_size + sizeof(be_msg_size);
+        assert(r->size <= sizeof(r->buffer));
+
+        // add header
+        memcpy(r->buffer, &be_msg_size, sizeof(be_msg_size));
+
+        // add protobuf msg
+        assert(req->IsInitialized());
+        if (!req->SerializeToArray(r->buffer + sizeof(be_msg_size), msg_size))
+          ret = -EIO;
+      } else {
+        seqr_frame::set_id(r->buffer, r->id);
+      }
+
+      if (!ret) {
+        chan->queue.push_back(r);
+        start = !chan->writing;
+        chan->writing = true;
+      }
+    }
+  }
+
+  if (ret) {
+    r->fail(ret);
+    FreeRequest(chan, r);
+    return;
+  }
+
+  if (start)
+    event_loop().io_service().post(make_handler(chan->start_write_memory,
+          [chan] { StartWrite(chan); }));
+}
+
+// write everything that has been queued since the last write completed. the
+// requests are waiting for a reply as soon as they are on the wire.
+void SeqrClient::StartWrite(std::shared_ptr<channel> chan)
+{
+  // the queues are swapped so both keep their capacity
+  auto& queue = chan->writing_queue;
+  {
+    std::lock_guard<std::mutex> l(chan->lock);
+    if (chan->failed || chan->queue.empty()) {
+      chan->writing = false;
+      return;
+    }
+    queue.swap(chan->queue);
+  }
+
+  chan->write_buffers.clear();
+  for (auto r : queue) {
+    chan->pending.push_back(r);
+    chan->write_buffers.push_back(boost::asio::buffer(r->buffer, r->size));
+  }
+  queue.clear();
+
+  boost::asio::async_write(chan->socket_, BufferView(chan->write_buffers),
+      make_handler(chan->write_memory,
+        [chan](const boost::system::error_code& err, size_t) {
+    if (err) {
+      std::cerr << "seqr write error " << err.message() << std::endl;
+      FailChannel(chan);
+      return;
+    }
+    StartWrite(chan);
+  }));
+}
+
+void SeqrClient::StartRead(std::shared_ptr<channel> chan)
+{
+  boost::asio::async_read(chan->socket_,
+      boost::asio::buffer(&chan->be_reply_size, sizeof(chan->be_reply_size)),
+      make_handler(chan->read_memory,
+        [chan](const boost::system::error_code& err, size_t) {
+    if (err) {
+      if (err != boost::asio::error::operation_aborted)
+        std::cerr << "seqr read error " << err.message() << std::endl;
+      FailChannel(chan);
+      return;
+    }
+
+    size_t size = ntohl(chan->be_reply_size);
+    const bool frame = size & seqr_frame::v2_flag;
+    size &= ~seqr_frame::v2_flag;
+    if (size >= sizeof(chan->buffer)) {
+      std::cerr << "seqr reply too large " << size << std::endl;
+      FailChannel(chan);
+      return;
+    }
+
+    boost::asio::async_read(chan->socket_,
+        boost::asio::buffer(chan->buffer, size),
+        make_handler(chan->read_memory,
+          [chan, size, frame](const boost::system::error_code& err, size_t) {
+      if (err) {
+        if (err != boost::asio::error::operation_aborted)
+          std::cerr << "seqr read error " << err.message() << std::endl;
+        FailChannel(chan);
+        return;
+      }
+      if (HandleReply(chan, size, frame))
+        StartRead(chan);
+    }));
+  }));
+}
+
+bool SeqrClient::HandleReply(std::shared_ptr<channel> chan, size_t size,
+    bool frame)
+{
+  zlog_proto::MSeqReply reply;
+  seqr_frame::Reply frame_reply;
+  auto& pending = chan->pending;
+  auto it = pending.end();
+
+  if (frame) {
+    if (!seqr_frame::DecodeReply(chan->buffer, size, &frame_reply)) {
+      std::cerr << "failed to decode seqr reply" << std::endl;
+      FailChannel(chan);
+      return false;
+    }
+    it = std::find_if(pending.begin(), pending.end(),
+        [&](Request *r) { return r->id == frame_reply.id; });
+  } else {
+    if (!reply.ParseFromArray(chan->buffer, size)) {
+      std::cerr << "failed to parse seqr reply" << std::endl;
+      FailChannel(chan);
+      return false;
+    }
+    assert(reply.IsInitialized());
+    if (reply.has_id()) {
+      it = std::find_if(pending.begin(), pending.end(),
+          [&](Request *r) { return r->id == reply.id(); });
+    } else {
+      it = pending.begin();
+    }
+  }
+
+  // a reply must be of the kind its request expects
+  if (it == pending.end() || frame != !(*it)->done) {
+    std::cerr << "unexpected seqr reply" << std::endl;
+    FailChannel(chan);
+    return false;
+  }
+
+  Request *r = *it;
+  pending.erase(it);
+
+  if (frame)
+    r->complete(0, frame_reply);
+  else
+    r->done(0, reply);
+  FreeRequest(chan, r);
+
+  return true;
+}
+
+// the channel is unusable after an i/o error. everything outstanding on it and
+// any request submitted to it later fails with -EIO.
+void SeqrClient::FailChannel(std::shared_ptr<channel> chan)
+{
+  std::vector<Request*> queue;
+  {
+    std::lock_guard<std::mutex> l(chan->lock);
+    if (chan->failed)
+      return;
+    chan->failed = true;
+    queue.swap(chan->queue);
+  }
+
+  boost::system::error_code err;
+  chan->socket_.close(err);
+
+  queue.insert(queue.end(), chan->pending.begin(), chan->pending.end());
+  chan->pending.clear();
+
+  for (auto r : queue) {
+    r->fail(-EIO);
+    FreeRequest(chan, r);
+  }
+}
+
+int SeqrClient::Call(zlog_proto::MSeqRequest& req,
+    zlog_proto::MSeqReply& reply)
+{
+  Waiter waiter;
+  Submit(req, [&](int r, zlog_proto::MSeqReply& result) {
+    if (!r)
+      reply.Swap(&result);
+    waiter.complete(r);
+  });
+  return waiter.wait();
+}
+
+void SeqrClient::SendCheckTail(std::shared_ptr<channel> chan,
+    uint32_t handle, uint64_t epoch, bool next, size_t count,
+    CheckTailCallback callback)
+{
+  seqr_frame::CheckTail req;
+  req.handle = handle;
+  req.epoch = epoch;
+  req.next = next;
+  req.count = count;
+
+  Request *r = NewRequest(chan);
+  r->size = seqr_frame::EncodeCheckTail(r->buffer, 0, req);
+  r->tail_done = std::move(callback);
+
+  Submit(chan, r, nullptr);
+}
+
+void SeqrClient::CheckTailRange(uint64_t epoch,
     const std::map<std::string, std::string>& meta,
-    const std::string& name, uint64_t *position, bool next) {
-  // fill in msg
-  zlog_proto::MSeqRequest req;
-  req.set_epoch(epoch);
-  req.set_name(name);
-  req.set_next(next);
+    const std::string& name, bool next, size_t count,
+    CheckTailCallback callback)
+{
+  if (protocol_ == 1) {
+    // fill in msg
+    zlog_proto::MSeqRequest req;
+    req.set_epoch(epoch);
+    req.set_name(name);
+    req.set_next(next);
+    for (auto e : meta) {
+      auto sp = req.add_meta();
+      sp->set_key(e.first);
+      sp->set_val(e.second);
+    }
+    req.set_count(count);
+
+    Submit(req, [count, callback](int ret, zlog_proto::MSeqReply& reply) {
+      if (ret) {
+        callback(ret, 0);
+        return;
+      }
+
+      if (reply.status() == zlog_proto::MSeqReply::INIT_LOG) {
+        callback(-EAGAIN, 0);
+      } else if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH) {
+        callback(-ERANGE, 0);
+      } else {
+        assert(reply.status() == zlog_proto::MSeqReply::OK);
+        assert((size_t)reply.position_size() == count);
+        // the sequencer hands out a batch as a single range
+        assert(reply.position(count - 1) - reply.position(0) == count - 1);
+        callback(0, reply.position(0));
+      }
+    });
+    return;
+  }
+
+  if (channels_.empty()) {
+    callback(-ENOTCONN, 0);
+    return;
+  }
+
+  auto chan = channels_[thread_slot() % channels_.size()];
+
+  uint32_t handle;
+  if (FindHandle(chan, name, meta, &handle)) {
+    SendCheckTail(chan, handle, epoch, next, count, std::move(callback));
+    return;
+  }
+
+  // register the log on this channel and then send the request
+  Register(chan, name, meta, [chan, epoch, next, count, callback](int ret,
+        uint32_t handle) {
+    if (ret) {
+      callback(ret, 0);
+      return;
+    }
+    SendCheckTail(chan, handle, epoch, next, count, callback);
+  });
+}
+
+bool SeqrClient::FindHandle(std::shared_ptr<channel> chan,
+    const std::string& name, const std::map<std::string, std::string>& meta,
+    uint32_t *handle)
+{
+  std::lock_guard<std::mutex> l(chan->lock);
+  auto it = chan->handles.find(name);
+  if (it == chan->handles.end())
+    return false;
+  for (auto& log : it->second) {
+    if (log.first == meta) {
+      *handle = log.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+// the sequencer replies once it has initialized the log
+void SeqrClient::Register(std::shared_ptr<channel> chan,
+    const std::string& name, const std::map<std::string, std::string>& meta,
+    std::function<void(int, uint32_t)> callback)
+{
+  zlog_proto::MSeqRegister reg;
+  reg.set_name(name);
   for (auto e : meta) {
-    auto sp = req.add_meta();
+    auto sp = reg.add_meta();
     sp->set_key(e.first);
     sp->set_val(e.second);
   }
-  req.set_count(1);
 
-  channel *chan = channels_[next_channel_++ % num_channels_];
-  std::lock_guard<std::mutex> l(chan->lock_);
+  Request *r = NewRequest(chan);
+  size_t msg_size = reg.ByteSize();
+  r->size = seqr_frame::header_size + msg_size;
+  assert(r->size <= sizeof(r->buffer));
+  seqr_frame::put_header(r->buffer, r->size - 4, seqr_frame::REGISTER, 0);
+  if (!reg.SerializeToArray(r->buffer + seqr_frame::header_size, msg_size)) {
+    FreeRequest(chan, r);
+    callback(-EIO, 0);
+    return;
+  }
+
+  r->frame_done = [chan, name, meta, callback](int ret,
+      const seqr_frame::Reply& reply) {
+    if (!ret)
+      ret = frame_status(reply.status);
+    if (ret) {
+      callback(ret, 0);
+      return;
+    }
+    const uint32_t handle = reply.value;
+    {
+      std::lock_guard<std::mutex> l(chan->lock);
+      auto& logs = chan->handles[name];
+      auto it = std::find_if(logs.begin(), logs.end(),
+          [&](const std::pair<std::map<std::string, std::string>,
+            uint32_t>& log) { return log.first == meta; });
+      if (it == logs.end())
+        logs.emplace_back(meta, handle);
+      else
+        it->second = handle;
+    }
+    callback(0, handle);
+  };
+
+  Submit(chan, r, nullptr);
+}
 
-  // serialize header and protobuf message
-  uint32_t msg_size = req.ByteSize();
-  uint32_t be_msg_size = htonl(msg_size);
-  uint32_t total_msg_size = msg_size + sizeof(be_msg_size);
-  assert(total_msg_size <= sizeof(chan->buffer));
+void SeqrClient::SendWaitTail(std::shared_ptr<channel> chan,
+    uint32_t handle, uint64_t epoch, uint64_t after, uint32_t timeout_ms,
+    CheckTailCallback callback)
+{
+  seqr_frame::WaitTail req;
+  req.handle = handle;
+  req.epoch = epoch;
+  req.after = after;
+  req.timeout_ms = timeout_ms;
 
-  // add header
-  memcpy(chan->buffer, &be_msg_size, sizeof(be_msg_size));
+  Request *r = NewRequest(chan);
+  r->size = seqr_frame::EncodeWaitTail(r->buffer, 0, req);
+  r->tail_done = std::move(callback);
 
-  // add protobuf msg
-  assert(req.IsInitialized());
-  if (!req.SerializeToArray(chan->buffer + sizeof(be_msg_size), msg_size)) {
-    return -EIO;
+  Submit(chan, r, nullptr);
+}
+
+// the entries of a request complete together, and done is called after their
+// results have been set.
+void SeqrClient::SendMultiCheckTail(std::shared_ptr<channel> chan,
+    const uint32_t *handles, TailQuery **queries, size_t num,
+    std::function<void()> done)
+{
+  assert(num > 0 && num <= seqr_frame::max_multi_entries);
+
+  seqr_frame::CheckTail reqs[seqr_frame::max_multi_entries];
+  for (size_t i = 0; i < num; i++) {
+    reqs[i].handle = handles[i];
+    reqs[i].epoch = queries[i]->epoch;
+    reqs[i].next = queries[i]->next;
+    reqs[i].count = queries[i]->count;
   }
 
-  // send
-  boost::asio::write(chan->socket_, boost::asio::buffer(chan->buffer, total_msg_size));
+  std::vector<TailQuery*> batch(queries, queries + num);
 
-  // get reply
-  boost::asio::read(chan->socket_, boost::asio::buffer(&be_msg_size, sizeof(be_msg_size)));
-  msg_size = ntohl(be_msg_size);
-  assert(msg_size < sizeof(chan->buffer));
-  boost::asio::read(chan->socket_, boost::asio::buffer(chan->buffer, msg_size));
+  Request *r = NewRequest(chan);
+  r->size = seqr_frame::EncodeMultiCheckTail(r->buffer, 0, reqs, num);
+  assert(r->size <= sizeof(r->buffer));
+  r->frame_done = [batch, done](int ret, const seqr_frame::Reply& reply) {
+    if (!ret && (reply.type != seqr_frame::MULTI_CHECK_TAIL ||
+          reply.value != batch.size()))
+      ret = -EIO;
+    for (size_t i = 0; i < batch.size(); i++) {
+      auto q = batch[i];
+      if (ret) {
+        q->ret = ret;
+        continue;
+      }
+      uint8_t status;
+      seqr_frame::DecodeMultiReplyEntry(reply.entries, i, &status,
+          &q->position);
+      q->ret = frame_status(status);
+    }
+    done();
+  };
 
-  // deserialize
-  zlog_proto::MSeqReply reply;
-  if (!reply.ParseFromArray(chan->buffer, msg_size)) {
-    return -EIO;
+  Submit(chan, r, nullptr);
+}
+
+/*
+ * Logs that aren't registered on the channel are registered first, and then
+ * every entry is sent. The registrations and the multi-log requests are each
+ * queued together, so they go out in a single write.
+ */
+void SeqrClient::CheckTails(std::vector<TailQuery>& queries)
+{
+  if (protocol_ == 1 || channels_.empty()) {
+    for (auto& q : queries) {
+      if (q.count == 1) {
+        q.ret = CheckTail(q.epoch, q.meta, q.name, &q.position, q.next);
+      } else {
+        std::vector<uint64_t> positions;
+        q.ret = CheckTail(q.epoch, q.meta, q.name, positions, q.count);
+        if (!q.ret)
+          q.position = positions[0];
+      }
+    }
+    return;
   }
-  assert(reply.IsInitialized());
 
-  if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
-    return -EAGAIN;
-  else if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH)
-    return -ERANGE;
-  else {
-    assert(reply.status() == zlog_proto::MSeqReply::OK);
-    assert(reply.position_size() == 1);
-    *position = reply.position(0);
+  auto chan = channels_[thread_slot() % channels_.size()];
+
+  std::vector<uint32_t> handles(queries.size());
+  std::vector<size_t> unregistered;
+  for (size_t i = 0; i < queries.size(); i++) {
+    auto& q = queries[i];
+    q.ret = 0;
+    if (q.count == 0 || q.count > max_batch_positions ||
+        (!q.next && q.count != 1)) {
+      q.ret = -EINVAL;
+      continue;
+    }
+    if (!FindHandle(chan, q.name, q.meta, &handles[i]))
+      unregistered.push_back(i);
   }
 
-  return 0;
+  if (!unregistered.empty()) {
+    Waiter waiter(unregistered.size());
+    for (auto i : unregistered) {
+      auto& q = queries[i];
+      Register(chan, q.name, q.meta, [&, i](int ret, uint32_t handle) {
+        queries[i].ret = ret;
+        handles[i] = handle;
+        waiter.complete(0);
+      });
+    }
+    waiter.wait();
+  }
+
+  std::vector<uint32_t> batch_handles;
+  std::vector<TailQuery*> batch;
+  for (size_t i = 0; i < queries.size(); i++) {
+    if (queries[i].ret)
+      continue;
+    batch_handles.push_back(handles[i]);
+    batch.push_back(&queries[i]);
+  }
+
+  if (batch.empty())
+    return;
+
+  const size_t max_entries = seqr_frame::max_multi_entries;
+  Waiter waiter((batch.size() + max_entries - 1) / max_entries);
+  for (size_t i = 0; i < batch.size(); i += max_entries) {
+    const size_t num = std::min(max_entries, batch.size() - i);
+    SendMultiCheckTail(chan, &batch_handles[i], &batch[i], num,
+        [&] { waiter.complete(0); });
+  }
+  waiter.wait();
+}
+
+int SeqrClient::WaitForTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, uint64_t after,
+    std::chrono::milliseconds timeout, uint64_t *tail)
+{
+  if (protocol_ == 1)
+    return -EOPNOTSUPP;
+
+  if (channels_.empty())
+    return -ENOTCONN;
+
+  auto chan = channels_[thread_slot() % channels_.size()];
+
+  const uint32_t timeout_ms = std::max<int64_t>(0,
+      std::min<int64_t>(timeout.count(), UINT32_MAX));
+
+  Waiter waiter;
+  auto callback = [&](int ret, uint64_t pos) {
+    if (!ret) {
+      *tail = pos;
+      if (pos <= after)
+        ret = -ETIMEDOUT;
+    }
+    waiter.complete(ret);
+  };
+
+  uint32_t handle;
+  if (FindHandle(chan, name, meta, &handle)) {
+    SendWaitTail(chan, handle, epoch, after, timeout_ms, callback);
+  } else {
+    Register(chan, name, meta, [&](int ret, uint32_t handle) {
+      if (ret) {
+        waiter.complete(ret);
+        return;
+      }
+      SendWaitTail(chan, handle, epoch, after, timeout_ms, callback);
+    });
+  }
+
+  return waiter.wait();
+}
+
+void SeqrClient::AsyncCheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, size_t count, CheckTailCallback callback)
+{
+  if (count == 0 || count > max_batch_positions) {
+    callback(-EINVAL, 0);
+    return;
+  }
+
+  CheckTailRange(epoch, meta, name, true, count, std::move(callback));
+}
+
+int SeqrClient::CheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, uint64_t *position, bool next)
+{
+  Waiter waiter;
+  CheckTailRange(epoch, meta, name, next, 1,
+      [&](int ret, uint64_t pos) {
+    if (!ret)
+      *position = pos;
+    waiter.complete(ret);
+  });
+  return waiter.wait();
+}
+
+int SeqrClient::CheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, std::vector<uint64_t>& positions, size_t count)
+{
+  if (count == 0 || count > max_batch_positions)
+    return -EINVAL;
+
+  Waiter waiter;
+  CheckTailRange(epoch, meta, name, true, count,
+      [&](int ret, uint64_t pos) {
+    if (!ret) {
+      for (size_t i = 0; i < count; i++)
+        positions.push_back(pos + i);
+    }
+    waiter.complete(ret);
+  });
+  return waiter.wait();
 }
 
 int SeqrClient::CheckTail(uint64_t epoch,
@@ -106,39 +888,10 @@ int SeqrClient::CheckTail(uint64_t epoch,
     req.add_stream_ids(pos);
   }
 
-  channel *chan = channels_[next_channel_++ % num_channels_];
-  std::lock_guard<std::mutex> l(chan->lock_);
-
-  // serialize header and protobuf message
-  uint32_t msg_size = req.ByteSize();
-  uint32_t be_msg_size = htonl(msg_size);
-  uint32_t total_msg_size = msg_size + sizeof(be_msg_size);
-  assert(total_msg_size <= sizeof(chan->buffer));
-
-  // add header
-  memcpy(chan->buffer, &be_msg_size, sizeof(be_msg_size));
-
-  // add protobuf msg
-  assert(req.IsInitialized());
-  if (!req.SerializeToArray(chan->buffer + sizeof(be_msg_size), msg_size)) {
-    return -EIO;
-  }
-
-  // send
-  boost::asio::write(chan->socket_, boost::asio::buffer(chan->buffer, total_msg_size));
-
-  // get reply
-  boost::asio::read(chan->socket_, boost::asio::buffer(&be_msg_size, sizeof(be_msg_size)));
-  msg_size = ntohl(be_msg_size);
-  assert(msg_size < sizeof(chan->buffer));
-  boost::asio::read(chan->socket_, boost::asio::buffer(chan->buffer, msg_size));
-
-  // deserialize
   zlog_proto::MSeqReply reply;
-  if (!reply.ParseFromArray(chan->buffer, msg_size)) {
-    return -EIO;
-  }
-  assert(reply.IsInitialized());
+  int ret = Call(req, reply);
+  if (ret)
+    return ret;
 
   if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
     return -EAGAIN;
@@ -1,37 +1,49 @@
 #pragma once
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <set>
+#include <type_traits>
 #include <vector>
 #include <mutex>
 #include <atomic>
+#include <cassert>
 #include <boost/asio.hpp>
 
+namespace zlog_proto {
+  class MSeqRequest;
+  class MSeqReply;
+}
+
 namespace zlog {
 
-// it's important to delete any seqr clients that are created because when the
-// channels are created in the constructor there are file descriptors created
-// at that point (at least on OSX). When the derived class is the fake
-// sequencer, we were just letting memory leak in tests... but it turns out that
-// OSX will quickly reach an open file descriptor limit..
+// it's important to delete any seqr clients that are created because the
+// channels hold open file descriptors once connected. When the derived class is
+// the fake sequencer, we were just letting memory leak in tests... but it turns
+// out that OSX will quickly reach an open file descriptor limit..
+//
+// all clients in a process share a single event loop thread. the synchronous
+// interfaces are implemented on top of the asynchronous ones.
 class SeqrClient {
  public:
-  SeqrClient(const char *host, const char *port, uint64_t epoch) :
-    host_(host), port_(port), epoch_(epoch)
+  // completion callback for asynchronous requests. on success ret is zero and
+  // count contiguous positions starting at position have been reserved.
+  typedef std::function<void(int ret, uint64_t position)> CheckTailCallback;
+
+  // protocol selects the sequencer protocol version. version 2 requires a
+  // sequencer that supports it, and version 1 works with any sequencer.
+  SeqrClient(const char *host, const char *port, uint64_t epoch,
+      int num_channels = 5, int protocol = 2) :
+    host_(host), port_(port), epoch_(epoch), num_channels_(num_channels),
+    protocol_(protocol)
   {
-    num_channels_ = 5;
-    next_channel_ = 0;
-    for (int i = 0; i < num_channels_; i++) {
-      channels_.push_back(new channel);
-    }
+    assert(num_channels_ > 0);
+    assert(protocol_ == 1 || protocol_ == 2);
   }
 
-  virtual ~SeqrClient() {
-    for (channel *chan : channels_) {
-      chan->io_service_.stop();
-      chan->socket_.close();
-      delete chan;
-    }
-  }
+  virtual ~SeqrClient();
 
   virtual void Connect();
 
@@ -39,33 +51,196 @@ class SeqrClient {
       const std::map<std::string, std::string>& meta,
       const std::string& name, uint64_t *position, bool next);
 
+  // reserve count new positions in a single round trip. the reserved
+  // positions are appended to positions in increasing order. count must be no
+  // larger than max_batch_positions.
+  virtual int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, std::vector<uint64_t>& positions, size_t count);
+
   virtual int CheckTail(uint64_t epoch,
       const std::map<std::string, std::string>& meta,
       const std::string& name, const std::set<uint64_t>& stream_ids,
       std::map<uint64_t, std::vector<uint64_t>>& stream_backpointers,
       uint64_t *position, bool next);
 
+  // reserve count new positions without blocking. the callback is invoked
+  // from the client's event loop thread (or inline for the fake sequencer)
+  // and must not wait on other sequencer requests.
+  virtual void AsyncCheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, size_t count, CheckTailCallback callback);
+
+  // a request for the tail of one of many logs. ret and position are set
+  // when the request completes, and position is the first of count positions
+  // if next is set.
+  struct TailQuery {
+    uint64_t epoch;
+    std::map<std::string, std::string> meta;
+    std::string name;
+    bool next;
+    size_t count;
+    int ret;
+    uint64_t position;
+  };
+
+  // handle the requests for many logs together. with protocol version 2 they
+  // are sent in multi-log requests that are written at once, and otherwise
+  // they are handled one at a time.
+  virtual void CheckTails(std::vector<TailQuery>& queries);
+
+  // wait until the tail is past position after, or until timeout expires.
+  // on success and on -ETIMEDOUT, *tail is set to the tail. returns
+  // -EOPNOTSUPP if the sequencer can't wait, in which case the caller polls.
+  virtual int WaitForTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t after,
+      std::chrono::milliseconds timeout, uint64_t *tail);
+
   uint64_t Epoch() const {
     return epoch_;
   }
 
+  // the sequencer endpoint. empty for a sequencer that isn't remote.
+  const std::string& Host() const {
+    return host_;
+  }
+
+  const std::string& Port() const {
+    return port_;
+  }
+
+  // the sequencer rejects requests for more than 100 positions, and the reply
+  // must fit in a channel buffer.
+  static const size_t max_batch_positions = 64;
+
  private:
+  struct Request;
+
+  // memory for an event loop handler, of which at most one is outstanding.
+  // asio recycles the memory of a single handler per thread, so without it a
+  // handler would be allocated on the heap when it's posted from a thread that
+  // isn't running the loop, or when a write and a read are both outstanding.
+  template <size_t Size>
+  struct HandlerMemory {
+    HandlerMemory() : used(false) {}
+
+    void *allocate(size_t size) {
+      if (!used && size <= sizeof(storage)) {
+        used = true;
+        return &storage;
+      }
+      return ::operator new(size);
+    }
+
+    void deallocate(void *p) {
+      if (p == &storage) {
+        used = false;
+        return;
+      }
+      ::operator delete(p);
+    }
+
+    typename std::aligned_storage<Size>::type storage;
+    bool used;
+  };
+
+  // a channel is a connection with any number of requests outstanding. each
+  // request is tagged with an id that the sequencer echoes in its reply.
+  // requests are queued by submitters under the lock, and everything else is
+  // owned by the event loop thread, which writes queued requests in a single
+  // gathered write and reads replies continuously. handlers hold a reference
+  // so a channel may outlive the client while its socket is being closed.
+  //
+  // with protocol version 2, logs registered on the connection are remembered
+  // along with the handle assigned to them by the sequencer.
+  //
+  // the containers are reused from one request to the next, and completed
+  // requests are kept for reuse, so a request in the steady state doesn't
+  // allocate.
   struct channel {
-    channel() : socket_(io_service_) {}
-    boost::asio::io_service io_service_;
+    explicit channel(boost::asio::io_service& io_service) :
+      socket_(io_service), next_id(0), writing(false), failed(false)
+    {}
+    ~channel();
     boost::asio::ip::tcp::socket socket_;
+
+    std::mutex lock;
+    uint64_t next_id;
+    std::vector<Request*> queue;
+    bool writing;
+    bool failed;
+    std::map<std::string, std::vector<std::pair<
+      std::map<std::string, std::string>, uint32_t>>> handles;
+    std::vector<Request*> free_requests;
+
+    // a gathered write prepares up to 64 buffers in its operation
+    HandlerMemory<128> start_write_memory;
+    HandlerMemory<2048> write_memory;
+    HandlerMemory<256> read_memory;
+
+    std::vector<Request*> writing_queue;
+    std::vector<boost::asio::const_buffer> write_buffers;
+    // in order of id
+    std::vector<Request*> pending;
+    uint32_t be_reply_size;
     char buffer[1024];
-    std::mutex lock_;
   };
 
-  std::vector<channel*> channels_;
+  // bound on the number of completed requests a channel keeps for reuse
+  static const size_t max_free_requests = 64;
+
+  void Submit(zlog_proto::MSeqRequest& req,
+      std::function<void(int, zlog_proto::MSeqReply&)> done);
+
+  int Call(zlog_proto::MSeqRequest& req,
+      zlog_proto::MSeqReply& reply);
+
+  // read the tail, or reserve count new positions when next is set
+  void CheckTailRange(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, bool next, size_t count,
+      CheckTailCallback callback);
+
+  static Request *NewRequest(const std::shared_ptr<channel>& chan);
+  static void FreeRequest(const std::shared_ptr<channel>& chan, Request *r);
+
+  static void Submit(std::shared_ptr<channel> chan, Request *r,
+      zlog_proto::MSeqRequest *req);
+  static void SendCheckTail(std::shared_ptr<channel> chan, uint32_t handle,
+      uint64_t epoch, bool next, size_t count, CheckTailCallback callback);
+  static void SendMultiCheckTail(std::shared_ptr<channel> chan,
+      const uint32_t *handles, TailQuery **queries, size_t num,
+      std::function<void()> done);
+  static void SendWaitTail(std::shared_ptr<channel> chan, uint32_t handle,
+      uint64_t epoch, uint64_t after, uint32_t timeout_ms,
+      CheckTailCallback callback);
+
+  // look up the handle of a log registered on a channel
+  static bool FindHandle(std::shared_ptr<channel> chan,
+      const std::string& name, const std::map<std::string, std::string>& meta,
+      uint32_t *handle);
+
+  // register a log on a channel. concurrent registrations of the same log
+  // receive the same handle.
+  static void Register(std::shared_ptr<channel> chan,
+      const std::string& name, const std::map<std::string, std::string>& meta,
+      std::function<void(int, uint32_t)> callback);
+
+  static void StartWrite(std::shared_ptr<channel> chan);
+  static void StartRead(std::shared_ptr<channel> chan);
+  static bool HandleReply(std::shared_ptr<channel> chan, size_t size,
+      bool frame);
+  static void FailChannel(std::shared_ptr<channel> chan);
+
+  std::vector<std::shared_ptr<channel>> channels_;
 
   std::string host_;
   std::string port_;
   uint64_t epoch_;
 
-  int num_channels_;
-  std::atomic<int> next_channel_;
+  const int num_channels_;
+  const int protocol_;
 };
 
 }
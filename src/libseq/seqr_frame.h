@@ -0,0 +1,274 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+namespace zlog {
+
+// Version 2 of the sequencer protocol.
+//
+// Every message on a sequencer connection starts with a 4 byte big-endian
+// length word. Version 1 messages are a protobuf MSeqRequest / MSeqReply. A
+// version 2 message sets the high bit of the length word and starts with a
+// type byte and the request id, followed by a type specific body:
+//
+//   REGISTER request   : MSeqRegister protobuf (log name and backend meta)
+//   CHECK_TAIL request : handle (4), epoch (8), next (1), count (4)
+//   WAIT_TAIL request  : handle (4), epoch (8), after (8), timeout (4)
+//   MULTI_CHECK_TAIL   : num (4), num x [handle (4), epoch (8), next (1),
+//                        count (4)]
+//   reply (all types)  : status (1), value (8)
+//   MULTI_CHECK_TAIL   : status (1), value (8), value x [status (1),
+//     reply              value (8)]
+//
+// A client registers a log once per connection and receives a handle that
+// identifies the log in later CHECK_TAIL requests, so the fast path doesn't
+// carry the name and meta and doesn't touch protobuf. The value of a REGISTER
+// reply is the handle, and the value of a CHECK_TAIL reply is the first of
+// count positions. Reply status values are those of MSeqReply::Status.
+//
+// The sequencer holds a WAIT_TAIL reply until the tail is past position after
+// or timeout milliseconds have passed, and the value of the reply is the tail.
+// A REGISTER request for a log that isn't initialized yet is answered once the
+// sequencer has initialized the log, rather than with INIT_LOG, which is only
+// returned if the initialization fails. Replies may therefore arrive out of
+// order, and are matched to requests by id.
+//
+// A MULTI_CHECK_TAIL request carries the CHECK_TAIL requests of many logs,
+// which are answered in a single reply. The value of the reply is the number
+// of entries, and it is followed by the status and value of each entry in the
+// order of the request.
+//
+// Both versions may be used on the same connection. All integers are sent in
+// network byte order.
+namespace seqr_frame {
+
+static const uint32_t v2_flag = 1u << 31;
+
+enum Type : uint8_t {
+  REGISTER = 1,
+  CHECK_TAIL = 2,
+  WAIT_TAIL = 3,
+  MULTI_CHECK_TAIL = 4,
+};
+
+// length word, type and id
+static const size_t header_size = 4 + 1 + 8;
+static const size_t id_offset = 4 + 1;
+
+static const size_t check_tail_size = header_size + 4 + 8 + 1 + 4;
+static const size_t wait_tail_size = header_size + 4 + 8 + 8 + 4;
+static const size_t reply_size = header_size + 1 + 8;
+
+static const size_t multi_entry_size = 4 + 8 + 1 + 4;
+static const size_t multi_reply_entry_size = 1 + 8;
+
+// a multi-log request and its reply fit in a 1024 byte message
+static const size_t max_multi_entries = 50;
+
+inline size_t multi_check_tail_size(size_t num) {
+  return header_size + 4 + num * multi_entry_size;
+}
+
+inline size_t multi_reply_size(size_t num) {
+  return reply_size + num * multi_reply_entry_size;
+}
+
+struct CheckTail {
+  uint32_t handle;
+  uint64_t epoch;
+  bool next;
+  uint32_t count;
+};
+
+struct WaitTail {
+  uint32_t handle;
+  uint64_t epoch;
+  uint64_t after;
+  uint32_t timeout_ms;
+};
+
+struct Reply {
+  Type type;
+  uint64_t id;
+  uint8_t status;
+  uint64_t value;
+  // the entries of a MULTI_CHECK_TAIL reply
+  const char *entries;
+};
+
+inline char *put_u32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+inline char *put_u64(char *p, uint64_t v) {
+  p = put_u32(p, (uint32_t)(v >> 32));
+  return put_u32(p, (uint32_t)v);
+}
+
+inline const char *get_u32(const char *p, uint32_t *v) {
+  uint32_t tmp;
+  memcpy(&tmp, p, sizeof(tmp));
+  *v = ntohl(tmp);
+  return p + sizeof(tmp);
+}
+
+inline const char *get_u64(const char *p, uint64_t *v) {
+  uint32_t hi, lo;
+  p = get_u32(p, &hi);
+  p = get_u32(p, &lo);
+  *v = ((uint64_t)hi << 32) | lo;
+  return p;
+}
+
+// write the length word, type and id. size is the number of bytes that follow
+// the length word.
+inline char *put_header(char *p, size_t size, Type type, uint64_t id) {
+  p = put_u32(p, v2_flag | (uint32_t)size);
+  *p++ = (char)type;
+  return put_u64(p, id);
+}
+
+// requests are encoded before they are assigned an id
+inline void set_id(char *buf, uint64_t id) {
+  put_u64(buf + id_offset, id);
+}
+
+// buf and size exclude the length word
+inline bool DecodeHeader(const char *buf, size_t size, uint8_t *type,
+    uint64_t *id) {
+  if (size < header_size - 4)
+    return false;
+  *type = buf[0];
+  get_u64(buf + 1, id);
+  return true;
+}
+
+inline size_t EncodeCheckTail(char *buf, uint64_t id, const CheckTail& req) {
+  char *p = put_header(buf, check_tail_size - 4, CHECK_TAIL, id);
+  p = put_u32(p, req.handle);
+  p = put_u64(p, req.epoch);
+  *p++ = req.next ? 1 : 0;
+  p = put_u32(p, req.count);
+  return p - buf;
+}
+
+// buf and size exclude the length word
+inline bool DecodeCheckTail(const char *buf, size_t size, CheckTail *req) {
+  if (size != check_tail_size - 4)
+    return false;
+  const char *p = buf + header_size - 4;
+  p = get_u32(p, &req->handle);
+  p = get_u64(p, &req->epoch);
+  req->next = *p++ != 0;
+  get_u32(p, &req->count);
+  return true;
+}
+
+inline size_t EncodeWaitTail(char *buf, uint64_t id, const WaitTail& req) {
+  char *p = put_header(buf, wait_tail_size - 4, WAIT_TAIL, id);
+  p = put_u32(p, req.handle);
+  p = put_u64(p, req.epoch);
+  p = put_u64(p, req.after);
+  p = put_u32(p, req.timeout_ms);
+  return p - buf;
+}
+
+// buf and size exclude the length word
+inline bool DecodeWaitTail(const char *buf, size_t size, WaitTail *req) {
+  if (size != wait_tail_size - 4)
+    return false;
+  const char *p = buf + header_size - 4;
+  p = get_u32(p, &req->handle);
+  p = get_u64(p, &req->epoch);
+  p = get_u64(p, &req->after);
+  get_u32(p, &req->timeout_ms);
+  return true;
+}
+
+inline size_t EncodeMultiCheckTail(char *buf, uint64_t id,
+    const CheckTail *reqs, size_t num) {
+  char *p = put_header(buf, multi_check_tail_size(num) - 4,
+      MULTI_CHECK_TAIL, id);
+  p = put_u32(p, num);
+  for (size_t i = 0; i < num; i++) {
+    p = put_u32(p, reqs[i].handle);
+    p = put_u64(p, reqs[i].epoch);
+    *p++ = reqs[i].next ? 1 : 0;
+    p = put_u32(p, reqs[i].count);
+  }
+  return p - buf;
+}
+
+// buf and size exclude the length word. the entries are read with
+// DecodeMultiEntry.
+inline bool DecodeMultiCheckTail(const char *buf, size_t size,
+    uint32_t *num) {
+  if (size < multi_check_tail_size(0) - 4)
+    return false;
+  get_u32(buf + header_size - 4, num);
+  return *num <= max_multi_entries &&
+    size == multi_check_tail_size(*num) - 4;
+}
+
+// buf excludes the length word
+inline void DecodeMultiEntry(const char *buf, size_t index, CheckTail *req) {
+  const char *p = buf + multi_check_tail_size(index) - 4;
+  p = get_u32(p, &req->handle);
+  p = get_u64(p, &req->epoch);
+  req->next = *p++ != 0;
+  get_u32(p, &req->count);
+}
+
+// buf is the encoded reply
+inline void EncodeMultiReplyEntry(char *buf, size_t index, uint8_t status,
+    uint64_t value) {
+  char *p = buf + multi_reply_size(index);
+  *p++ = (char)status;
+  put_u64(p, value);
+}
+
+// entries is the entries field of a decoded reply
+inline void DecodeMultiReplyEntry(const char *entries, size_t index,
+    uint8_t *status, uint64_t *value) {
+  const char *p = entries + index * multi_reply_entry_size;
+  *status = (uint8_t)*p++;
+  get_u64(p, value);
+}
+
+// the entries of a MULTI_CHECK_TAIL reply are added with
+// EncodeMultiReplyEntry, and the value is the number of entries.
+inline size_t EncodeReply(char *buf, const Reply& reply) {
+  const size_t size = reply.type == MULTI_CHECK_TAIL ?
+    multi_reply_size(reply.value) : reply_size;
+  char *p = put_header(buf, size - 4, reply.type, reply.id);
+  *p++ = (char)reply.status;
+  p = put_u64(p, reply.value);
+  return p - buf;
+}
+
+// buf and size exclude the length word
+inline bool DecodeReply(const char *buf, size_t size, Reply *reply) {
+  if (size < reply_size - 4)
+    return false;
+  uint8_t type = buf[0];
+  if (type != REGISTER && type != CHECK_TAIL && type != WAIT_TAIL &&
+      type != MULTI_CHECK_TAIL)
+    return false;
+  reply->type = (Type)type;
+  const char *p = get_u64(buf + 1, &reply->id);
+  reply->status = (uint8_t)*p++;
+  p = get_u64(p, &reply->value);
+  if (type != MULTI_CHECK_TAIL) {
+    reply->entries = nullptr;
+    return size == reply_size - 4;
+  }
+  reply->entries = p;
+  return reply->value <= max_multi_entries &&
+    size == multi_reply_size(reply->value) - 4;
+}
+
+}
+}
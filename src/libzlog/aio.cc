@@ -2,15 +2,29 @@
 
 #include <condition_variable>
 #include <mutex>
+#include <numeric>
 #include "zlog/backend.h"
 
 namespace zlog {
 
 enum AioType {
   ZLOG_AIO_APPEND,
+  ZLOG_AIO_APPEND_BATCH,
   ZLOG_AIO_READ,
 };
 
+class AioCompletionImpl;
+
+/*
+ * Context for a single entry write issued as part of a batch append.
+ */
+struct AioBatchEntry {
+  AioCompletionImpl *impl;
+  size_t index;
+  uint64_t position;
+  int ret;
+};
+
 class AioCompletionImpl {
  public:
   /*
@@ -51,9 +65,14 @@ class AioCompletionImpl {
    *
    * pposition:
    *  - final append position
+   * epoch:
+   *  - epoch of the mapping used for the current attempt
+   * seq_epoch:
+   *  - epoch of the sequencer that handed out the current position
    */
   uint64_t *pposition;
   uint64_t epoch;
+  uint64_t seq_epoch;
 
   /*
    * AioRead
@@ -62,6 +81,29 @@ class AioCompletionImpl {
    *  - where to put result
    */
   std::string *datap;
+
+  /*
+   * AioAppendBatch
+   *
+   * batch_data:
+   *  - private copy of the entries being appended
+   * batch:
+   *  - entries being appended (may reference batch_data)
+   * batch_positions:
+   *  - final position of each entry, or Log::invalid_position
+   * batch_pending:
+   *  - indices of entries not yet written
+   * batch_round:
+   *  - writes in flight for the current attempt
+   */
+  std::vector<std::string> batch_data;
+  std::vector<Slice> batch;
+  std::vector<uint64_t> *ppositions;
+  std::vector<uint64_t> batch_positions;
+  std::vector<size_t> batch_pending;
+  std::vector<AioBatchEntry> batch_round;
+  int batch_outstanding;
+
   #ifdef WITH_CACHE
   Cache* cache;
   #endif
@@ -108,16 +150,162 @@ class AioCompletionImpl {
     this->callback = callback;
   }
 
+  /*
+   * Complete the operation and drop the reference held on behalf of the
+   * backend. Called with the lock held, and the completion may be freed when
+   * this returns. callback_complete is set under the lock so that a waiter
+   * can't miss the wakeup between checking it and blocking.
+   */
+  void finish_locked(int ret) {
+    retval = ret;
+    complete = true;
+    lock.unlock();
+    if (has_callback)
+      callback();
+    lock.lock();
+    callback_complete = true;
+    cond.notify_all();
+    put_unlock();
+  }
+
+  void finish(int ret) {
+    lock.lock();
+    finish_locked(ret);
+  }
+
+  // the positions of the entries that were written are returned even when the
+  // batch fails, so the caller doesn't append them again
+  void finish_batch(int ret) {
+    if (ppositions)
+      ppositions->swap(batch_positions);
+    finish(ret);
+  }
+
+  /*
+   * The operation state machines. Each step either issues the next
+   * asynchronous request or completes the operation, and the fields describing
+   * the current attempt are only touched by whichever thread is running the
+   * current step.
+   */
+  void append_sequence();
+  void append_map();
+  void append_retry(bool update_view);
+
+  void read_map();
+
+  void submit_batch();
+  void sequence_batch(size_t first, size_t count);
+  void write_batch(size_t first, size_t count, uint64_t seq_epoch);
+  void batch_put(int n);
+  void complete_batch_round();
+
   static void aio_safe_cb_read(void *arg, int ret);
   static void aio_safe_cb_write(void *arg, int ret);
+  static void aio_safe_cb_write_batch(void *arg, int ret);
 };
 
+/*
+ * Reserve a position for the entry being appended.
+ */
+void AioCompletionImpl::append_sequence()
+{
+  log->AsyncCheckTail(1, [this](int ret, uint64_t position,
+        uint64_t seq_epoch) {
+    if (ret) {
+      finish(ret);
+      return;
+    }
+    this->position = position;
+    this->seq_epoch = seq_epoch;
+    append_map();
+  });
+}
+
+/*
+ * Map the position from the sequencer to a storage object and write the entry.
+ * If the epoch has changed, it may mean the sequencer changed, so we behave
+ * conservatively and retry with a new position.
+ */
+void AioCompletionImpl::append_map()
+{
+  auto mapping = log->striper.MapPosition(position);
+  if (!mapping) {
+    log->AsyncExtendMap(position, [this](int ret) {
+      if (ret)
+        finish(ret);
+      else
+        append_map();
+    });
+    return;
+  }
+
+  if (seq_epoch != mapping->seq_epoch) {
+    std::cerr << "retry with new seq" << std::endl;
+    log->InvalidateLease(seq_epoch);
+    append_retry(false);
+    return;
+  }
+
+  // used to identify if state changes have occurred since dispatching the
+  // request in order to avoid reconfiguration later (important when lots of
+  // threads or contexts try to do the same thing).
+  epoch = mapping->epoch;
+
+  int ret = backend->AioWrite(*mapping->oid, mapping->epoch, position,
+      mapping->width, mapping->max_size,
+      Slice(data.data(), data.size()),
+      this, AioCompletionImpl::aio_safe_cb_write);
+  if (ret)
+    finish(ret);
+}
+
+/*
+ * Retry the append at a new position. The retry is bounced through the
+ * finisher so that a run of inline completions (e.g. the fake sequencer with
+ * the ram backend) does not grow the stack.
+ */
+void AioCompletionImpl::append_retry(bool update_view)
+{
+  if (update_view) {
+    log->AsyncUpdateView([this](int ret) {
+      if (ret)
+        finish(ret);
+      else
+        append_sequence();
+    });
+  } else {
+    log->QueueFinisher([this] {
+      if (log->FinisherShutdown())
+        finish(-ESHUTDOWN);
+      else
+        append_sequence();
+    });
+  }
+}
+
+void AioCompletionImpl::read_map()
+{
+  auto mapping = log->striper.MapPosition(position);
+  if (!mapping) {
+    log->AsyncExtendMap(position, [this](int ret) {
+      if (ret)
+        finish(ret);
+      else
+        read_map();
+    });
+    return;
+  }
+
+  int ret = backend->AioRead(*mapping->oid, mapping->epoch, position,
+      mapping->width, mapping->max_size, &data,
+      this, AioCompletionImpl::aio_safe_cb_read);
+  if (ret)
+    finish(ret);
+}
+
 void AioCompletionImpl::aio_safe_cb_read(void *arg, int ret)
 {
   AioCompletionImpl *impl = (AioCompletionImpl*)arg;
-  bool finish = false;
-
-  impl->lock.lock();
 
   assert(impl->type == ZLOG_AIO_READ);
 
@@ -133,75 +321,31 @@ void AioCompletionImpl::aio_safe_cb_read(void *arg, int ret)
     impl->cache->put(impl->position, Slice(*(impl->datap)));
     #endif
 
-    ret = 0;
-    finish = true;
+    impl->finish(0);
   } else if (ret == -ESPIPE) {
     /*
      * We'll need to try again with a new epoch.
      */
-    ret = impl->log->UpdateView();
-    if (ret)
-      finish = true;
+    impl->log->AsyncUpdateView([impl](int ret) {
+      if (ret)
+        impl->finish(ret);
+      else
+        impl->read_map();
+    });
   } else if (ret < 0) {
     // -ENOENT  // not-written
     // -ENODATA // invalidated
     // other: rados error
-    finish = true;
+    impl->finish(ret);
   } else {
     assert(0);
-    ret = -EIO;
-    finish = true;
-  }
-
-  /*
-   * Try append again with a new position. This can happen if above there is a
-   * stale epoch that we refresh, or if the position was marked read-only.
-   */
-  if (!finish) {
-    auto mapping = impl->log->striper.MapPosition(impl->position);
-    while (!mapping) {
-      ret = impl->log->ExtendMap();
-      if (ret)
-        break;
-      mapping = impl->log->striper.MapPosition(impl->position);
-    }
-
-    // don't need impl->get(): reuse reference
-
-    if (mapping) {
-      // submit new aio op
-      ret = impl->backend->AioRead(mapping->oid, mapping->epoch, impl->position,
-          mapping->width, mapping->max_size, &impl->data,
-          impl, AioCompletionImpl::aio_safe_cb_read);
-    }
-
-    if (ret)
-      finish = true;
-  }
-
-  // complete aio if append success, or any error
-  if (finish) {
-    impl->retval = ret;
-    impl->complete = true;
-    impl->lock.unlock();
-    if (impl->has_callback)
-      impl->callback();
-    impl->callback_complete = true;
-    impl->cond.notify_all();
-    impl->lock.lock();
-    impl->put_unlock();
-    return;
+    impl->finish(-EIO);
   }
-
-  impl->lock.unlock();
 }
 
 void AioCompletionImpl::aio_safe_cb_write(void *arg, int ret)
 {
   AioCompletionImpl *impl = (AioCompletionImpl*)arg;
-  bool finish = false;
-
-  impl->lock.lock();
 
   assert(impl->type == ZLOG_AIO_APPEND);
 
@@ -213,97 +357,198 @@ void AioCompletionImpl::aio_safe_cb_write(void *arg, int ret)
       *impl->pposition = impl->position;
     }
     #ifdef WITH_CACHE
-    impl->cache->put(*(impl->pposition), impl->data);
+    impl->cache->put(impl->position, impl->data);
     #endif
 
-    ret = 0;
-    finish = true;
+    impl->finish(0);
   } else if (ret == -ESPIPE) {
     /*
      * We'll need to try again with a new epoch.
      */
-    ret = impl->log->UpdateView();
-    if (ret)
-      finish = true;
-  } else if (ret < 0 && ret != -EROFS) {
+    impl->append_retry(true);
+  } else if (ret == -EROFS) {
+    /*
+     * The position was marked read-only.
+     */
+    impl->append_retry(false);
+  } else if (ret < 0) {
     /*
      * Encountered a RADOS error.
      */
-    finish = true;
+    impl->finish(ret);
   } else {
     assert(0);
-    ret = -EIO;
-    finish = true;
+    impl->finish(-EIO);
   }
+}
 
-  /*
-   * Try append again with a new position. This can happen if above there is a
-   * stale epoch that we refresh, or if the position was marked read-only.
-   */
-  if (!finish) {
-    // if we are appending, get a new position
-    uint64_t position;
-    uint64_t seq_epoch;
-    boost::optional<Striper::Mapping> mapping;
-    while (true) {
-      ret = impl->log->CheckTail(&position, &seq_epoch, true);
-      if (ret) {
-        finish = true;
-        break;
-      }
-      mapping = impl->log->striper.MapPosition(position);
-      while (!mapping) {
-        ret = impl->log->ExtendMap();
-        if (ret)
-          break;
-        mapping = impl->log->striper.MapPosition(position);
-      }
-      if (ret) {
-        finish = true;
-        break;
-      }
-      if (seq_epoch != mapping->epoch) {
-        std::cerr << "trying new seq" << std::endl;
-        continue;
-      }
-
-      break;
+/*
+ * Reserve positions for every pending entry of a batch append and issue the
+ * writes as each group of positions arrives. The sequencer limits the number of
+ * positions handed out per request, so the round is split into several groups.
+ * An extra count is held on batch_outstanding while the groups are being
+ * submitted so that the round cannot complete early.
+ */
+void AioCompletionImpl::submit_batch()
+{
+  batch_round.clear();
+  for (auto index : batch_pending) {
+    batch_round.push_back(AioBatchEntry{this, index, 0, 0});
+  }
+
+  size_t size = batch_round.size();
+
+  lock.lock();
+  batch_outstanding = size + 1;
+  lock.unlock();
+
+  for (size_t first = 0; first < size;
+       first += SeqrClient::max_batch_positions) {
+    size_t count = std::min(size - first, SeqrClient::max_batch_positions);
+    sequence_batch(first, count);
+  }
+
+  batch_put(1);
+}
+
+void AioCompletionImpl::sequence_batch(size_t first, size_t count)
+{
+  log->AsyncCheckTail(count, [this, first, count](int ret,
+        uint64_t position, uint64_t seq_epoch) {
+    if (ret) {
+      for (size_t i = first; i < first + count; i++)
+        batch_round[i].ret = ret;
+      batch_put(count);
+      return;
     }
+    for (size_t i = 0; i < count; i++)
+      batch_round[first + i].position = position + i;
+    write_batch(first, count, seq_epoch);
+  });
+}
 
-    // we are still good. build a new aio
-    if (!finish) {
-      impl->position = position;
+/*
+ * Issue the writes for a group of entries. If a position is not yet mapped the
+ * rest of the group is resumed once the map has been extended.
+ */
+void AioCompletionImpl::write_batch(size_t first, size_t count,
+    uint64_t seq_epoch)
+{
+  for (size_t i = first; i < first + count; i++) {
+    auto& entry = batch_round[i];
+
+    auto mapping = log->striper.MapPosition(entry.position);
+    if (!mapping) {
+      size_t rest = first + count - i;
+      log->AsyncExtendMap(entry.position, [this, i, rest, seq_epoch](int ret) {
+        if (ret) {
+          for (size_t j = i; j < i + rest; j++)
+            batch_round[j].ret = ret;
+          batch_put(rest);
+        } else {
+          write_batch(i, rest, seq_epoch);
+        }
+      });
+      return;
+    }
 
-      // refresh
-      impl->epoch = mapping->epoch;
+    // the sequencer changed. as with a single append, a lease from the old
+    // sequencer is dropped, and the entry is retried like a position that was
+    // marked read-only.
+    if (seq_epoch != mapping->seq_epoch) {
+      log->InvalidateLease(seq_epoch);
+      aio_safe_cb_write_batch(&entry, -EROFS);
+      continue;
+    }
 
-      // don't need impl->get(): reuse reference
+    int ret = backend->AioWrite(*mapping->oid, mapping->epoch, entry.position,
+        mapping->width, mapping->max_size, batch[entry.index],
+        &entry, AioCompletionImpl::aio_safe_cb_write_batch);
+    if (ret)
+      aio_safe_cb_write_batch(&entry, ret);
+  }
+}
 
-      // submit new aio op
-      ret = impl->backend->AioWrite(mapping->oid, mapping->epoch, impl->position,
-          mapping->width, mapping->max_size,
-          Slice(impl->data.data(), impl->data.size()),
-          impl, AioCompletionImpl::aio_safe_cb_write);
-      if (ret)
-        finish = true;
+/*
+ * Drop n counts from the current round, completing the round when the last
+ * count is dropped. The completion may be freed when this returns.
+ */
+void AioCompletionImpl::batch_put(int n)
+{
+  lock.lock();
+  assert(batch_outstanding >= n);
+  batch_outstanding -= n;
+  if (batch_outstanding > 0) {
+    lock.unlock();
+    return;
+  }
+  lock.unlock();
+
+  complete_batch_round();
+}
+
+/*
+ * Process the results of a round of batch writes once all of them have
+ * completed. Entries that failed because of a stale epoch or because their
+ * position became read-only are retried at new positions in another round. If
+ * any entry failed with another error, the batch completes with that error
+ * and the entries that weren't written keep Log::invalid_position.
+ */
+void AioCompletionImpl::complete_batch_round()
+{
+  std::vector<size_t> retry;
+  bool update_view = false;
+  int ret = 0;
+
+  for (const auto& entry : batch_round) {
+    if (entry.ret == 0) {
+      batch_positions[entry.index] = entry.position;
+      #ifdef WITH_CACHE
+      cache->put(entry.position, batch[entry.index]);
+      #endif
+    } else if (entry.ret == -ESPIPE) {
+      update_view = true;
+      retry.push_back(entry.index);
+    } else if (entry.ret == -EROFS) {
+      retry.push_back(entry.index);
+    } else if (!ret) {
+      ret = entry.ret;
     }
   }
 
-  // complete aio if append success, or any error
-  if (finish) {
-    impl->retval = ret;
-    impl->complete = true;
-    impl->lock.unlock();
-    if (impl->has_callback)
-      impl->callback();
-    impl->callback_complete = true;
-    impl->cond.notify_all();
-    impl->lock.lock();
-    impl->put_unlock();
+  if (ret || retry.empty()) {
+    finish_batch(ret);
     return;
   }
 
-  impl->lock.unlock();
+  batch_pending.swap(retry);
+
+  if (update_view) {
+    log->AsyncUpdateView([this](int ret) {
+      if (ret)
+        finish_batch(ret);
+      else
+        submit_batch();
+    });
+  } else {
+    log->QueueFinisher([this] {
+      if (log->FinisherShutdown())
+        finish_batch(-ESHUTDOWN);
+      else
+        submit_batch();
+    });
+  }
+}
+
+void AioCompletionImpl::aio_safe_cb_write_batch(void *arg, int ret)
+{
+  AioBatchEntry *entry = (AioBatchEntry*)arg;
+  AioCompletionImpl *impl = entry->impl;
+
+  assert(impl->type == ZLOG_AIO_APPEND_BATCH);
+
+  entry->ret = ret;
+  impl->batch_put(1);
 }
 
 AioCompletion::~AioCompletion() {}
@@ -357,69 +602,83 @@ zlog::AioCompletion *Log::aio_create_completion()
 }
 
 /*
- * The retry for AioAppend is coordinated through the aio_safe_cb callback
- * which will dispatch a new rados operation.
+ * Sequencing, mapping, writing and retrying are all driven from callbacks (see
+ * append_sequence), so the caller never waits on the sequencer.
  */
 int LogImpl::AioAppend(AioCompletion *c, const Slice& data,
     uint64_t *pposition)
 {
-  // initial guess. see #194 about moving sequencer call into the callback for
-  // full async behavior.
-  uint64_t position;
-  uint64_t seq_epoch;
-  boost::optional<Striper::Mapping> mapping;
-  while (true) {
-    int ret = CheckTail(&position, &seq_epoch, true);
-    if (ret)
-      return ret;
+  AioCompletionImplWrapper *wrapper =
+    reinterpret_cast<AioCompletionImplWrapper*>(c);
+  AioCompletionImpl *impl = wrapper->impl_;
 
-    mapping = striper.MapPosition(position);
-    while (!mapping) {
-      ret = ExtendMap();
-      if (ret)
-        return ret;
-      mapping = striper.MapPosition(position);
-    }
+  impl->log = this;
+  impl->data.assign(data.data(), data.size());
+  impl->pposition = pposition;
+  impl->backend = backend;
+  impl->type = ZLOG_AIO_APPEND;
+  #ifdef WITH_CACHE
+  impl->cache = cache;
+  #endif
 
-    if (seq_epoch != mapping->epoch) {
-      std::cerr << "retry with new seq" << std::endl;
-      continue;
-    }
+  impl->get(); // backend now has a reference
 
-    break;
-  }
+  impl->append_sequence();
+
+  return 0;
+}
+
+int LogImpl::AioAppendBatch(AioCompletion *c,
+    const std::vector<Slice>& data, std::vector<uint64_t> *ppositions)
+{
+  return AioAppendBatch(c, data, ppositions, true);
+}
+
+/*
+ * Positions for the whole batch are reserved from the sequencer up front, and
+ * retries of individual entries are coordinated by complete_batch_round.
+ * When copy_data is false the caller guarantees that the entries remain valid
+ * until the operation completes.
+ */
+int LogImpl::AioAppendBatch(AioCompletion *c,
+    const std::vector<Slice>& data, std::vector<uint64_t> *ppositions,
+    bool copy_data)
+{
+  if (data.empty())
+    return -EINVAL;
 
   AioCompletionImplWrapper *wrapper =
     reinterpret_cast<AioCompletionImplWrapper*>(c);
   AioCompletionImpl *impl = wrapper->impl_;
 
   impl->log = this;
-  impl->data.assign(data.data(), data.size());
-  impl->position = position;
-  impl->pposition = pposition;
   impl->backend = backend;
-  impl->type = ZLOG_AIO_APPEND;
+  impl->type = ZLOG_AIO_APPEND_BATCH;
+  impl->ppositions = ppositions;
   #ifdef WITH_CACHE
   impl->cache = cache;
   #endif
-  // used to identify if state changes have occurred since dispatching the
-  // request in order to avoid reconfiguration later (important when lots of
-  // threads or contexts try to do the same thing).
-  impl->epoch = mapping->epoch;
+
+  if (copy_data) {
+    impl->batch_data.reserve(data.size());
+    impl->batch.reserve(data.size());
+    for (const auto& entry : data) {
+      impl->batch_data.emplace_back(entry.data(), entry.size());
+      impl->batch.emplace_back(impl->batch_data.back());
+    }
+  } else {
+    impl->batch = data;
+  }
+
+  impl->batch_positions.assign(data.size(), Log::invalid_position);
+  impl->batch_pending.resize(data.size());
+  std::iota(impl->batch_pending.begin(), impl->batch_pending.end(), 0);
 
   impl->get(); // backend now has a reference
 
-  int ret = backend->AioWrite(mapping->oid, mapping->epoch, position,
-      mapping->width, mapping->max_size, data,
-      impl, AioCompletionImpl::aio_safe_cb_write);
-  /*
-   * Currently aio_operate never fails. If in the future that changes then we
-   * need to make sure that references to impl and the rados completion are
-   * cleaned up correctly.
-   */
-  assert(ret == 0);
+  impl->submit_batch();
 
-  return ret;
+  return 0;
 }
 
 int LogImpl::AioRead(uint64_t position, AioCompletion *c,
@@ -445,44 +704,14 @@ int LogImpl::AioRead(uint64_t position, AioCompletion *c,
   #ifdef WITH_CACHE
   int cache_miss = cache->get(&position, datap);
   if(!cache_miss){
-
-    int ret = 0;  
-    impl->lock.lock();
-    impl->retval = ret;
-    impl->complete = true;
-    impl->lock.unlock();
-    if (impl->has_callback)
-      impl->callback();
-    impl->callback_complete = true;
-    impl->cond.notify_all();
-    impl->lock.lock();
-    impl->put_unlock();
-
-    return ret;
+    impl->finish(0);
+    return 0;
   }
   #endif
 
-  
-  auto mapping = striper.MapPosition(position);
-  while (!mapping) {
-    int ret = ExtendMap();
-    if (ret)
-      return ret;
-    mapping = striper.MapPosition(position);
-  }
-
-  int ret = backend->AioRead(mapping->oid, mapping->epoch, position,
-      mapping->width, mapping->max_size, &impl->data,
-      impl, AioCompletionImpl::aio_safe_cb_read);
-  /*
-   * Currently aio_operate never fails. If in the future that changes then we
-   * need to make sure that references to impl and the rados completion are
-   * cleaned up correctly.
-   */
-  assert(ret == 0);
-
+  impl->read_map();
 
-  return ret;
+  return 0;
 }
 
 
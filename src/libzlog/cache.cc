@@ -3,6 +3,7 @@
 #include<unordered_map>
 #include<tuple>
 #include<iterator>
+#include<memory>
 #include"include/zlog/eviction.h"
 #include"include/zlog/cache.h"
 
@@ -15,8 +16,8 @@ int Cache::put(uint64_t pos, const Slice& data){
   mut.lock();
   if(options.cache_size > 0 && data.size() < options.cache_size && cache_map.find(pos) == cache_map.end()){ 
     eviction->cache_put_miss(pos);
-    zlog_mempool::cache::string pool_data(data.data(), data.size());
-    cache_map[pos] = zlog_mempool::cache::string(pool_data);
+    cache_map[pos] = std::make_shared<const zlog_mempool::cache::string>(
+        data.data(), data.size());
   }else{
     ret = -1;
   }
@@ -28,11 +29,33 @@ int Cache::get(uint64_t* pos, std::string* data){
   #ifdef WITH_STATS
   RecordTick(options.statistics, CACHE_REQS);
   #endif
-  auto map_it = cache_map.find(*pos);
   int ret = 0;       
   mut.lock(); 
+  auto map_it = cache_map.find(*pos);
+  if(map_it != cache_map.end()){
+    data->assign(map_it->second->data(), map_it->second->size());
+    eviction->cache_get_hit(pos);
+  }else{
+    #ifdef WITH_STATS
+    RecordTick(options.statistics, CACHE_MISSES);
+    #endif
+    ret = 1;
+  }
+  mut.unlock();
+  return ret;
+}
+
+// the entry is shared with the cache, so it outlives its eviction
+int Cache::get(uint64_t* pos, PinnedSlice* data){
+  #ifdef WITH_STATS
+  RecordTick(options.statistics, CACHE_REQS);
+  #endif
+  int ret = 0;
+  mut.lock();
+  auto map_it = cache_map.find(*pos);
   if(map_it != cache_map.end()){
-    data->assign((map_it->second).data(), (map_it->second).size());
+    const auto& entry = map_it->second;
+    *data = PinnedSlice(entry->data(), entry->size(), entry);
     eviction->cache_get_hit(pos);
   }else{
     #ifdef WITH_STATS
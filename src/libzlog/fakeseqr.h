@@ -10,13 +10,14 @@ class FakeSeqrClient : public zlog::SeqrClient {
  public:
   FakeSeqrClient(const std::map<std::string, std::string>& meta,
       const std::string& name, bool empty, uint64_t position,
-      uint64_t epoch) : SeqrClient("", "", epoch), pool("0xdeadbeef")
+      uint64_t epoch) : SeqrClient("", "", epoch), pool("0xdeadbeef"),
+    name_(name)
   {
-    entry *e = &entries_[std::make_pair(pool, name)];
+    log_ = &entries_[std::make_pair(pool, name)];
     if (empty)
-      e->seq = 0;
+      log_->seq = 0;
     else
-      e->seq = position + 1;
+      log_->seq = position + 1;
   }
 
   void Connect() {}
@@ -25,13 +26,7 @@ class FakeSeqrClient : public zlog::SeqrClient {
       const std::map<std::string, std::string>& meta,
       const std::string& name, uint64_t *position, bool next)
   {
-    entry *e;
-    auto it = entries_.find(std::make_pair(pool, name));
-    if (it == entries_.end()) {
-      e = &entries_[std::make_pair(pool, name)];
-      e->seq = 0;
-    } else
-      e = &it->second;
+    entry *e = find_entry(name);
     
     if (next) {
       uint64_t tail = e->seq.fetch_add(1); // returns previous value
@@ -46,8 +41,40 @@ class FakeSeqrClient : public zlog::SeqrClient {
       const std::map<std::string, std::string>& meta,
       const std::string& name, std::vector<uint64_t>& positions, size_t count)
   {
-    assert(0);
-    exit(1);
+    if (count == 0 || count > max_batch_positions)
+      return -EINVAL;
+
+    entry *e = find_entry(name);
+
+    uint64_t tail = e->seq.fetch_add(count); // returns previous value
+    for (size_t i = 0; i < count; i++)
+      positions.push_back(tail + i);
+
+    return 0;
+  }
+
+  // the sequence is local, so the callback is invoked inline
+  virtual void AsyncCheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, size_t count, CheckTailCallback callback)
+  {
+    if (count == 0 || count > max_batch_positions) {
+      callback(-EINVAL, 0);
+      return;
+    }
+
+    entry *e = find_entry(name);
+
+    uint64_t tail = e->seq.fetch_add(count); // returns previous value
+    callback(0, tail);
+  }
+
+  // the log polls the local sequence instead
+  virtual int WaitForTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t after,
+      std::chrono::milliseconds timeout, uint64_t *tail)
+  {
     return -EOPNOTSUPP;
   }
 
@@ -60,13 +87,7 @@ class FakeSeqrClient : public zlog::SeqrClient {
     if (stream_ids.size() == 0)
       return -EINVAL;
 
-    entry *e;
-    auto it = entries_.find(std::make_pair(pool, name));
-    if (it == entries_.end()) {
-      e = &entries_[std::make_pair(pool, name)];
-      e->seq = 0;
-    } else
-      e = &it->second;
+    entry *e = find_entry(name);
 
     if (next) {
       std::map<uint64_t, std::vector<uint64_t>> result;
@@ -158,5 +179,21 @@ class FakeSeqrClient : public zlog::SeqrClient {
     stream_index_t streams;
   };
 
+  // the entry of the log that the client was created for is found without
+  // building a key, which would copy the name on every request.
+  entry *find_entry(const std::string& name) {
+    if (name == name_)
+      return log_;
+    auto it = entries_.find(std::make_pair(pool, name));
+    if (it == entries_.end()) {
+      entry *e = &entries_[std::make_pair(pool, name)];
+      e->seq = 0;
+      return e;
+    }
+    return &it->second;
+  }
+
+  const std::string name_;
+  entry *log_;
   std::map<std::pair<std::string, std::string>, entry> entries_;
 };
@@ -2,17 +2,65 @@
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <dlfcn.h>
 #include "zlog/log.h"
 #include "zlog/cache.h"
 #include "zlog/backend.h"
 #include "log_impl.h"
+#include "shmseqr.h"
 
 namespace zlog {
 
 Log::~Log() {}
 
+const uint64_t Log::invalid_position = UINT64_MAX;
+
+// options that configure the client rather than the log
+static int CheckClientOptions(const Options& options)
+{
+  if (options.seqr_channels <= 0) {
+    std::cerr << "seqr_channels must be great than 0" << std::endl;
+    return -EINVAL;
+  }
+
+  if (options.seqr_protocol != 1 && options.seqr_protocol != 2) {
+    std::cerr << "seqr_protocol must be 1 or 2" << std::endl;
+    return -EINVAL;
+  }
+
+  if (options.seqr_lease_size < 0 ||
+      (size_t)options.seqr_lease_size > SeqrClient::max_batch_positions) {
+    std::cerr << "seqr_lease_size must be between 0 and "
+      << SeqrClient::max_batch_positions << std::endl;
+    return -EINVAL;
+  }
+
+  if (options.stripe_widen_rate > 0 &&
+      (options.stripe_widen_max_width <= 0 ||
+       options.stripe_widen_interval_ms <= 0)) {
+    std::cerr << "stripe_widen_max_width and stripe_widen_interval_ms "
+      "must be great than 0" << std::endl;
+    return -EINVAL;
+  }
+
+  if (options.read_range_window <= 0) {
+    std::cerr << "read_range_window must be great than 0" << std::endl;
+    return -EINVAL;
+  }
+
+  if (options.tail_readahead <= 0 || options.tail_hole_timeout_ms < 0) {
+    std::cerr << "tail_readahead must be great than 0, and "
+      "tail_hole_timeout_ms can't be negative" << std::endl;
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
 int Log::Create(const Options& options,
     const std::string& scheme, const std::string& name,
     const std::map<std::string, std::string>& opts,
@@ -34,8 +82,12 @@ int Log::Create(const Options& options,
     return -EINVAL;
   }
 
+  int ret = CheckClientOptions(options);
+  if (ret)
+    return ret;
+
   std::shared_ptr<Backend> backend;
-  int ret = Backend::Load(scheme, opts, backend);
+  ret = Backend::Load(scheme, opts, backend);
   if (ret)
     return ret;
 
@@ -51,7 +103,10 @@ int Log::Create(const Options& options,
       << "." << 0;
     const auto cookie = exclusive_cookie_ss.str();
 
-    init_view.set_exclusive_cookie(cookie);
+    if (options.seqr_shm)
+      init_view.set_shm_name(ShmSeqrClient::NewName());
+    else
+      init_view.set_exclusive_cookie(cookie);
   } else {
     init_view.set_host(host);
     init_view.set_port(port);
@@ -83,6 +138,11 @@ int Log::Create(const Options& options,
     impl->exclusive_cookie = init_view.exclusive_cookie();
     impl->exclusive_empty = true;
     impl->exclusive_position = 0;
+  } else if (init_view.has_shm_name()) {
+    impl->shm_init = true;
+    impl->shm_init_epoch = 0;
+    impl->shm_empty = true;
+    impl->shm_position = 0;
   }
 
   ret = impl->UpdateView();
@@ -108,8 +168,12 @@ int Log::Open(const Options& options,
   if (name.empty())
     return -EINVAL;
 
+  int ret = CheckClientOptions(options);
+  if (ret)
+    return ret;
+
   std::shared_ptr<Backend> backend;
-  int ret = Backend::Load(scheme, opts, backend);
+  ret = Backend::Load(scheme, opts, backend);
   if (ret)
     return ret;
 
@@ -135,7 +199,10 @@ int Log::Open(const Options& options,
   // FIXME: these semantics are WEIRD. Also, we don't actually do anything with
   // host and port /)
   if (host.empty()) {
-    ret = impl->ProposeExclusiveMode();
+    if (options.seqr_shm)
+      ret = impl->OpenShmMode();
+    else
+      ret = impl->ProposeExclusiveMode();
     if (ret) {
       return ret;
     }
@@ -170,6 +237,10 @@ int Log::CreateWithBackend(const Options& options,
     return -EINVAL;
   }
 
+  int ret = CheckClientOptions(options);
+  if (ret)
+    return ret;
+
   // build the initial view
   std::string init_view_data;
   auto init_view = Striper::InitViewData(options.width, options.entries_per_object,
@@ -181,14 +252,17 @@ int Log::CreateWithBackend(const Options& options,
     << "." << 0;
   const auto cookie = exclusive_cookie_ss.str();
 
-  init_view.set_exclusive_cookie(cookie);
+  if (options.seqr_shm)
+    init_view.set_shm_name(ShmSeqrClient::NewName());
+  else
+    init_view.set_exclusive_cookie(cookie);
 
   if (!init_view.SerializeToString(&init_view_data)) {
     std::cerr << "failed to serialize view" << std::endl;
     return -EIO;
   }
 
-  int ret = backend->CreateLog(name, init_view_data);
+  ret = backend->CreateLog(name, init_view_data);
   if (ret) {
     std::cerr << "Failed to create log " << name << " ret "
       << ret << " (" << strerror(-ret) << ")" << std::endl;
@@ -206,9 +280,16 @@ int Log::CreateWithBackend(const Options& options,
       new LogImpl(backend, name, hoid, prefix, options));
 
   // make sure to set before update view
-  impl->exclusive_cookie = init_view.exclusive_cookie();
-  impl->exclusive_empty = true;
-  impl->exclusive_position = 0;
+  if (options.seqr_shm) {
+    impl->shm_init = true;
+    impl->shm_init_epoch = 0;
+    impl->shm_empty = true;
+    impl->shm_position = 0;
+  } else {
+    impl->exclusive_cookie = init_view.exclusive_cookie();
+    impl->exclusive_empty = true;
+    impl->exclusive_position = 0;
+  }
 
   ret = impl->UpdateView();
   if (ret) {
@@ -231,9 +312,13 @@ int Log::OpenWithBackend(const Options& options,
   if (name.empty())
     return -EINVAL;
 
+  int ret = CheckClientOptions(options);
+  if (ret)
+    return ret;
+
   std::string hoid;
   std::string prefix;
-  int ret = backend->OpenLog(name, hoid, prefix);
+  ret = backend->OpenLog(name, hoid, prefix);
   if (ret) {
     return ret;
   }
@@ -250,7 +335,10 @@ int Log::OpenWithBackend(const Options& options,
     return -EINVAL;
   }
 
-  ret = impl->ProposeExclusiveMode();
+  if (options.seqr_shm)
+    ret = impl->OpenShmMode();
+  else
+    ret = impl->ProposeExclusiveMode();
   if (ret)
     return ret;
 
@@ -259,4 +347,78 @@ int Log::OpenWithBackend(const Options& options,
   return 0;
 }
 
+/*
+ * Logs are grouped by the endpoint of their sequencer, and each group is sent
+ * through the sequencer client of one of its logs. A log whose request fails,
+ * for instance because its view is out of date, is retried on its own with
+ * CheckTail, which handles those cases.
+ */
+int CheckTails(const std::vector<Log*>& logs, std::vector<uint64_t> *tails)
+{
+  struct Group {
+    std::shared_ptr<SeqrClient> seq;
+    std::vector<size_t> logs;
+    std::vector<SeqrClient::TailQuery> queries;
+  };
+
+  std::map<std::string, Group> groups;
+  std::vector<size_t> retry;
+
+  tails->assign(logs.size(), 0);
+
+  for (size_t i = 0; i < logs.size(); i++) {
+    auto impl = static_cast<LogImpl*>(logs[i]);
+
+    auto snapshot = impl->striper.GetSnapshot();
+    auto seq = snapshot ? snapshot->seqr : nullptr;
+
+    if (!seq) {
+      retry.push_back(i);
+      continue;
+    }
+
+    // a sequencer that isn't remote only serves its own log
+    std::stringstream key;
+    if (seq->Host().empty())
+      key << seq.get();
+    else
+      key << seq->Host() << ":" << seq->Port();
+
+    auto& group = groups[key.str()];
+    if (!group.seq)
+      group.seq = seq;
+
+    SeqrClient::TailQuery query;
+    query.epoch = snapshot->epoch;
+    query.meta = impl->backend_meta;
+    query.name = impl->name;
+    query.next = false;
+    query.count = 1;
+
+    group.logs.push_back(i);
+    group.queries.push_back(query);
+  }
+
+  for (auto& it : groups) {
+    auto& group = it.second;
+    group.seq->CheckTails(group.queries);
+    for (size_t j = 0; j < group.logs.size(); j++) {
+      const auto& query = group.queries[j];
+      if (query.ret)
+        retry.push_back(group.logs[j]);
+      else
+        (*tails)[group.logs[j]] = query.position;
+    }
+  }
+
+  int ret = 0;
+  for (auto i : retry) {
+    int r = logs[i]->CheckTail(&(*tails)[i]);
+    if (r && !ret)
+      ret = r;
+  }
+
+  return ret;
+}
+
 }
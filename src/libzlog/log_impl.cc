@@ -1,11 +1,15 @@
 #include "log_impl.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <boost/asio/ip/host_name.hpp>
 #include <boost/uuid/uuid.hpp>
@@ -19,11 +23,29 @@
 #include "include/zlog/backend.h"
 #include "include/zlog/cache.h"
 
+#include "monitoring/statistics.h"
+
 #include "fakeseqr.h"
+#include "shmseqr.h"
 #include "striper.h"
 
 namespace zlog {
 
+// a sequencer holds the requests for a log that it is initializing until the
+// log is ready, so -EAGAIN is only seen when an initialization fails, or from
+// a shared-memory sequencer that is being initialized. the request is retried
+// with an exponential backoff.
+static const std::chrono::milliseconds max_seqr_backoff(1000);
+
+static std::chrono::milliseconds next_backoff(
+    std::chrono::milliseconds backoff)
+{
+  return std::min(backoff * 2, max_seqr_backoff);
+}
+
+// interval between polls of a sequencer that can't wait for the tail
+static const std::chrono::milliseconds max_tail_poll_interval(10);
+
 int LogImpl::Open(const std::string& scheme, const std::string& name,
     const std::map<std::string, std::string>& opts, LogImpl **logpp,
     std::shared_ptr<Backend> *out_backend)
@@ -65,6 +87,20 @@ int LogImpl::Open(const std::string& scheme, const std::string& name,
 
 LogImpl::~LogImpl()
 { 
+  if (views_watched)
+    backend->UnwatchViews(views_watch);
+
+  // the unused part of a lease is filled by the finisher as it drains
+  DropLease();
+
+  // the finisher goes first because its jobs may wait on the view updater
+  {
+    std::lock_guard<std::mutex> l(finisher_lock);
+    finisher_shutdown = true;
+  }
+  finisher_cond.notify_one();
+  finisher_thread.join();
+
   {
     std::lock_guard<std::mutex> l(lock);
     shutdown = true;
@@ -92,7 +128,10 @@ int LogImpl::UpdateView()
 
   bool done = false;
   std::condition_variable cond;
-  view_update_waiters.emplace_back(&cond, &done);
+  view_update_waiters.emplace_back([&] {
+    done = true;
+    cond.notify_one();
+  });
 
   view_update.notify_one();
   cond.wait(lk, [&done] { return done; });
@@ -100,44 +139,168 @@ int LogImpl::UpdateView()
   return 0;
 }
 
+void LogImpl::AsyncUpdateView(std::function<void(int)> callback)
+{
+  std::lock_guard<std::mutex> lk(lock);
+
+  view_update_waiters.emplace_back([this, callback] {
+    QueueFinisher([callback] { callback(0); });
+  });
+
+  view_update.notify_one();
+}
+
+// extending the map proposes views synchronously, so it runs on the finisher
+// thread. extensions are serialized there, and a request for a position that
+// an earlier extension already covered completes without creating another
+// view.
+void LogImpl::AsyncExtendMap(uint64_t position,
+    std::function<void(int)> callback)
+{
+  const auto start = std::chrono::steady_clock::now();
+  QueueFinisher([this, position, callback, start] {
+    int ret = 0;
+    if (!striper.MapPosition(position))
+      ret = ExtendMap();
+    RecordExtendStall(start);
+    callback(ret);
+  });
+}
+
+// the positions up to map_extend_distance past the tail are kept mapped. the
+// extension runs on the finisher, and at most one is queued at a time.
+void LogImpl::MaybeExtendMap(uint64_t tail)
+{
+  if (options.map_extend_distance <= 0)
+    return;
+
+  const uint64_t target = tail + options.map_extend_distance;
+  {
+    auto snapshot = striper.GetSnapshot();
+    if (!snapshot || target <= snapshot->MaxPosition())
+      return;
+  }
+
+  if (extending.exchange(true))
+    return;
+
+  QueueFinisher([this, target] {
+    while (striper.GetSnapshot()->MaxPosition() < target) {
+      int ret = ExtendMap();
+      if (ret) {
+        std::cerr << "failed to extend map " << ret << std::endl;
+        break;
+      }
+    }
+    extending = false;
+  });
+}
+
+void LogImpl::RecordExtendStall(std::chrono::steady_clock::time_point start)
+{
+  const auto stall = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  RecordTick(options.statistics, MAP_EXTEND_STALLS);
+  MeasureTime(options.statistics, MAP_EXTEND_STALL_MICROS, stall.count());
+}
+
+void LogImpl::QueueFinisher(std::function<void()> fn,
+    std::chrono::milliseconds delay)
+{
+  auto when = std::chrono::steady_clock::now() + delay;
+  std::lock_guard<std::mutex> lk(finisher_lock);
+  finisher_queue.emplace(when, std::move(fn));
+  finisher_cond.notify_one();
+}
+
+bool LogImpl::FinisherShutdown()
+{
+  std::lock_guard<std::mutex> lk(finisher_lock);
+  return finisher_shutdown;
+}
+
+// on shutdown every job in the queue is run before exiting, including delayed
+// jobs, so that the operations waiting on them complete. a job that would be
+// delayed again checks FinisherShutdown() and fails instead.
+void LogImpl::Finisher()
+{
+  std::unique_lock<std::mutex> lk(finisher_lock);
+  while (true) {
+    if (finisher_queue.empty()) {
+      if (finisher_shutdown)
+        break;
+      finisher_cond.wait(lk);
+      continue;
+    }
+
+    auto it = finisher_queue.begin();
+    if (!finisher_shutdown &&
+        it->first > std::chrono::steady_clock::now()) {
+      finisher_cond.wait_until(lk, it->first);
+      continue;
+    }
+
+    auto fn = std::move(it->second);
+    finisher_queue.erase(it);
+
+    lk.unlock();
+    fn();
+    lk.lock();
+  }
+}
+
+void LogImpl::ViewsChanged()
+{
+  std::lock_guard<std::mutex> lk(lock);
+  views_changed = true;
+  view_update.notify_one();
+}
+
 void LogImpl::ViewUpdater()
 {
+  // set once views are applied, and cleared when the sequencer is built
+  bool update_seqr = false;
+
   while (true) {
     {
       std::unique_lock<std::mutex> lk(lock);
       view_update.wait(lk, [&] {
-          return !view_update_waiters.empty() || shutdown;
+          return !view_update_waiters.empty() || views_changed || shutdown;
           });
       if (shutdown)
         break;
+      views_changed = false;
     }
 
+    // a new client starts from the view checkpoint when there is one
+    if (striper.Empty() && LoadViewCheckpoint())
+      update_seqr = true;
+
     // striper initialized from epoch 0
     uint64_t epoch = striper.Empty() ? 0 : striper.Epoch() + 1;
 
     // query for new views since epoch
     std::map<uint64_t, std::string> views;
-    int ret = backend->ReadViews(hoid, epoch, views);
+    int ret = backend->ReadViews(hoid, epoch, max_views_per_read, views);
     if (ret) {
       std::cerr << "read views error " << ret << std::endl;
       continue;
     }
 
     // no updates found
-    if (views.empty()) {
+    if (views.empty() && !update_seqr) {
       std::lock_guard<std::mutex> lk(lock);
-      for (auto w : view_update_waiters) {
-        w.first->notify_one();
-        *w.second = true;
+      for (auto& w : view_update_waiters) {
+        w();
       }
       view_update_waiters.clear();
       continue;
     }
 
     // apply updates. we are going to apply all the updates, but not build a new
-    // sequencer until all updates are applied. if a client uses a sequencer
-    // tagged with an older epoch, then they will notice and retry. the race is
-    // safe, and very narrow.
+    // sequencer until all updates are applied. clients that see the new views
+    // before the sequencer wait for this thread instead of taking positions
+    // from the old sequencer that would be retried.
     for (auto it = views.begin(); it != views.end(); it++) {
       if (it->first != epoch) {
         std::cerr << "view gap found. very bad." << std::endl;
@@ -145,15 +308,32 @@ void LogImpl::ViewUpdater()
         exit(0);
         return;
       }
-      ret = striper.Add(it->first, it->second);
-      if (ret) {
-        std::cerr << "failed to add view" << std::endl;
-        exit(1);
-        return;
-      }
       epoch++;
     }
 
+    ret = striper.Add(views);
+    if (ret) {
+      std::cerr << "failed to add view" << std::endl;
+      exit(1);
+      return;
+    }
+
+    if (!views.empty())
+      update_seqr = true;
+
+    // there may be more views to read
+    if (views.size() == max_views_per_read)
+      continue;
+
+    update_seqr = false;
+
+    // views that only extend the log keep the sequencer
+    {
+      auto snapshot = striper.GetSnapshot();
+      if (snapshot->seqr && snapshot->seqr_epoch == snapshot->seqr->Epoch())
+        continue;
+    }
+
     /*
      * build a sequencer based on the latest view. the semantics of creating and
      * opening logs, with and without sequencers or in exclusive mode, combined
@@ -167,13 +347,23 @@ void LogImpl::ViewUpdater()
     if (view.second.has_exclusive_cookie()) {
       assert(!view.second.exclusive_cookie().empty());
       if (view.second.exclusive_cookie() == exclusive_cookie) {
-        client = std::make_shared<FakeSeqrClient>(backend->meta(), name,
+        client = std::make_shared<FakeSeqrClient>(backend_meta, name,
             exclusive_empty, exclusive_position, view.first);
       }
+    } else if (view.second.has_shm_name()) {
+      // the views applied may include a newer extension of the cut that put
+      // the log in this mode, so initialization isn't tied to the latest view
+      const bool init = shm_init && view.first >= shm_init_epoch;
+      client = std::make_shared<ShmSeqrClient>(view.second.shm_name(),
+          view.first, init, init ? shm_init_epoch : view.second.shm_epoch(),
+          shm_empty, shm_position);
+      if (init)
+        shm_init = false;
     } else {
       if (view.second.has_host() && view.second.has_port()) {
         client = std::make_shared<zlog::SeqrClient>(view.second.host().c_str(),
-            view.second.port().c_str(), view.first);
+            view.second.port().c_str(), view.first, options.seqr_channels,
+            options.seqr_protocol);
       } else {
         std::cerr << "no host and port found" << std::endl;
       }
@@ -182,21 +372,56 @@ void LogImpl::ViewUpdater()
     if (client)
       client->Connect();
 
-    std::lock_guard<std::mutex> lk(lock);
+    striper.SetSequencer(client);
 
-    sequencer = client;
+    // positions leased from the old sequencer may also be handed out by the
+    // new one
+    DropLease();
   }
   std::lock_guard<std::mutex> lk(lock);
   assert(view_update_waiters.empty());
 }
 
+bool LogImpl::LoadViewCheckpoint()
+{
+  std::string data;
+  int ret = backend->ReadViewCheckpoint(hoid, &data);
+  if (ret) {
+    if (ret != -ENOENT && ret != -EOPNOTSUPP)
+      std::cerr << "failed to read view checkpoint " << ret << std::endl;
+    return false;
+  }
+
+  ret = striper.LoadCheckpoint(data);
+  if (ret) {
+    std::cerr << "failed to load view checkpoint " << ret << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+// clients may write checkpoints concurrently, and an older checkpoint may
+// replace a newer one. any checkpoint is a valid starting point, since the
+// views created after it are read when the log is opened.
+void LogImpl::WriteViewCheckpoint()
+{
+  std::string data;
+  int ret = striper.Checkpoint(&data);
+  if (ret == 0)
+    ret = backend->WriteViewCheckpoint(hoid, data);
+  if (ret && ret != -EOPNOTSUPP)
+    std::cerr << "failed to write view checkpoint " << ret << std::endl;
+}
+
 // generate a new view, but do not propose it.
 //
+// views that extend the log aren't sealed, and they are created ahead of the
+// tail. when the latest stripe is empty, the stripes before it in the same run
+// of extensions are sealed until one that has been written to is found, so
+// that the sequencer doesn't skip over the unwritten part of the run.
+//
 // TODO
-//   - with fixed number of entries per stripe, we have two different types of
-//   sealing. when creating a normal view to extend the current one, we really
-//   don't need to seal any objects. we only need to seal when mappings are
-//   going to _change_
 //   - CURRENTLY we create strictly disjoint views that are abutt. so we
 //   actually don't care what the current maximum position is in a stripe when
 //   sealing---if the stripe isn't full, the mappings to that stripe will still
@@ -204,20 +429,17 @@ void LogImpl::ViewUpdater()
 //   before they are full, we actually will care about the max position.
 //   - when sealing to trim current stripe, watch out for multiple empty stripes
 //   being present and what that might mean for calculating the max pos.
-//
-//   - Need to figure out what extending means for sealing and seqr recovery.
-//   this actually probably works correctly now. but if there were very little
-//   positions haveing been written, but lots of extended views, then the seal
-//   process would create a giant hole. the sequencer woudl start handing out
-//   positions at the end. but... we can optimize that later.
 int LogImpl::CreateNextView(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty,
-    zlog_proto::View& view, bool extend)
+    zlog_proto::View& view)
 {
   int ret = UpdateView();
   if (ret)
     return ret;
 
-  auto conf = striper.GetCurrent();
+  auto snapshot = striper.GetSnapshot();
+  auto conf = snapshot->GetCurrent();
+
+  const auto start = std::chrono::steady_clock::now();
 
   bool empty;
   uint64_t max_position;
@@ -228,34 +450,48 @@ int LogImpl::CreateNextView(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty,
     return ret;
   }
 
+  const bool stripe_empty = empty;
+  auto stripe = conf;
+  while (empty) {
+    auto prev = snapshot->PrevStripe(stripe);
+    if (!prev)
+      break;
+    stripe = std::move(*prev);
+    ret = Seal(stripe.oids, next_epoch, &max_position, &empty);
+    if (ret) {
+      std::cerr << "failed to seal " << ret << std::endl;
+      return ret;
+    }
+  }
+
+  MeasureTime(options.statistics, CUT_SEAL_MICROS,
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+
   // if the latest stripe is empty, it may also mean that the entire log is
   // empty. the output parameters correspond to max/empty of the log, not the
   // current stripe.
   uint64_t out_maxpos = 0; // initialization is ONLY for -Werror=maybe-uninitialized
   bool out_empty;
-  view = striper.LatestView().second; // start with a copy of the current view
-  if (extend) {
-    out_empty = false; // squash uninit use warning
-    assert(!pempty);
-    assert(!pmaxpos);
-    uint64_t next_pos = view.position() +
-      (view.width() * view.entries_per_object());
-    view.set_position(next_pos);
-  } else if (empty) {
-    if (conf.minpos == 0) {
+  view = snapshot->LatestView(); // start with a copy of the current view
+  view.clear_extension();
+  if (empty) {
+    if (stripe.minpos == 0) {
       // the log is empty, so out_maxpos is undefined.
       // view will have the same configuration, newer epoch
       out_empty = true;
     } else {
-      assert(conf.minpos > 0);
+      assert(stripe.minpos > 0);
       out_empty = false;
-      out_maxpos = conf.minpos - 1;
+      out_maxpos = stripe.minpos - 1;
     }
   } else {
     out_maxpos = max_position;
     out_empty = false;
-    // next stripe starts with _next_ position: current max + 1
-    view.set_position(max_position + 1);
+    // next stripe starts with _next_ position: current max + 1. when the
+    // max was found before the latest stripe, the view stays where it is.
+    if (!stripe_empty)
+      view.set_position(max_position + 1);
   }
 
   if (pepoch)
@@ -294,17 +530,22 @@ int LogImpl::ProposeNextView(uint64_t next_epoch,
   if (striper.GetCurrent().epoch != next_epoch)
     return -EINVAL;
 
+  if (options.view_checkpoint_interval > 0 &&
+      next_epoch % options.view_checkpoint_interval == 0) {
+    QueueFinisher([this] { WriteViewCheckpoint(); });
+  }
+
   return 0;
 }
 
 // Want to seal to get accurate maximum, but we don't really want to change any
 // mappings. we just need everyone to stop so the sequencer can initialize its
 // state.
-int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty, bool extend)
+int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty)
 {
   uint64_t next_epoch;
   zlog_proto::View view;
-  int ret = CreateNextView(&next_epoch, pmaxpos, pempty, view, extend);
+  int ret = CreateNextView(&next_epoch, pmaxpos, pempty, view);
   if (ret)
     return ret;
 
@@ -318,37 +559,96 @@ int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty, bool e
   return 0;
 }
 
+namespace {
+
+// the state of a seal or max pos request for one object in a stripe. the
+// requests for all the objects are issued at once, and the last one to
+// complete wakes up the waiter.
+struct SealOp {
+  int ret;
+  uint64_t pos;
+  bool empty;
+
+  std::mutex *lock;
+  std::condition_variable *cond;
+  size_t *pending;
+
+  static void Complete(void *arg, int ret) {
+    auto op = static_cast<SealOp*>(arg);
+    op->ret = ret;
+    std::lock_guard<std::mutex> lk(*op->lock);
+    if (--*op->pending == 0)
+      op->cond->notify_one();
+  }
+};
+
+// issue a request for each object and wait for all of them to complete
+template<typename Issue>
+void WaitAll(std::vector<SealOp>& ops, Issue issue)
+{
+  std::mutex lock;
+  std::condition_variable cond;
+  size_t pending = ops.size();
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    auto& op = ops[i];
+    op.lock = &lock;
+    op.cond = &cond;
+    op.pending = &pending;
+    int ret = issue(i, &op);
+    if (ret)
+      SealOp::Complete(&op, ret);
+  }
+
+  std::unique_lock<std::mutex> lk(lock);
+  cond.wait(lk, [&] { return pending == 0; });
+}
+
+}
+
+// the objects are sealed in parallel, and then their max positions are read
+// in parallel, so a cut costs two round trips regardless of the width.
 int LogImpl::Seal(const std::vector<std::string>& objects,
     uint64_t epoch, uint64_t *pmaxpos, bool *pempty)
 {
+  std::vector<SealOp> ops(objects.size());
+
   // seal objects
-  for (auto oid : objects) {
-    int ret = backend->Seal(oid, epoch);
-    if (ret) {
+  WaitAll(ops, [&](size_t i, SealOp *op) {
+    return backend->AioSeal(objects[i], epoch, op, SealOp::Complete);
+  });
+
+  for (auto& op : ops) {
+    if (op.ret) {
       std::cerr << "failed to seal object" << std::endl;
-      return ret;
+      return op.ret;
     }
   }
 
   // query objects for max pos
+  WaitAll(ops, [&](size_t i, SealOp *op) {
+    return backend->AioMaxPos(objects[i], epoch, &op->pos, &op->empty,
+        op, SealOp::Complete);
+  });
+
   uint64_t max_position = 0; // initialization is ONLY for -Werror=maybe-uninitialized
   bool initialized = false;
-  for (auto oid : objects) {
-    bool empty;
-    uint64_t pos;
-    int ret = backend->MaxPos(oid, epoch, &pos, &empty);
-    if (ret) {
-      std::cerr << "failed to find max pos ret " << ret << std::endl;
-      return ret;
+  for (auto& op : ops) {
+    if (op.ret) {
+      std::cerr << "failed to find max pos ret " << op.ret << std::endl;
+      return op.ret;
     }
 
-    if (!empty && !initialized) {
-      max_position = pos;
+    if (op.empty)
+      continue;
+
+    if (!initialized) {
+      max_position = op.pos;
       initialized = true;
       continue;
     }
 
-    max_position = std::max(max_position, pos);
+    max_position = std::max(max_position, op.pos);
   }
 
   *pempty = !initialized;
@@ -369,6 +669,9 @@ int LogImpl::ProposeSharedMode()
   assert(!view.has_exclusive_cookie());
   assert(exclusive_cookie.empty());
 
+  view.clear_shm_name();
+  view.clear_shm_epoch();
+
   return ProposeNextView(next_epoch, view);
 }
 
@@ -395,6 +698,8 @@ int LogImpl::ProposeExclusiveMode()
   // that when UpdateView is called it will pick up the new mode.
   exclusive_cookie = cookie;
   view.set_exclusive_cookie(cookie);
+  view.clear_shm_name();
+  view.clear_shm_epoch();
 
   // used in UpdateView to construct the fake sequencer instance.
   exclusive_empty = empty;
@@ -403,23 +708,199 @@ int LogImpl::ProposeExclusiveMode()
   return ProposeNextView(next_epoch, view);
 }
 
-// TODO: in order extend we use create cut which seals the current stripe.
-// really we want to extend the stripe without sealing. this is ok, we just need
-// to change the way we build the view map. later...
-//
-// TODO: if the current view is empty, create cut doesn't extend it. if a
-// sequencer hands out a bunch of positions that span the next view, but that
-// view hasn't been craeted yet AND the current view is empty which could happen
-// with a race, extend map will just keep duplicating the current map. this
-// happened with the Fill unit test that starts off appending to a position in
-// the next view. So we need to add a mode so that create cut will extend the
-// map.
-//
-// TODO: we also don't need to seal for extension
+int LogImpl::ProposeShmMode()
+{
+  bool empty;
+  uint64_t position;
+  uint64_t next_epoch;
+  zlog_proto::View view;
+  int ret = CreateNextView(&next_epoch, &position, &empty, view);
+  if (ret)
+    return ret;
+
+  // the segment of a log that is already in this mode is reused
+  if (!view.has_shm_name())
+    view.set_shm_name(ShmSeqrClient::NewName());
+  view.set_shm_epoch(next_epoch);
+  view.clear_exclusive_cookie();
+  exclusive_cookie.clear();
+
+  // used in UpdateView to initialize the segment
+  shm_init = true;
+  shm_init_epoch = next_epoch;
+  shm_empty = empty;
+  shm_position = position;
+
+  ret = ProposeNextView(next_epoch, view);
+
+  // a view proposed by another client at the same epoch must not cause the
+  // segment to be initialized with this cut later
+  shm_init = false;
+
+  return ret;
+}
+
+bool LogImpl::ShmSeqrReady()
+{
+  auto snapshot = striper.GetSnapshot();
+  if (!snapshot)
+    return false;
+  auto seq = dynamic_cast<ShmSeqrClient*>(snapshot->seqr.get());
+  return seq && seq->Ready();
+}
+
+// join the shared-memory sequencer of the log. a new cut is made when the log
+// isn't in this mode yet, or the segment hasn't been initialized for the
+// current view, such as after the host restarted.
+int LogImpl::OpenShmMode()
+{
+  if (ShmSeqrReady())
+    return 0;
+
+  int ret = ProposeShmMode();
+  if (ret) {
+    // another process may have made the cut
+    if (UpdateView() == 0 && ShmSeqrReady())
+      return 0;
+    return ret;
+  }
+
+  return 0;
+}
+
+// propose a copy of the latest view that starts where it ends. the mappings of
+// existing positions don't change, so nothing is sealed and the sequencer is
+// kept. a view proposed by another client at the same epoch may or may not
+// extend the map, so in that case the caller checks the mapping again.
 int LogImpl::ExtendMap()
 {
-  std::cout << "extending map" << std::endl;
-  return CreateCut(nullptr, nullptr, nullptr, true);
+  const uint64_t epoch = striper.Epoch();
+
+  std::lock_guard<std::mutex> lk(extend_lock);
+
+  int ret = UpdateView();
+  if (ret)
+    return ret;
+
+  // the view changed while waiting for another extension
+  auto latest = striper.LatestView();
+  if (latest.first != epoch)
+    return 0;
+
+  auto& view = latest.second;
+  view.set_position(view.position() +
+      (view.width() * view.entries_per_object()));
+  view.set_extension(true);
+
+  ret = ProposeNextView(latest.first + 1, view);
+  if (ret && striper.Epoch() > latest.first)
+    return 0;
+
+  return ret;
+}
+
+// the new layout starts after the max position of the log, which may be before
+// the stripes the log was extended with. in exclusive mode the sequencer is
+// rebuilt from the cut, so only the owner may reconfigure the log.
+int LogImpl::Reconfigure(uint32_t width, uint32_t entries_per_object,
+    uint32_t max_entry_size)
+{
+  if (width == 0 || entries_per_object == 0 || max_entry_size == 0)
+    return -EINVAL;
+
+  std::lock_guard<std::mutex> lk(extend_lock);
+
+  bool empty;
+  uint64_t position;
+  uint64_t next_epoch;
+  zlog_proto::View view;
+  int ret = CreateNextView(&next_epoch, &position, &empty, view);
+  if (ret)
+    return ret;
+
+  // the stripes after the max position were sealed while they were empty
+  if (!empty)
+    view.set_position(position + 1);
+  view.set_width(width);
+  view.set_entries_per_object(entries_per_object);
+  view.set_max_entry_size(max_entry_size);
+
+  // the sequencer is initialized from the cut, as when the mode was proposed
+  if (view.has_exclusive_cookie()) {
+    if (view.exclusive_cookie() != exclusive_cookie)
+      return -EPERM;
+    exclusive_empty = empty;
+    exclusive_position = position;
+  } else if (view.has_shm_name()) {
+    view.set_shm_epoch(next_epoch);
+    shm_init = true;
+    shm_init_epoch = next_epoch;
+    shm_empty = empty;
+    shm_position = position;
+  }
+
+  ret = ProposeNextView(next_epoch, view);
+
+  shm_init = false;
+
+  return ret;
+}
+
+int LogImpl::SetStripeWidth(int width)
+{
+  if (width <= 0)
+    return -EINVAL;
+
+  auto view = striper.LatestView().second;
+  return Reconfigure(width, view.entries_per_object(),
+      view.max_entry_size());
+}
+
+// the rate is measured by the growth of the tail, so it includes the appends
+// of every client of the log. a client without a sequencer doesn't sample.
+void LogImpl::WidenStripe(uint64_t prev_tail,
+    std::chrono::steady_clock::time_point prev_time)
+{
+  if (FinisherShutdown())
+    return;
+
+  bool sample;
+  {
+    auto snapshot = striper.GetSnapshot();
+    sample = snapshot && snapshot->seqr;
+  }
+
+  uint64_t tail = 0;
+  auto time = std::chrono::steady_clock::time_point();
+  if (sample && CheckTail(&tail) == 0) {
+    time = std::chrono::steady_clock::now();
+    const int width = StripeWidth();
+    const auto elapsed = std::chrono::duration_cast<
+      std::chrono::microseconds>(time - prev_time).count();
+    if (prev_time != std::chrono::steady_clock::time_point() &&
+        tail > prev_tail && elapsed > 0 &&
+        width < options.stripe_widen_max_width) {
+      const double rate = (double)(tail - prev_tail) * 1000000.0 /
+        elapsed / width;
+      if (rate > options.stripe_widen_rate) {
+        const int new_width = std::min(width * 2,
+            options.stripe_widen_max_width);
+        int ret = SetStripeWidth(new_width);
+        if (ret)
+          std::cerr << "failed to widen stripe " << ret << std::endl;
+
+        // the next sample starts after the cut
+        if (CheckTail(&tail) == 0)
+          time = std::chrono::steady_clock::now();
+        else
+          time = std::chrono::steady_clock::time_point();
+      }
+    }
+  }
+
+  QueueFinisher([this, tail, time] {
+    WidenStripe(tail, time);
+  }, std::chrono::milliseconds(options.stripe_widen_interval_ms));
 }
 
 int LogImpl::CheckTail(uint64_t *pposition)
@@ -430,24 +911,55 @@ int LogImpl::CheckTail(uint64_t *pposition)
 int LogImpl::CheckTail(uint64_t *pposition, uint64_t *epoch,
     bool increment)
 {
+  if (increment && options.seqr_lease_size > 1)
+    return LeasePosition(pposition, epoch);
+  return Reserve(increment ? 1 : 0, pposition, nullptr, epoch);
+}
+
+// count is zero to read the tail without reserving a position. when more than
+// one position is requested, pcount receives the number reserved.
+int LogImpl::Reserve(size_t count, uint64_t *pposition, size_t *pcount,
+    uint64_t *epoch)
+{
+  std::chrono::milliseconds backoff(1);
   while (true) {
-    std::unique_lock<std::mutex> l(lock);
-    auto seq = sequencer;
-    l.unlock();
+    auto snapshot = striper.GetSnapshot();
+    auto seq = snapshot ? snapshot->seqr.get() : nullptr;
 
     if (!seq) {
       std::cerr << "no active sequencer" << std::endl;
       return -EINVAL;
     }
 
-    int ret = seq->CheckTail(striper.Epoch(), backend->meta(),
-        name, pposition, increment);
+    // positions from a sequencer that is being replaced would be retried
+    if (snapshot->SeqrPending()) {
+      int ret = UpdateView();
+      if (ret)
+        return ret;
+      continue;
+    }
+
+    int ret;
+    if (count > 1) {
+      std::vector<uint64_t> positions;
+      ret = seq->CheckTail(snapshot->epoch, backend_meta,
+          name, positions, count);
+      if (!ret) {
+        *pposition = positions[0];
+        *pcount = positions.size();
+      }
+    } else {
+      ret = seq->CheckTail(snapshot->epoch, backend_meta,
+          name, pposition, count == 1);
+    }
     if (!ret) {
       if (epoch)
         *epoch = seq->Epoch();
+      MaybeExtendMap(*pposition);
       return 0;
     } else if (ret == -EAGAIN) {
-      sleep(1);
+      std::this_thread::sleep_for(backoff);
+      backoff = next_backoff(backoff);
       continue;
     } else if (ret == -ERANGE) {
       std::cerr << "check tail ret -ERANGE" << std::endl;
@@ -462,25 +974,357 @@ int LogImpl::CheckTail(uint64_t *pposition, uint64_t *epoch,
   return -EIO;
 }
 
+/*
+ * A sequencer that doesn't support waiting is polled, and the interval between
+ * polls grows up to a small bound.
+ */
+int LogImpl::WaitForTail(uint64_t after, std::chrono::milliseconds timeout,
+    uint64_t *ptail)
+{
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::chrono::milliseconds backoff(1);
+
+  while (true) {
+    auto snapshot = striper.GetSnapshot();
+    auto seq = snapshot ? snapshot->seqr.get() : nullptr;
+
+    if (!seq) {
+      std::cerr << "no active sequencer" << std::endl;
+      return -EINVAL;
+    }
+
+    const auto remaining = std::max(std::chrono::milliseconds(0),
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now()));
+
+    uint64_t tail;
+    int ret = seq->WaitForTail(snapshot->epoch, backend_meta, name,
+        after, remaining, &tail);
+    if (ret == -EOPNOTSUPP) {
+      ret = seq->CheckTail(snapshot->epoch, backend_meta, name,
+          &tail, false);
+      if (!ret && tail <= after) {
+        if (remaining.count() == 0) {
+          ret = -ETIMEDOUT;
+        } else {
+          std::this_thread::sleep_for(std::min(backoff, remaining));
+          backoff = std::min(backoff * 2, max_tail_poll_interval);
+          continue;
+        }
+      }
+    }
+
+    if (!ret || ret == -ETIMEDOUT) {
+      // the sequencer may limit how long it waits
+      if (ret == -ETIMEDOUT && remaining.count() > 0 &&
+          std::chrono::steady_clock::now() < deadline)
+        continue;
+      *ptail = tail;
+      return ret;
+    } else if (ret == -EAGAIN) {
+      std::this_thread::sleep_for(backoff);
+      backoff = next_backoff(backoff);
+      continue;
+    } else if (ret == -ERANGE) {
+      ret = UpdateView();
+      if (ret)
+        return ret;
+      continue;
+    }
+    return ret;
+  }
+  assert(0);
+  return -EIO;
+}
+
+void LogImpl::AsyncCheckTail(size_t count,
+    std::function<void(int, uint64_t, uint64_t)> callback)
+{
+  if (count == 1 && options.seqr_lease_size > 1)
+    AsyncLeasePosition(callback);
+  else
+    AsyncReserve(count, callback);
+}
+
+// the retry behavior matches CheckTail, except that the wait for a sequencer
+// that is initializing is scheduled on the finisher instead of sleeping.
+//
+// the request holds a reference to the sequencer, since the snapshot is
+// released before the reply arrives and replacing the sequencer would
+// otherwise fail its outstanding requests. a request that fails with -EIO
+// after the sequencer was replaced is retried with the new sequencer.
+void LogImpl::AsyncReserve(size_t count,
+    std::function<void(int, uint64_t, uint64_t)> callback,
+    std::chrono::milliseconds backoff)
+{
+  auto snapshot = striper.GetSnapshot();
+  auto seq = snapshot ? snapshot->seqr : nullptr;
+
+  if (!seq) {
+    std::cerr << "no active sequencer" << std::endl;
+    callback(-EINVAL, 0, 0);
+    return;
+  }
+
+  if (snapshot->SeqrPending()) {
+    AsyncUpdateView([this, count, callback](int ret) {
+      if (ret)
+        callback(ret, 0, 0);
+      else
+        AsyncReserve(count, callback);
+    });
+    return;
+  }
+
+  const uint64_t seq_epoch = seq->Epoch();
+  seq->AsyncCheckTail(snapshot->epoch, backend_meta, name, count,
+      [this, seq, seq_epoch, count, callback, backoff](int ret,
+        uint64_t position) {
+    if (!ret) {
+      MaybeExtendMap(position + count - 1);
+      callback(0, position, seq_epoch);
+    } else if (ret == -EIO &&
+        striper.GetSnapshot()->seqr_epoch != seq_epoch) {
+      AsyncReserve(count, callback);
+    } else if (ret == -EAGAIN) {
+      QueueFinisher([this, count, callback, backoff] {
+        if (FinisherShutdown())
+          callback(-ESHUTDOWN, 0, 0);
+        else
+          AsyncReserve(count, callback, next_backoff(backoff));
+      }, backoff);
+    } else if (ret == -ERANGE) {
+      std::cerr << "check tail ret -ERANGE" << std::endl;
+      AsyncUpdateView([this, count, callback](int ret) {
+        if (ret)
+          callback(ret, 0, 0);
+        else
+          AsyncReserve(count, callback);
+      });
+    } else {
+      callback(ret, 0, 0);
+    }
+  });
+}
+
+/*
+ * Position leases. With Options::seqr_lease_size set, a position for an append
+ * is taken from a block of positions reserved from the sequencer in a single
+ * request rather than with a round trip per append. A lease is only valid for
+ * the sequencer that handed it out. It is dropped when the sequencer changes
+ * or an append notices a stale epoch. Positions that were never handed out
+ * are filled so that readers don't wait on the holes, unless the sequencer
+ * changed and may hand them out again.
+ */
+bool LogImpl::TakeLeasedPosition(uint64_t *pposition, uint64_t *pepoch)
+{
+  auto cur = std::atomic_load(&lease);
+  if (!cur)
+    return false;
+
+  uint64_t position = cur->next.fetch_add(1);
+  if (position >= cur->end)
+    return false;
+
+  *pposition = position;
+  if (pepoch)
+    *pepoch = cur->epoch;
+
+  return true;
+}
+
+// concurrent requests for a position that find the lease exhausted are queued
+// behind a single request for a new lease.
+void LogImpl::AsyncLeasePosition(
+    std::function<void(int, uint64_t, uint64_t)> callback)
+{
+  uint64_t position;
+  uint64_t epoch;
+  if (TakeLeasedPosition(&position, &epoch)) {
+    MaybeExtendMap(position);
+    callback(0, position, epoch);
+    return;
+  }
+
+  std::unique_lock<std::mutex> l(lease_lock);
+
+  // a refill may have completed in the meantime
+  if (TakeLeasedPosition(&position, &epoch)) {
+    l.unlock();
+    MaybeExtendMap(position);
+    callback(0, position, epoch);
+    return;
+  }
+
+  lease_waiters.push_back(callback);
+  if (lease_refill)
+    return;
+  lease_refill = true;
+  l.unlock();
+
+  AsyncReserve(options.seqr_lease_size,
+      [this](int ret, uint64_t position, uint64_t epoch) {
+    RefillLease(ret, ret ? nullptr : std::make_shared<Lease>(position,
+          options.seqr_lease_size, epoch));
+  });
+}
+
+// the synchronous counterpart of AsyncLeasePosition. a caller that finds the
+// lease exhausted while a refill is outstanding waits for it rather than
+// requesting a lease of its own, which would replace the refilled lease and
+// leave most of it to be filled. the caller that makes the request takes the
+// first position, and the rest are leased.
+int LogImpl::LeasePosition(uint64_t *pposition, uint64_t *pepoch)
+{
+  while (true) {
+    if (TakeLeasedPosition(pposition, pepoch)) {
+      MaybeExtendMap(*pposition);
+      return 0;
+    }
+
+    std::unique_lock<std::mutex> l(lease_lock);
+
+    // a refill may have completed in the meantime
+    if (TakeLeasedPosition(pposition, pepoch)) {
+      l.unlock();
+      MaybeExtendMap(*pposition);
+      return 0;
+    }
+
+    if (lease_refill) {
+      lease_cond.wait(l, [this] { return !lease_refill; });
+      continue;
+    }
+    lease_refill = true;
+    l.unlock();
+
+    uint64_t position;
+    size_t count;
+    uint64_t epoch;
+    int ret = Reserve(options.seqr_lease_size, &position, &count, &epoch);
+    if (ret) {
+      RefillLease(ret, nullptr);
+      return ret;
+    }
+
+    *pposition = position;
+    if (pepoch)
+      *pepoch = epoch;
+
+    RefillLease(0, std::make_shared<Lease>(position + 1, count - 1, epoch));
+
+    return 0;
+  }
+}
+
+// the new lease is installed before the refill is marked complete, so that a
+// request that finds the lease exhausted in between doesn't start another.
+void LogImpl::RefillLease(int ret, std::shared_ptr<Lease> new_lease)
+{
+  if (!ret)
+    InstallLease(new_lease);
+
+  std::list<std::function<void(int, uint64_t, uint64_t)>> waiters;
+  {
+    std::lock_guard<std::mutex> l(lease_lock);
+    lease_refill = false;
+    waiters.swap(lease_waiters);
+  }
+  lease_cond.notify_all();
+
+  if (ret) {
+    for (auto& w : waiters)
+      w(ret, 0, 0);
+    return;
+  }
+
+  // waiters that find the new lease exhausted queue up for another one
+  for (auto& w : waiters)
+    AsyncLeasePosition(w);
+}
+
+void LogImpl::InstallLease(std::shared_ptr<Lease> new_lease)
+{
+  auto old_lease = std::atomic_exchange(&lease, new_lease);
+  if (old_lease)
+    ReleaseLease(old_lease);
+}
+
+// drop the lease if it was handed out by the sequencer at epoch
+void LogImpl::InvalidateLease(uint64_t epoch)
+{
+  auto cur = std::atomic_load(&lease);
+  if (cur && cur->epoch == epoch) {
+    std::shared_ptr<Lease> empty;
+    if (std::atomic_compare_exchange_strong(&lease, &cur, empty))
+      ReleaseLease(cur);
+  }
+}
+
+void LogImpl::DropLease()
+{
+  auto old_lease = std::atomic_exchange(&lease, std::shared_ptr<Lease>());
+  if (old_lease)
+    ReleaseLease(old_lease);
+}
+
+// claim the positions that haven't been handed out and fill them, as long as
+// the sequencer that handed out the lease is still current, such as when the
+// log is closed. a new sequencer starts after the positions sealed by the
+// cut that replaced it, and may hand out the rest of the lease again, so
+// after a change the positions are left alone.
+void LogImpl::ReleaseLease(std::shared_ptr<Lease> old_lease)
+{
+  uint64_t position = old_lease->next.exchange(old_lease->end);
+  if (position >= old_lease->end)
+    return;
+
+  const uint64_t epoch = old_lease->epoch;
+  auto current = [this, epoch] {
+    return striper.GetSnapshot()->seqr_epoch == epoch;
+  };
+  if (!current())
+    return;
+
+  const uint64_t end = old_lease->end;
+  QueueFinisher([this, position, end, current] {
+    for (uint64_t pos = position; pos < end && current(); pos++) {
+      int ret = Fill(pos);
+      if (ret && ret != -EROFS) {
+        std::cerr << "failed to fill leased position " << pos
+          << " ret " << ret << std::endl;
+      }
+    }
+  });
+}
+
 #ifdef STREAMING_SUPPORT
 int LogImpl::CheckTail(const std::set<uint64_t>& stream_ids,
     std::map<uint64_t, std::vector<uint64_t>>& stream_backpointers,
     uint64_t *pposition, bool increment)
 {
+  std::chrono::milliseconds backoff(1);
   for (;;) {
-    std::unique_lock<std::mutex> l(lock);
-    auto seq = sequencer;
-    l.unlock();
+    auto snapshot = striper.GetSnapshot();
+    auto seq = snapshot ? snapshot->seqr.get() : nullptr;
 
     if (!seq) {
       std::cerr << "no active sequencer" << std::endl;
       return -EINVAL;
     }
 
-    int ret = seq->CheckTail(striper.Epoch(), backend->meta(),
+    if (snapshot->SeqrPending()) {
+      int ret = UpdateView();
+      if (ret)
+        return ret;
+      continue;
+    }
+
+    int ret = seq->CheckTail(snapshot->epoch, backend_meta,
         name, stream_ids, stream_backpointers, pposition, increment);
     if (ret == -EAGAIN) {
-      sleep(1);
+      std::this_thread::sleep_for(backoff);
+      backoff = next_backoff(backoff);
       continue;
     } else if (ret == -ERANGE) {
       ret = UpdateView();
@@ -510,7 +1354,7 @@ int LogImpl::Read(uint64_t position, std::string *data)
         return ret;
       continue;
     }
-    int ret = backend->Read(mapping->oid, mapping->epoch, position,
+    int ret = backend->Read(*mapping->oid, mapping->epoch, position,
         mapping->width, mapping->max_size, data);
 
     if (!ret){
@@ -532,6 +1376,202 @@ int LogImpl::Read(uint64_t position, std::string *data)
   return -EIO;
 }
 
+// a miss doesn't add the entry to the cache, since that would copy the entry
+// the read was meant to share.
+int LogImpl::ReadPinned(uint64_t position, PinnedSlice *data)
+{
+  #ifdef WITH_CACHE
+  int cache_miss = cache->get(&position, data);
+  if(!cache_miss) return 0;
+  #endif
+
+  while (true) {
+    auto mapping = striper.MapPosition(position);
+    if (!mapping) {
+      int ret = ExtendMap();
+      if (ret < 0)
+        return ret;
+      continue;
+    }
+    int ret = backend->ReadPinned(*mapping->oid, mapping->epoch, position,
+        mapping->width, mapping->max_size, data);
+
+    if (ret == -ESPIPE) {
+      ret = UpdateView();
+      if (ret)
+        return ret;
+      continue;
+    }
+    return ret;
+  }
+  assert(0);
+  return -EIO;
+}
+
+namespace {
+
+// the reads of the positions [begin, end), one for each object that the
+// positions are striped across. the read at index i returns the positions
+// begin + i, begin + i + stride, and so on. the reads may complete after the
+// range read that issued them has returned, so they are shared with the
+// backend callbacks.
+struct RangeChunk {
+  struct Read {
+    bool done;
+    int ret;
+    std::vector<int> results;
+    std::vector<std::string> data;
+  };
+
+  uint64_t begin;
+  uint64_t end;
+  uint32_t stride;
+  std::vector<std::shared_ptr<Read>> reads;
+};
+
+struct RangeReadState {
+  std::mutex lock;
+  std::condition_variable cond;
+};
+
+}
+
+/*
+ * The range is split into chunks of at most max_entries_per_range_read rows
+ * of a stripe, and a chunk is read with one backend request for each object
+ * in the stripe. Chunks are issued ahead of the position being delivered as
+ * long as the number of requests in flight stays within read_range_window.
+ * The positions past the end of the mapped log haven't been written, so they
+ * are reported without extending the map.
+ */
+int LogImpl::ReadRange(uint64_t begin, uint64_t end,
+    std::function<int(uint64_t, int, const Slice&)> callback)
+{
+  if (begin > end)
+    return -EINVAL;
+
+  auto state = std::make_shared<RangeReadState>();
+  std::deque<RangeChunk> chunks;
+  size_t in_flight = 0;
+  bool view_updated = false;
+
+  uint64_t position = begin;
+  uint64_t next = begin;
+  while (position < end) {
+    // issue the next chunks. there is always at least one chunk in flight.
+    while (next < end) {
+      auto snapshot = striper.GetSnapshot();
+      auto mapping = snapshot->MapPosition(next);
+      if (!mapping && !view_updated) {
+        int ret = UpdateView();
+        if (ret)
+          return ret;
+        view_updated = true;
+        continue;
+      }
+
+      RangeChunk chunk;
+      chunk.begin = next;
+      if (!mapping) {
+        chunk.end = end;
+        chunk.stride = 1;
+      } else {
+        chunk.stride = mapping->width;
+        chunk.end = std::min(end, std::min(mapping->maxpos + 1,
+              next + (uint64_t)chunk.stride * max_entries_per_range_read));
+      }
+
+      const size_t num_reads = !mapping ? 0 :
+        std::min((uint64_t)chunk.stride, chunk.end - chunk.begin);
+      if (!chunks.empty() && in_flight + num_reads >
+          (size_t)options.read_range_window)
+        break;
+
+      for (size_t i = 0; i < num_reads; i++) {
+        const uint64_t first = chunk.begin + i;
+        auto m = snapshot->MapPosition(first);
+        assert(m);
+        const uint32_t count = (chunk.end - first + chunk.stride - 1) /
+          chunk.stride;
+
+        auto read = std::make_shared<RangeChunk::Read>();
+        read->done = false;
+        chunk.reads.push_back(read);
+
+        int ret = backend->AioReadRange(*m->oid, m->epoch, first, count,
+            m->width, m->max_size, &read->results, &read->data, nullptr,
+            [state, read](void *arg, int ret) {
+          std::lock_guard<std::mutex> lk(state->lock);
+          read->ret = ret;
+          read->done = true;
+          state->cond.notify_all();
+        });
+        if (ret) {
+          std::lock_guard<std::mutex> lk(state->lock);
+          read->ret = ret;
+          read->done = true;
+        }
+      }
+
+      in_flight += num_reads;
+      chunks.push_back(std::move(chunk));
+      next = chunks.back().end;
+    }
+
+    // deliver the positions of the oldest chunk
+    auto& chunk = chunks.front();
+    bool stale = false;
+    for (; position < chunk.end; position++) {
+      if (chunk.reads.empty()) {
+        int ret = callback(position, -ENOENT, Slice());
+        if (ret)
+          return ret;
+        continue;
+      }
+
+      const uint64_t offset = position - chunk.begin;
+      auto& read = chunk.reads[offset % chunk.stride];
+      {
+        std::unique_lock<std::mutex> lk(state->lock);
+        state->cond.wait(lk, [&read] { return read->done; });
+      }
+
+      if (read->ret == -ESPIPE) {
+        stale = true;
+        break;
+      } else if (read->ret) {
+        return read->ret;
+      }
+
+      const size_t index = offset / chunk.stride;
+      const int ret = read->results[index];
+      if (ret && ret != -ENOENT && ret != -ENODATA)
+        return ret;
+
+      int cb_ret = callback(position, ret,
+          ret ? Slice() : Slice(read->data[index]));
+      if (cb_ret)
+        return cb_ret;
+    }
+
+    // the chunks read with the stale view are read again
+    if (stale) {
+      int ret = UpdateView();
+      if (ret)
+        return ret;
+      chunks.clear();
+      in_flight = 0;
+      next = position;
+      continue;
+    }
+
+    in_flight -= chunk.reads.size();
+    chunks.pop_front();
+  }
+
+  return 0;
+}
+
 #ifdef STREAMING_SUPPORT
 int LogImpl::Read(uint64_t epoch, uint64_t position, std::string *data)
 {
@@ -569,26 +1609,31 @@ int LogImpl::Append(const Slice& data, uint64_t *pposition)
     // and retry. note that one could optimize this case and check only that the
     // sequencer was invalidated even if the view changed.
     auto mapping = striper.MapPosition(position);
-    while (!mapping) {
-      ret = ExtendMap();
-      if (ret < 0)
-        return ret;
-      mapping = striper.MapPosition(position);
+    if (!mapping) {
+      const auto start = std::chrono::steady_clock::now();
+      while (!mapping) {
+        ret = ExtendMap();
+        if (ret < 0)
+          return ret;
+        mapping = striper.MapPosition(position);
+      }
+      RecordExtendStall(start);
     }
 
-    if (seq_epoch != mapping->epoch) {
+    if (seq_epoch != mapping->seq_epoch) {
       std::cerr << "retry with new seq" << std::endl;
+      InvalidateLease(seq_epoch);
       continue;
     }
 
-    ret = backend->Write(mapping->oid, data, mapping->epoch, position,
+    ret = backend->Write(*mapping->oid, data, mapping->epoch, position,
         mapping->width, mapping->max_size);
     if (!ret) {
       if (pposition){
         *pposition = position;
       }
       #ifdef WITH_CACHE
-      cache->put(*pposition, data);
+      cache->put(position, data);
       #endif
       return 0;
     }
@@ -609,6 +1654,20 @@ int LogImpl::Append(const Slice& data, uint64_t *pposition)
   return -EIO;
 }
 
+// the batch is appended through the asynchronous interface so that the writes
+// for all entries are in flight at the same time, fanned out across the objects
+// in the stripe. see AioAppendBatch for the retry behavior.
+int LogImpl::AppendBatch(const std::vector<Slice>& data,
+    std::vector<uint64_t> *ppositions)
+{
+  std::unique_ptr<AioCompletion> c(Log::aio_create_completion());
+  int ret = AioAppendBatch(c.get(), data, ppositions, false);
+  if (ret)
+    return ret;
+  c->WaitForComplete();
+  return c->ReturnValue();
+}
+
 int LogImpl::Fill(uint64_t position)
 {
   while (true) {
@@ -620,7 +1679,7 @@ int LogImpl::Fill(uint64_t position)
       continue;
     }
 
-    int ret = backend->Fill(mapping->oid, mapping->epoch, position,
+    int ret = backend->Fill(*mapping->oid, mapping->epoch, position,
         mapping->width, mapping->max_size);
     if (!ret)
       return 0;
@@ -668,7 +1727,7 @@ int LogImpl::Trim(uint64_t position)
       continue;
     }
 
-    int ret = backend->Trim(mapping->oid, mapping->epoch, position,
+    int ret = backend->Trim(*mapping->oid, mapping->epoch, position,
         mapping->width, mapping->max_size);
     if (!ret){
       #ifdef WITH_CACHE
@@ -689,3 +1748,4 @@ int LogImpl::Trim(uint64_t position)
 }
 
 }
+
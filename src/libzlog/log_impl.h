@@ -1,6 +1,11 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <CivetServer.h>
@@ -36,10 +41,15 @@ class LogImpl : public Log {
       const Options& opts) :
     shutdown(false),
     backend(backend),
-    sequencer(nullptr),
+    backend_meta(backend->meta()),
     name(name),
     hoid(hoid),
     striper(prefix),
+    shm_init(false),
+    views_changed(false),
+    extending(false),
+    finisher_shutdown(false),
+    lease_refill(false),
     options(opts)
 #ifdef WITH_STATS
     ,metrics_http_server_(nullptr),
@@ -56,6 +66,14 @@ class LogImpl : public Log {
     }
 #endif
     view_update_thread = std::thread(&LogImpl::ViewUpdater, this);
+    finisher_thread = std::thread(&LogImpl::Finisher, this);
+    views_watched = backend->WatchViews(hoid, [this] { ViewsChanged(); },
+        &views_watch) == 0;
+    if (options.stripe_widen_rate > 0) {
+      QueueFinisher([this] {
+        WidenStripe(0, std::chrono::steady_clock::time_point());
+      }, std::chrono::milliseconds(options.stripe_widen_interval_ms));
+    }
   }
 
   ~LogImpl();
@@ -64,14 +82,54 @@ class LogImpl : public Log {
   void ViewUpdater();
   int UpdateView();
 
+  // wake up the view updater when the backend reports a view change
+  void ViewsChanged();
+
+  // the view updater reads at most this many views at a time
+  static const uint32_t max_views_per_read = 1000;
+
+  // a range read asks an object for at most this many entries at a time
+  static const uint32_t max_entries_per_range_read = 128;
+
+  // initialize the striper from the view checkpoint, if there is one
+  bool LoadViewCheckpoint();
+
+  // write a checkpoint of the current views
+  void WriteViewCheckpoint();
+
+  // non-blocking versions of UpdateView and ExtendMap for the aio path. the
+  // callback is invoked on the finisher thread.
+  void AsyncUpdateView(std::function<void(int)> callback);
+  void AsyncExtendMap(uint64_t position, std::function<void(int)> callback);
+
+  // extend the map in the background when tail is close to its end
+  void MaybeExtendMap(uint64_t tail);
+
+  // record the time an operation waited for the map to be extended
+  void RecordExtendStall(std::chrono::steady_clock::time_point start);
+
+  // run fn on the finisher thread after delay. continuations that may block,
+  // or that would otherwise recurse through inline completions, are run here.
+  void Finisher();
+  void QueueFinisher(std::function<void()> fn,
+      std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+
+  // set once the log is being destroyed. the finisher then runs the jobs
+  // left in its queue without waiting for their delay, and jobs that would
+  // retry fail with -ESHUTDOWN instead.
+  bool FinisherShutdown();
+
   int CreateNextView(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty,
-      zlog_proto::View& view, bool extend = false);
+      zlog_proto::View& view);
   int ProposeNextView(uint64_t next_epoch, const zlog_proto::View& view);
-  int CreateCut(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty, bool extend = false);
+  int CreateCut(uint64_t *pepoch, uint64_t *pmaxpos, bool *pempty);
   int Seal(const std::vector<std::string>& objects,
       uint64_t epoch, uint64_t *pmaxpos, bool *pempty);
   int ProposeSharedMode();
   int ProposeExclusiveMode();
+  int ProposeShmMode();
+  int OpenShmMode();
+  bool ShmSeqrReady();
 
   static int Open(const std::string& scheme, const std::string& name,
       const std::map<std::string, std::string>& opts, LogImpl **logpp,
@@ -80,6 +138,43 @@ class LogImpl : public Log {
  public:
   int CheckTail(uint64_t *pposition) override;
   int CheckTail(uint64_t *pposition, uint64_t *epoch, bool increment);
+  int Reserve(size_t count, uint64_t *pposition, size_t *pcount,
+      uint64_t *epoch);
+  int WaitForTail(uint64_t after, std::chrono::milliseconds timeout,
+      uint64_t *tail) override;
+
+  int OpenTailIterator(uint64_t start, TailIterator **iterator) override;
+
+  // reserve count contiguous positions without blocking. on success the
+  // callback receives the first position and the epoch of the sequencer.
+  void AsyncCheckTail(size_t count,
+      std::function<void(int, uint64_t, uint64_t)> callback);
+  void AsyncReserve(size_t count,
+      std::function<void(int, uint64_t, uint64_t)> callback,
+      std::chrono::milliseconds backoff = std::chrono::milliseconds(1));
+
+ public:
+  // a block of positions reserved from the sequencer tagged with epoch, and
+  // handed out locally one at a time. positions at or past end are not part of
+  // the lease.
+  struct Lease {
+    Lease(uint64_t position, uint64_t count, uint64_t epoch) :
+      next(position), end(position + count), epoch(epoch)
+    {}
+
+    std::atomic<uint64_t> next;
+    const uint64_t end;
+    const uint64_t epoch;
+  };
+
+  bool TakeLeasedPosition(uint64_t *pposition, uint64_t *pepoch);
+  int LeasePosition(uint64_t *pposition, uint64_t *pepoch);
+  void AsyncLeasePosition(std::function<void(int, uint64_t, uint64_t)> callback);
+  void RefillLease(int ret, std::shared_ptr<Lease> new_lease);
+  void InstallLease(std::shared_ptr<Lease> new_lease);
+  void InvalidateLease(uint64_t epoch);
+  void DropLease();
+  void ReleaseLease(std::shared_ptr<Lease> old_lease);
 
 #ifdef STREAMING_SUPPORT
 /*
@@ -99,8 +194,14 @@ class LogImpl : public Log {
  public:
   int Read(uint64_t position, std::string *data) override;
   int Read(uint64_t epoch, uint64_t position, std::string *data);
+  int ReadPinned(uint64_t position, PinnedSlice *data) override;
+
+  int ReadRange(uint64_t begin, uint64_t end,
+      std::function<int(uint64_t, int, const Slice&)> callback) override;
 
   int Append(const Slice& data, uint64_t *pposition = NULL) override;
+  int AppendBatch(const std::vector<Slice>& data,
+      std::vector<uint64_t> *ppositions = NULL) override;
 
   int Fill(uint64_t position) override;
   int Fill(uint64_t epoch, uint64_t position);
@@ -114,6 +215,11 @@ class LogImpl : public Log {
   int AioAppend(zlog::AioCompletion *c, const Slice& data,
       uint64_t *pposition = NULL) override;
 
+  int AioAppendBatch(zlog::AioCompletion *c, const std::vector<Slice>& data,
+      std::vector<uint64_t> *ppositions = NULL) override;
+  int AioAppendBatch(zlog::AioCompletion *c, const std::vector<Slice>& data,
+      std::vector<uint64_t> *ppositions, bool copy_data);
+
 #ifdef STREAMING_SUPPORT
  public:
   int OpenStream(uint64_t stream_id, zlog::Stream **streamptr) override;
@@ -132,6 +238,18 @@ class LogImpl : public Log {
 
   int ExtendMap();
 
+  // cut the log and propose a view with a new layout that starts at the next
+  // position. positions that may already be written keep their mapping.
+  int Reconfigure(uint32_t width, uint32_t entries_per_object,
+      uint32_t max_entry_size);
+  int SetStripeWidth(int width);
+
+  // widen the stripe when the appends to each object since the last sample
+  // exceed options.stripe_widen_rate. runs on the finisher every
+  // options.stripe_widen_interval_ms.
+  void WidenStripe(uint64_t prev_tail,
+      std::chrono::steady_clock::time_point prev_time);
+
 #ifdef WITH_STATS
  private:
   class MetricsHandler : public CivetHandler {
@@ -173,21 +291,60 @@ class LogImpl : public Log {
   // thread-safe
   std::shared_ptr<Backend> backend;
 
-  std::shared_ptr<SeqrClient> sequencer;
+  // sent with every sequencer request, so it is copied from the backend once
+  const std::map<std::string, std::string> backend_meta;
+
   const std::string name;
   const std::string hoid;
 
-  // thread-safe
+  // thread-safe. the sequencer is published with the views.
   Striper striper;
 
   std::string exclusive_cookie;
   uint64_t exclusive_position;
   bool exclusive_empty;
 
+  // set by the client whose view puts the log in shared-memory sequencer
+  // mode, and used in UpdateView to initialize the segment.
+  bool shm_init;
+  uint64_t shm_init_epoch;
+  uint64_t shm_position;
+  bool shm_empty;
+
+  // waiters are invoked by the view updater with the lock held and must not
+  // block.
   std::condition_variable view_update;
-  std::list<std::pair<std::condition_variable*, bool*>> view_update_waiters;
+  std::list<std::function<void()>> view_update_waiters;
   std::thread view_update_thread;
 
+  // set when the backend reports a view change, and cleared by the view
+  // updater before it reads the views
+  bool views_changed;
+  bool views_watched;
+  uint64_t views_watch;
+
+  // extensions of the map are serialized. extending is set while the
+  // background extension is queued or running.
+  std::mutex extend_lock;
+  std::atomic<bool> extending;
+
+  std::mutex finisher_lock;
+  std::condition_variable finisher_cond;
+  bool finisher_shutdown;
+  std::multimap<std::chrono::steady_clock::time_point,
+    std::function<void()>> finisher_queue;
+  std::thread finisher_thread;
+
+  // the current lease is accessed with the std::atomic_* shared_ptr functions.
+  // lease_refill is set while a lease is being requested, and lease_cond is
+  // signaled when the request completes. asynchronous requests wait in
+  // lease_waiters, and synchronous requests on lease_cond.
+  std::shared_ptr<Lease> lease;
+  std::mutex lease_lock;
+  std::condition_variable lease_cond;
+  bool lease_refill;
+  std::list<std::function<void(int, uint64_t, uint64_t)>> lease_waiters;
+
   const Options options;
 #ifdef WITH_STATS
   CivetServer* metrics_http_server_ = nullptr;
@@ -0,0 +1,293 @@
+#include "shmseqr.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace zlog {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "shared-memory sequencer requires lock-free atomics");
+
+ShmSeqrClient::ShmSeqrClient(const std::string& shm_name, uint64_t epoch,
+    bool init, uint64_t init_epoch, bool empty, uint64_t position) :
+  SeqrClient("", "", epoch),
+  shm_name_(shm_name),
+  init_(init),
+  init_epoch_(init_epoch),
+  empty_(empty),
+  position_(position),
+  seg_(nullptr)
+{
+}
+
+ShmSeqrClient::~ShmSeqrClient()
+{
+  if (seg_)
+    munmap(seg_, sizeof(*seg_));
+}
+
+void ShmSeqrClient::Connect()
+{
+  int fd = shm_open(shm_name_.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    std::cerr << "failed to open sequencer segment " << shm_name_
+      << " " << strerror(errno) << std::endl;
+    return;
+  }
+
+  // a new segment is extended with zeros. an existing segment of another size
+  // was created by an incompatible version.
+  struct stat st;
+  int ret = fstat(fd, &st);
+  if (ret == 0 && st.st_size == 0)
+    ret = ftruncate(fd, sizeof(Segment));
+  if (ret == 0 && fstat(fd, &st) == 0 && st.st_size != sizeof(Segment)) {
+    std::cerr << "sequencer segment " << shm_name_
+      << " has unexpected size " << st.st_size << std::endl;
+    close(fd);
+    return;
+  }
+  if (ret) {
+    std::cerr << "failed to size sequencer segment " << shm_name_
+      << " " << strerror(errno) << std::endl;
+    close(fd);
+    return;
+  }
+
+  void *addr = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "failed to map sequencer segment " << shm_name_
+      << " " << strerror(errno) << std::endl;
+    return;
+  }
+
+  seg_ = (Segment*)addr;
+
+  if (init_)
+    Initialize();
+}
+
+void ShmSeqrClient::Lock()
+{
+  while (seg_->lock.exchange(1, std::memory_order_acquire))
+    std::this_thread::yield();
+}
+
+void ShmSeqrClient::Unlock()
+{
+  seg_->lock.store(0, std::memory_order_release);
+}
+
+/*
+ * The epoch is cleared while the tail and streams are reset, so a request
+ * that increments the tail concurrently sees the change when it checks the
+ * epoch again and discards the position.
+ */
+void ShmSeqrClient::Initialize()
+{
+  Lock();
+  const uint64_t cur = seg_->epoch.load();
+  if (cur == 0 || cur - 1 < init_epoch_) {
+    seg_->epoch.store(0);
+    seg_->tail.store(empty_ ? 0 : position_ + 1);
+    seg_->num_streams = 0;
+    seg_->epoch.store(init_epoch_ + 1);
+  }
+  Unlock();
+}
+
+int ShmSeqrClient::CheckEpoch(uint64_t epoch, uint64_t *pseg_epoch) const
+{
+  if (!seg_)
+    return -EIO;
+  const uint64_t cur = seg_->epoch.load();
+  if (cur == 0 || cur - 1 < init_epoch_)
+    return -EAGAIN;
+  if (epoch < cur - 1)
+    return -ERANGE;
+  *pseg_epoch = cur;
+  return 0;
+}
+
+bool ShmSeqrClient::Ready() const
+{
+  uint64_t cur;
+  return CheckEpoch(Epoch(), &cur) == 0;
+}
+
+int ShmSeqrClient::CheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, uint64_t *position, bool next)
+{
+  uint64_t cur;
+  int ret = CheckEpoch(epoch, &cur);
+  if (ret)
+    return ret;
+
+  uint64_t tail;
+  if (next)
+    tail = seg_->tail.fetch_add(1); // returns previous value
+  else
+    tail = seg_->tail.load();
+
+  if (seg_->epoch.load() != cur)
+    return -ERANGE;
+
+  *position = tail;
+
+  return 0;
+}
+
+int ShmSeqrClient::CheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, std::vector<uint64_t>& positions, size_t count)
+{
+  if (count == 0 || count > max_batch_positions)
+    return -EINVAL;
+
+  uint64_t cur;
+  int ret = CheckEpoch(epoch, &cur);
+  if (ret)
+    return ret;
+
+  uint64_t tail = seg_->tail.fetch_add(count); // returns previous value
+
+  if (seg_->epoch.load() != cur)
+    return -ERANGE;
+
+  for (size_t i = 0; i < count; i++)
+    positions.push_back(tail + i);
+
+  return 0;
+}
+
+void ShmSeqrClient::AsyncCheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, size_t count, CheckTailCallback callback)
+{
+  if (count == 0 || count > max_batch_positions) {
+    callback(-EINVAL, 0);
+    return;
+  }
+
+  uint64_t cur;
+  int ret = CheckEpoch(epoch, &cur);
+  if (ret) {
+    callback(ret, 0);
+    return;
+  }
+
+  uint64_t tail = seg_->tail.fetch_add(count); // returns previous value
+
+  if (seg_->epoch.load() != cur) {
+    callback(-ERANGE, 0);
+    return;
+  }
+
+  callback(0, tail);
+}
+
+int ShmSeqrClient::CheckTail(uint64_t epoch,
+    const std::map<std::string, std::string>& meta,
+    const std::string& name, const std::set<uint64_t>& stream_ids,
+    std::map<uint64_t, std::vector<uint64_t>>& stream_backpointers,
+    uint64_t *position, bool next)
+{
+  if (stream_ids.size() == 0)
+    return -EINVAL;
+
+  uint64_t cur;
+  int ret = CheckEpoch(epoch, &cur);
+  if (ret)
+    return ret;
+
+  Lock();
+
+  // the segment may have been initialized for a new cut
+  if (seg_->epoch.load() != cur) {
+    Unlock();
+    return -ERANGE;
+  }
+
+  // find the streams, adding any that don't exist yet
+  std::vector<Stream*> streams;
+  for (auto id : stream_ids) {
+    Stream *stream = nullptr;
+    for (uint32_t i = 0; i < seg_->num_streams; i++) {
+      if (seg_->streams[i].id == id) {
+        stream = &seg_->streams[i];
+        break;
+      }
+    }
+    if (!stream) {
+      if (seg_->num_streams == max_streams) {
+        Unlock();
+        return -ENOSPC;
+      }
+      stream = &seg_->streams[seg_->num_streams++];
+      stream->id = id;
+      stream->count = 0;
+    }
+    streams.push_back(stream);
+  }
+
+  // make a copy of the current backpointers
+  std::map<uint64_t, std::vector<uint64_t>> result;
+  for (auto stream : streams) {
+    result[stream->id] = std::vector<uint64_t>(stream->backpointers,
+        stream->backpointers + stream->count);
+  }
+
+  uint64_t tail;
+  if (next) {
+    tail = seg_->tail.fetch_add(1); // returns previous value
+
+    // add new position to each stream, dropping the oldest
+    for (auto stream : streams) {
+      if (stream->count == max_stream_backpointers) {
+        memmove(stream->backpointers, stream->backpointers + 1,
+            (max_stream_backpointers - 1) * sizeof(uint64_t));
+        stream->count--;
+      }
+      stream->backpointers[stream->count++] = tail;
+    }
+  } else {
+    tail = seg_->tail.load();
+  }
+
+  Unlock();
+
+  if (position)
+    *position = tail;
+  stream_backpointers.swap(result);
+
+  return 0;
+}
+
+std::string ShmSeqrClient::NewName()
+{
+  std::stringstream ss;
+  ss << "/zlog." << boost::uuids::random_generator()();
+  return ss.str();
+}
+
+int ShmSeqrClient::Unlink(const std::string& shm_name)
+{
+  if (shm_unlink(shm_name.c_str()))
+    return -errno;
+  return 0;
+}
+
+}
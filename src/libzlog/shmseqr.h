@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "libseq/libseqr.h"
+
+namespace zlog {
+
+/*
+ * A sequencer shared by the processes on one host through a shared-memory
+ * segment. A log is in this mode when its view names a segment (shm_name),
+ * and every writer must run on the same host.
+ *
+ * The semantics match the FakeSeqrClient used in exclusive mode: the client
+ * that cuts the view which puts the log in this mode initializes the tail from
+ * the maximum position found by the cut, and the stream backpointers start out
+ * empty. The segment records the epoch of that cut. Requests tagged with an
+ * older epoch are rejected with -ERANGE, and requests made before the segment
+ * has been initialized return -EAGAIN. A new view that only extends the log
+ * keeps using the segment.
+ *
+ * Taking a position is a single atomic increment. Stream requests and
+ * initialization take a spin lock in the segment.
+ */
+class ShmSeqrClient : public SeqrClient {
+ public:
+  // init_epoch is the epoch of the cut that put the log in this mode, which
+  // may be older than epoch when the log has been extended since. when init
+  // is set, the segment is initialized for init_epoch unless it has already
+  // been initialized by a cut at or after init_epoch. requests wait until the
+  // segment has been initialized for init_epoch.
+  ShmSeqrClient(const std::string& shm_name, uint64_t epoch, bool init,
+      uint64_t init_epoch, bool empty, uint64_t position);
+
+  ~ShmSeqrClient();
+
+  // map the segment, creating it if it doesn't exist
+  void Connect() override;
+
+  int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t *position, bool next) override;
+
+  int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, std::vector<uint64_t>& positions,
+      size_t count) override;
+
+  int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, const std::set<uint64_t>& stream_ids,
+      std::map<uint64_t, std::vector<uint64_t>>& stream_backpointers,
+      uint64_t *position, bool next) override;
+
+  // the sequence is local, so the callback is invoked inline
+  void AsyncCheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, size_t count,
+      CheckTailCallback callback) override;
+
+  // the log polls the segment instead
+  int WaitForTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t after,
+      std::chrono::milliseconds timeout, uint64_t *tail) override {
+    return -EOPNOTSUPP;
+  }
+
+  // true if the segment is mapped and serves this client's epoch
+  bool Ready() const;
+
+  // a new unique segment name
+  static std::string NewName();
+
+  // remove a segment. processes that have it mapped are not affected.
+  static int Unlink(const std::string& shm_name);
+
+  static const size_t max_streams = 64;
+  static const size_t max_stream_backpointers = 10;
+
+ private:
+  struct Stream {
+    uint64_t id;
+    uint64_t count;
+    uint64_t backpointers[max_stream_backpointers];
+  };
+
+  // the segment is zero filled when it is created, which is a valid initial
+  // state for the lock-free atomics.
+  struct Segment {
+    // epoch of the cut that initialized the segment plus one, or zero while
+    // the segment is being initialized.
+    std::atomic<uint64_t> epoch;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> lock;
+    uint32_t num_streams;
+    Stream streams[max_streams];
+  };
+
+  void Lock();
+  void Unlock();
+  int CheckEpoch(uint64_t epoch, uint64_t *pseg_epoch) const;
+  void Initialize();
+
+  const std::string shm_name_;
+  const bool init_;
+  const uint64_t init_epoch_;
+  const bool empty_;
+  const uint64_t position_;
+
+  Segment *seg_;
+};
+
+}
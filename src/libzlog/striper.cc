@@ -1,31 +1,257 @@
 #include "striper.h"
 #include "proto/zlog.pb.h"
+#include "libseq/libseqr.h"
 
 // TODO:
 //  - check for overflow when computing max pos
-//  - collapse views instead of creating explicit copy of each
 //  - handle view overlap so we can force seal a stripe
 //  - fix naming scheme for objects
 
-boost::optional<Striper::Mapping> Striper::MapPosition(uint64_t position) const
+// a thread's cached reference is replaced with in_use while it's held, and a
+// publisher replaces the cached references with obsolete (nullptr).
+static int in_use_marker;
+static void * const in_use = &in_use_marker;
+static void * const obsolete = nullptr;
+
+Striper::Striper(const std::string& prefix) :
+  prefix_(prefix),
+  current_(nullptr),
+  local_(&Striper::UnrefHandler)
 {
-  std::lock_guard<std::mutex> l(lock_);
+}
 
-  assert(!views_.empty());
-  auto it = views_.upper_bound(position);
-  it--;
+// the cached references are released by the thread local destructor
+Striper::~Striper()
+{
+  if (current_)
+    Unref(current_);
+}
+
+void Striper::Unref(Snapshot *snapshot)
+{
+  if (snapshot->refs.fetch_sub(1) == 1)
+    delete snapshot;
+}
+
+void Striper::UnrefHandler(void *ptr)
+{
+  assert(ptr != in_use);
+  Unref(static_cast<Snapshot*>(ptr));
+}
+
+/*
+ * The common case takes the thread's cached reference. A thread without one,
+ * or with one already in use by an outer reference, takes a new reference
+ * under the lock. See ReleaseSnapshot for how the cache is refilled.
+ */
+Striper::SnapshotRef Striper::GetSnapshot() const
+{
+  void *ptr = local_.Swap(in_use);
+  if (ptr != obsolete && ptr != in_use)
+    return SnapshotRef(this, static_cast<Snapshot*>(ptr));
+
+  Snapshot *snapshot;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    snapshot = current_;
+    if (snapshot)
+      snapshot->refs++;
+  }
+
+  if (!snapshot && ptr == obsolete) {
+    void *expected = in_use;
+    local_.CompareAndSwap(obsolete, expected);
+  }
+
+  return SnapshotRef(this, snapshot);
+}
+
+// the reference goes back into the cache unless a new snapshot was published
+// while it was held, or it's an inner reference
+void Striper::ReleaseSnapshot(Snapshot *snapshot) const
+{
+  void *expected = in_use;
+  if (local_.CompareAndSwap(snapshot, expected))
+    return;
+  Unref(snapshot);
+}
+
+void Striper::Publish(Snapshot *snapshot)
+{
+  snapshot->refs = 1;
+
+  Snapshot *old = current_;
+  current_ = snapshot;
+
+  zlog::autovector<void*> cached;
+  local_.Scrape(&cached, obsolete);
+  for (auto ptr : cached) {
+    if (ptr != in_use)
+      Unref(static_cast<Snapshot*>(ptr));
+  }
+
+  if (old)
+    Unref(old);
+}
+
+Striper::ViewRange::ViewRange(const std::string& prefix, uint64_t epoch,
+    uint64_t minpos, uint32_t width, uint32_t entries_per_object,
+    uint32_t max_size, bool extension, uint64_t num_views) :
+  prefix_(prefix), epoch_(epoch), minpos_(minpos), width_(width),
+  entries_per_object_(entries_per_object), max_size_(max_size),
+  extension_(extension), num_views_(num_views)
+{
+  assert(num_views_ > 0);
+  auto oids = std::make_shared<std::vector<std::string>>();
+  for (auto i = 0u; i < width_; i++) {
+    oids->push_back(ObjectName(epoch_ + num_views_ - 1, i));
+  }
+  oids_ = oids;
+}
+
+std::string Striper::ViewRange::ObjectName(uint64_t epoch,
+    uint32_t index) const
+{
+  std::stringstream oid;
+  oid << prefix_ << "." << epoch << "." << index;
+  return oid.str();
+}
+
+bool Striper::ViewRange::SameLayout(const zlog_proto::View& view) const
+{
+  return view.width() == width_ &&
+    view.entries_per_object() == entries_per_object_ &&
+    view.max_entry_size() == max_size_;
+}
+
+bool Striper::ViewRange::Extends(uint64_t epoch,
+    const zlog_proto::View& view) const
+{
+  return epoch == epoch_ + num_views_ &&
+    view.position() == maxpos() + 1 &&
+    SameLayout(view);
+}
+
+std::shared_ptr<const Striper::ViewRange> Striper::ViewRange::Extend() const
+{
+  auto range = std::make_shared<ViewRange>(prefix_, epoch_, minpos_, width_,
+      entries_per_object_, max_size_, extension_, num_views_ + 1);
+  range->prev_oids_ = oids_;
+  return range;
+}
+
+std::shared_ptr<const Striper::ViewRange> Striper::ViewRange::Truncate(
+    uint64_t num_views) const
+{
+  assert(0 < num_views && num_views < num_views_);
+  return std::make_shared<ViewRange>(prefix_, epoch_, minpos_, width_,
+      entries_per_object_, max_size_, extension_, num_views);
+}
+
+std::vector<std::string> Striper::ViewRange::Oids(uint64_t minpos) const
+{
+  assert(minpos_ <= minpos && minpos <= last_minpos());
+  assert((minpos - minpos_) % span() == 0);
+  const uint64_t view = (minpos - minpos_) / span();
+  if (view == num_views_ - 1)
+    return *oids_;
+  if (view == num_views_ - 2 && prev_oids_)
+    return *prev_oids_;
+  std::vector<std::string> oids;
+  for (auto i = 0u; i < width_; i++) {
+    oids.push_back(ObjectName(epoch_ + view, i));
+  }
+  return oids;
+}
+
+void Striper::ViewRange::Map(uint64_t position, Mapping *mapping) const
+{
+  assert(minpos_ <= position && position <= maxpos());
+  const uint64_t view = (position - minpos_) / span();
+  const uint32_t index = position % width_;
+  mapping->maxpos = minpos_ + (view + 1) * span() - 1;
+  mapping->width = width_;
+  mapping->max_size = max_size_;
+  if (view == num_views_ - 1) {
+    mapping->oid = std::shared_ptr<const std::string>(oids_,
+        &(*oids_)[index]);
+  } else if (view == num_views_ - 2 && prev_oids_) {
+    mapping->oid = std::shared_ptr<const std::string>(prev_oids_,
+        &(*prev_oids_)[index]);
+  } else {
+    mapping->oid = std::make_shared<const std::string>(
+        ObjectName(epoch_ + view, index));
+  }
+}
+
+boost::optional<Striper::Mapping> Striper::Snapshot::MapPosition(
+    uint64_t position) const
+{
+  assert(!views.empty());
+  const auto next = views.upper_bound(position);
+  auto it = std::prev(next);
 
   assert(it->first <= position);
-  if (position <= it->second.maxpos()) {
-    auto oid = it->second.map(position);
-    auto width = it->second.width();
-    auto max_size = it->second.max_size();
-    return Mapping{epoch_, width, max_size, oid};
+  if (position <= it->second->maxpos()) {
+    Mapping mapping;
+    mapping.epoch = epoch;
+    mapping.seq_epoch = seqr_epoch;
+    it->second->Map(position, &mapping);
+    // a range with a new layout may start in the view
+    if (next != views.end() && next->first <= mapping.maxpos)
+      mapping.maxpos = next->first - 1;
+    return mapping;
   }
 
   return boost::none;
 }
 
+Striper::StripeInfo Striper::Snapshot::GetCurrent() const
+{
+  assert(!views.empty());
+  auto latest = views.rbegin()->second;
+  return StripeInfo{epoch,
+    latest->last_minpos(),
+    latest->width(),
+    latest->oids()};
+}
+
+boost::optional<Striper::StripeInfo> Striper::Snapshot::PrevStripe(
+    const StripeInfo& stripe) const
+{
+  assert(!views.empty());
+  auto it = views.upper_bound(stripe.minpos);
+  it--;
+
+  // the views in a range are contiguous, and the first view of a range may
+  // extend the range before it
+  if (stripe.minpos == it->second->minpos()) {
+    if (!it->second->extension() || it == views.begin())
+      return boost::none;
+    it--;
+    if (it->second->maxpos() + 1 != stripe.minpos)
+      return boost::none;
+    const auto& range = *it->second;
+    return StripeInfo{epoch, range.last_minpos(), range.width(),
+      range.oids()};
+  }
+
+  const auto& range = *it->second;
+  const uint64_t minpos = stripe.minpos - range.span();
+  return StripeInfo{epoch, minpos, range.width(), range.Oids(minpos)};
+}
+
+bool Striper::Snapshot::SeqrPending() const
+{
+  return seqr && seqr_epoch != seqr->Epoch();
+}
+
+uint64_t Striper::Snapshot::MaxPosition() const
+{
+  assert(!views.empty());
+  return views.rbegin()->second->maxpos();
+}
+
 zlog_proto::View Striper::InitViewData(uint32_t width, uint32_t entries_per_object,
     uint32_t max_entry_size)
 {
@@ -47,45 +273,189 @@ zlog_proto::View Striper::InitViewData(uint32_t width, uint32_t entries_per_obje
 // actually keep around a copy of the latest.
 std::pair<uint64_t, zlog_proto::View> Striper::LatestView() const
 {
-  std::lock_guard<std::mutex> l(lock_);
-  assert(!views_.empty());
-  return std::make_pair(epoch_, latest_view_);
+  auto snapshot = GetSnapshot();
+  assert(snapshot);
+  return std::make_pair(snapshot->epoch, snapshot->latest_view);
 }
 
-int Striper::Add(uint64_t epoch, const std::string& data)
+// views are applied to a new snapshot that is published once, so a client
+// catching up on many views doesn't publish a snapshot per view
+int Striper::Add(const std::map<uint64_t, std::string>& views)
 {
-  zlog_proto::View view;
-  if (!view.ParseFromString(data)) {
-    return -EIO;
+  if (views.empty())
+    return 0;
+
+  std::lock_guard<std::mutex> l(lock_);
+
+  auto snapshot = new Snapshot;
+  if (current_) {
+    snapshot->epoch = current_->epoch;
+    snapshot->views = current_->views;
+    snapshot->latest_view = current_->latest_view;
+    snapshot->seqr = current_->seqr;
+    snapshot->seqr_epoch = current_->seqr_epoch;
   }
 
-  assert(view.width() > 0);
-  assert(view.entries_per_object() > 0);
+  bool first = !current_;
+  for (const auto& it : views) {
+    zlog_proto::View view;
+    if (!view.ParseFromString(it.second)) {
+      delete snapshot;
+      return -EIO;
+    }
 
-  std::lock_guard<std::mutex> l(lock_);
+    assert(view.width() > 0);
+    assert(view.entries_per_object() > 0);
+
+    AddView(snapshot, first, it.first, view);
+    first = false;
+  }
+
+  Publish(snapshot);
 
-  if (views_.empty()) {
+  return 0;
+}
+
+void Striper::AddView(Snapshot *snapshot, bool first, uint64_t epoch,
+    const zlog_proto::View& view) const
+{
+  if (first) {
     assert(epoch == 0);
     assert(view.position() == 0);
-    uint64_t maxpos = (view.width() * view.entries_per_object()) - 1;
-    epoch_ = 0;
-    views_.emplace(0, ViewEntry(prefix_, epoch_, view.width(), maxpos,
-          view.max_entry_size()));
+    snapshot->epoch = 0;
+    snapshot->seqr_epoch = 0;
+    snapshot->views.emplace(0, std::make_shared<ViewRange>(prefix_,
+          snapshot->epoch, 0, view.width(), view.entries_per_object(),
+          view.max_entry_size(), false));
   } else {
-    assert(epoch == (epoch_ + 1));
+    assert(epoch == (snapshot->epoch + 1));
 
-    auto latest_view = views_.rbegin();
-    assert(latest_view->first <= view.position());
-    (void)latest_view;
+    snapshot->epoch = epoch;
 
-    epoch_ = epoch;
-    uint64_t maxpos = view.position() +
-      (view.width() * view.entries_per_object()) - 1;
-    views_.emplace(view.position(), ViewEntry(prefix_, epoch_, view.width(), maxpos,
-          view.max_entry_size()));
+    // positions from the sequencer of an earlier view are retried unless
+    // the view only extends the log
+    if (!view.extension())
+      snapshot->seqr_epoch = epoch;
+
+    // a view that extends the latest range is folded into it, and a view that
+    // starts at the same position as the latest view with the same layout
+    // doesn't change the mapping. otherwise the view starts a new range. a
+    // view with a new layout may start before the latest view, and the views
+    // it replaces were sealed while they were empty.
+    auto& latest = snapshot->views.rbegin()->second;
+    if (latest->Extends(epoch, view)) {
+      latest = latest->Extend();
+    } else if (latest->last_minpos() != view.position() ||
+        !latest->SameLayout(view)) {
+      assert(latest->last_minpos() <= view.position() ||
+          !latest->SameLayout(view));
+      Truncate(snapshot, view.position());
+      snapshot->views.emplace(view.position(), std::make_shared<ViewRange>(
+            prefix_, snapshot->epoch, view.position(), view.width(),
+            view.entries_per_object(), view.max_entry_size(),
+            view.extension()));
+    }
   }
 
-  latest_view_ = view;
+  snapshot->latest_view = view;
+}
+
+// remove the views that start at or after position
+void Striper::Truncate(Snapshot *snapshot, uint64_t position)
+{
+  while (!snapshot->views.empty()) {
+    auto it = snapshot->views.end();
+    it--;
+    auto& range = it->second;
+    if (range->minpos() >= position) {
+      snapshot->views.erase(it);
+      continue;
+    }
+    if (range->last_minpos() >= position) {
+      const uint64_t num_views =
+        (position - range->minpos() + range->span() - 1) / range->span();
+      range = range->Truncate(num_views);
+    }
+    break;
+  }
+}
+
+int Striper::Checkpoint(std::string *data) const
+{
+  auto snapshot = GetSnapshot();
+  if (!snapshot)
+    return -ENOENT;
+
+  zlog_proto::ViewCheckpoint checkpoint;
+  checkpoint.set_epoch(snapshot->epoch);
+  for (const auto& it : snapshot->views) {
+    const auto& range = *it.second;
+    auto r = checkpoint.add_ranges();
+    r->set_epoch(range.epoch());
+    r->set_position(range.minpos());
+    r->set_width(range.width());
+    r->set_entries_per_object(range.entries_per_object());
+    r->set_max_entry_size(range.max_size());
+    r->set_extension(range.extension());
+    r->set_num_views(range.num_views());
+  }
+  *checkpoint.mutable_latest_view() = snapshot->latest_view;
+
+  if (!checkpoint.SerializeToString(data))
+    return -EIO;
+
+  return 0;
+}
+
+// the sequencer is set after the checkpoint is loaded, and until then the
+// snapshot has none
+int Striper::LoadCheckpoint(const std::string& data)
+{
+  zlog_proto::ViewCheckpoint checkpoint;
+  if (!checkpoint.ParseFromString(data))
+    return -EIO;
+
+  if (checkpoint.ranges_size() == 0)
+    return -EIO;
+
+  auto snapshot = std::unique_ptr<Snapshot>(new Snapshot);
+  snapshot->epoch = checkpoint.epoch();
+  snapshot->seqr_epoch = checkpoint.epoch();
+  snapshot->latest_view = checkpoint.latest_view();
+
+  for (const auto& r : checkpoint.ranges()) {
+    if (r.width() == 0 || r.entries_per_object() == 0 || r.num_views() == 0)
+      return -EIO;
+    if (!snapshot->views.empty() &&
+        snapshot->views.rbegin()->first >= r.position())
+      return -EIO;
+    snapshot->views.emplace(r.position(), std::make_shared<ViewRange>(
+          prefix_, r.epoch(), r.position(), r.width(),
+          r.entries_per_object(), r.max_entry_size(), r.extension(),
+          r.num_views()));
+  }
+
+  std::lock_guard<std::mutex> l(lock_);
+
+  if (current_)
+    return -EEXIST;
+
+  Publish(snapshot.release());
 
   return 0;
 }
+
+void Striper::SetSequencer(std::shared_ptr<zlog::SeqrClient> seqr)
+{
+  std::lock_guard<std::mutex> l(lock_);
+  assert(current_);
+
+  auto snapshot = new Snapshot;
+  snapshot->epoch = current_->epoch;
+  snapshot->views = current_->views;
+  snapshot->latest_view = current_->latest_view;
+  snapshot->seqr = seqr;
+  snapshot->seqr_epoch = current_->epoch;
+
+  Publish(snapshot);
+}
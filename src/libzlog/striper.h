@@ -1,11 +1,28 @@
 #pragma once
+#include <atomic>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <boost/optional.hpp>
 #include "proto/zlog.pb.h"
+#include "util/thread_local.h"
 
+namespace zlog {
+  class SeqrClient;
+}
+
+/*
+ * The views are published as immutable snapshots, along with the sequencer
+ * that serves the latest epoch. Each thread caches a reference to the current
+ * snapshot, so reading it only touches thread-local state. Publishing a new
+ * snapshot takes back the cached references, and a snapshot is freed once the
+ * last reader releases it.
+ */
 class Striper {
+ private:
+  class ViewRange;
+
  public:
   struct StripeInfo {
     uint64_t epoch;
@@ -14,96 +31,259 @@ class Striper {
     std::vector<std::string> oids;
   };
 
+  // the oid shares the names cached by the striper when it can, and is
+  // otherwise built for the mapping. seq_epoch is the epoch of the sequencer
+  // that may hand out positions for the mapping, and maxpos is the last
+  // position of the view that maps the position.
   struct Mapping {
     uint64_t epoch;
+    uint64_t seq_epoch;
+    uint64_t maxpos;
     uint32_t width;
     uint32_t max_size;
-    std::string oid;
+    std::shared_ptr<const std::string> oid;
   };
 
-  Striper(const std::string& prefix) :
-    prefix_(prefix)
-  {}
+  class Snapshot {
+   public:
+    uint64_t epoch;
+
+    // the sequencer for the latest epoch, which may be unset
+    std::shared_ptr<zlog::SeqrClient> seqr;
+
+    // the epoch the sequencer was created for. views that extend the log keep
+    // the sequencer, and other views replace it.
+    uint64_t seqr_epoch;
+
+    // true when a view that replaces the sequencer has been applied, and the
+    // sequencer built for it hasn't been published yet
+    bool SeqrPending() const;
+
+    boost::optional<Mapping> MapPosition(uint64_t position) const;
+
+    StripeInfo GetCurrent() const;
+
+    // the stripe before the given stripe if the given stripe may have been
+    // created by extending the log, and otherwise none.
+    boost::optional<StripeInfo> PrevStripe(const StripeInfo& stripe) const;
+
+    // the last position mapped by the views
+    uint64_t MaxPosition() const;
+
+    const zlog_proto::View& LatestView() const {
+      return latest_view;
+    }
+
+   private:
+    friend class Striper;
+
+    // min-pos(inclusive) -> range. ranges are shared with later snapshots.
+    std::map<uint64_t, std::shared_ptr<const ViewRange>> views;
+    zlog_proto::View latest_view;
+
+    std::atomic<int> refs;
+  };
+
+  // a reference to a snapshot, which remains valid until it is released
+  class SnapshotRef {
+   public:
+    SnapshotRef(const Striper *striper, Snapshot *snapshot) :
+      striper_(striper), snapshot_(snapshot)
+    {}
+
+    SnapshotRef(SnapshotRef&& other) :
+      striper_(other.striper_), snapshot_(other.snapshot_)
+    {
+      other.snapshot_ = nullptr;
+    }
+
+    SnapshotRef(const SnapshotRef&) = delete;
+    SnapshotRef& operator=(const SnapshotRef&) = delete;
+
+    ~SnapshotRef() {
+      if (snapshot_)
+        striper_->ReleaseSnapshot(snapshot_);
+    }
+
+    explicit operator bool() const {
+      return snapshot_ != nullptr;
+    }
+
+    const Snapshot *operator->() const {
+      return snapshot_;
+    }
+
+    const Snapshot& operator*() const {
+      return *snapshot_;
+    }
+
+   private:
+    const Striper *striper_;
+    Snapshot *snapshot_;
+  };
+
+  Striper(const std::string& prefix);
+
+  ~Striper();
 
   static zlog_proto::View InitViewData(uint32_t width,
       uint32_t entries_per_object, uint32_t max_entry_size);
 
+  // the current snapshot, or an empty reference if no view has been added.
+  // a thread may hold more than one reference at a time.
+  SnapshotRef GetSnapshot() const;
+
   std::pair<uint64_t, zlog_proto::View> LatestView() const;
 
-  // Add the serialized view data for an epoch
-  int Add(uint64_t epoch, const std::string& data);
+  // Add the serialized view data for consecutive epochs, starting after the
+  // latest epoch
+  int Add(const std::map<uint64_t, std::string>& views);
+
+  // serialize the views as a zlog_proto::ViewCheckpoint
+  int Checkpoint(std::string *data) const;
+
+  // initialize the striper from a checkpoint. the striper must be empty.
+  int LoadCheckpoint(const std::string& data);
+
+  // publish the sequencer for the latest epoch
+  void SetSequencer(std::shared_ptr<zlog::SeqrClient> seqr);
 
   bool Empty() const {
-    std::lock_guard<std::mutex> l(lock_);
-    return views_.empty();
+    return !GetSnapshot();
   }
 
   StripeInfo GetCurrent() const {
-    std::lock_guard<std::mutex> l(lock_);
-    assert(!views_.empty());
-    auto latest = views_.rbegin();
-    return StripeInfo{epoch_,
-      latest->first,
-      latest->second.width(),
-      latest->second.oids()};
+    auto snapshot = GetSnapshot();
+    assert(snapshot);
+    return snapshot->GetCurrent();
   }
 
   uint64_t Epoch() const {
-    std::lock_guard<std::mutex> l(lock_);
-    assert(!views_.empty());
-    return epoch_;
+    auto snapshot = GetSnapshot();
+    assert(snapshot);
+    return snapshot->epoch;
   }
 
-  boost::optional<Mapping> MapPosition(uint64_t position) const;
+  boost::optional<Mapping> MapPosition(uint64_t position) const {
+    auto snapshot = GetSnapshot();
+    assert(snapshot);
+    return snapshot->MapPosition(position);
+  }
 
  private:
-  class ViewEntry {
+  /*
+   * A run of views with the same layout, in which each view starts where the
+   * previous one ends and was created at the next epoch, as happens when the
+   * log is extended. The view at index k starts at minpos + k * span and was
+   * created at epoch + k, and its objects are named prefix.(epoch + k).i. A
+   * position is mapped arithmetically, and only the names of the objects in
+   * the last two views are kept, since the log is extended ahead of the tail.
+   */
+  class ViewRange {
    public:
-    ViewEntry(const std::string& prefix, uint64_t epoch, uint32_t width,
-        uint64_t maxpos, uint32_t max_size) :
-      width_(width), maxpos_(maxpos), max_size_(max_size)
-    {
-      for (auto i = 0u; i < width_; i++) {
-        std::stringstream oid;
-        oid << prefix << "." << epoch << "." << i;
-        oids_.push_back(oid.str());
-      }
+    ViewRange(const std::string& prefix, uint64_t epoch, uint64_t minpos,
+        uint32_t width, uint32_t entries_per_object, uint32_t max_size,
+        bool extension, uint64_t num_views = 1);
+
+    uint64_t epoch() const {
+      return epoch_;
     }
 
     uint32_t width() const {
       return width_;
     }
 
-    uint64_t maxpos() const {
-      return maxpos_;
+    uint32_t entries_per_object() const {
+      return entries_per_object_;
+    }
+
+    uint64_t num_views() const {
+      return num_views_;
     }
 
-    std::string map(uint64_t position) const {
-      auto index = position % width_;
-      assert(index < oids_.size());
-      return oids_[index];
+    uint64_t minpos() const {
+      return minpos_;
     }
 
-    std::vector<std::string> oids() const {
-      return oids_;
+    uint64_t maxpos() const {
+      return minpos_ + num_views_ * span() - 1;
     }
 
     uint32_t max_size() const {
       return max_size_;
     }
 
+    // the first view extended the view before it
+    bool extension() const {
+      return extension_;
+    }
+
+    // first position of the last view
+    uint64_t last_minpos() const {
+      return minpos_ + (num_views_ - 1) * span();
+    }
+
+    uint64_t span() const {
+      return (uint64_t)width_ * entries_per_object_;
+    }
+
+    // objects of the last view
+    const std::vector<std::string>& oids() const {
+      return *oids_;
+    }
+
+    // true if the view maps positions to objects like the views in the range
+    bool SameLayout(const zlog_proto::View& view) const;
+
+    // true if the view created at epoch follows the last view in the range
+    bool Extends(uint64_t epoch, const zlog_proto::View& view) const;
+
+    // a copy of this range that includes one more view
+    std::shared_ptr<const ViewRange> Extend() const;
+
+    // a copy of this range with only its first num_views views
+    std::shared_ptr<const ViewRange> Truncate(uint64_t num_views) const;
+
+    // the position must be in the range
+    void Map(uint64_t position, Mapping *mapping) const;
+
+    // objects of the view that starts at minpos
+    std::vector<std::string> Oids(uint64_t minpos) const;
+
    private:
-    uint32_t width_;
-    uint64_t maxpos_;
-    uint32_t max_size_;
-    std::vector<std::string> oids_;
+    std::string ObjectName(uint64_t epoch, uint32_t index) const;
+
+    const std::string prefix_;
+    const uint64_t epoch_;
+    const uint64_t minpos_;
+    const uint32_t width_;
+    const uint32_t entries_per_object_;
+    const uint32_t max_size_;
+    const bool extension_;
+    const uint64_t num_views_;
+
+    // objects of the last view, and of the view before it if it's in the range
+    std::shared_ptr<const std::vector<std::string>> oids_;
+    std::shared_ptr<const std::vector<std::string>> prev_oids_;
   };
 
+  void AddView(Snapshot *snapshot, bool first, uint64_t epoch,
+      const zlog_proto::View& view) const;
+
+  static void Truncate(Snapshot *snapshot, uint64_t position);
+
+  void Publish(Snapshot *snapshot);
+  void ReleaseSnapshot(Snapshot *snapshot) const;
+  static void Unref(Snapshot *snapshot);
+  static void UnrefHandler(void *ptr);
+
+  // serializes writers, and protects current_ for readers without a cached
+  // reference
   mutable std::mutex lock_;
   const std::string prefix_;
 
-  // min-pos(inclusive) -> entry
-  std::map<uint64_t, ViewEntry> views_;
-  zlog_proto::View latest_view_;
-  uint64_t epoch_;
+  Snapshot *current_;
+
+  // each thread's cached reference to the current snapshot
+  mutable zlog::ThreadLocalPtr local_;
 };
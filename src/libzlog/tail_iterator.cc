@@ -0,0 +1,154 @@
+#include "log_impl.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace zlog {
+
+TailIterator::~TailIterator() {}
+
+// interval between reads of a position that was handed out but isn't written
+// yet, which bounds how long an entry waits to be returned once it's written
+static const std::chrono::milliseconds max_hole_poll_interval(10);
+
+/*
+ * The positions before tail_ have been handed out by the sequencer. They are
+ * read ahead of the returned entries with a range read, which stops at the
+ * first position that isn't written yet. The iterator waits on the sequencer
+ * only after returning every position before tail_, and a wait covers all the
+ * positions handed out in the meantime, so following the log doesn't add a
+ * sequencer request per entry.
+ */
+class TailIteratorImpl : public TailIterator {
+ public:
+  TailIteratorImpl(LogImpl *log, uint64_t position) :
+    log_(log),
+    position_(position),
+    tail_(position),
+    hole_(false)
+  {}
+
+  int Next(std::chrono::milliseconds timeout, uint64_t *position,
+      std::string *data) override;
+
+  uint64_t Position() const override {
+    return entries_.empty() ? position_ : entries_.front().first;
+  }
+
+ private:
+  int ReadAhead();
+
+  LogImpl *log_;
+
+  // the entries before position_ have been read, and the ones that weren't
+  // returned yet are buffered in entries_
+  uint64_t position_;
+  uint64_t tail_;
+  std::deque<std::pair<uint64_t, std::string>> entries_;
+
+  // set while position_ is handed out but not written
+  bool hole_;
+  std::chrono::steady_clock::time_point hole_since_;
+};
+
+// read the written entries from position_, up to the tail and at most the
+// readahead, and stop at the first position that isn't written
+int TailIteratorImpl::ReadAhead()
+{
+  const uint64_t end = std::min(tail_,
+      position_ + log_->options.tail_readahead);
+
+  uint64_t next = position_;
+  int ret = log_->ReadRange(position_, end,
+      [&](uint64_t position, int result, const Slice& data) {
+    if (result == -ENOENT)
+      return 1;
+    if (!result)
+      entries_.emplace_back(position, data.ToString());
+    next = position + 1;
+    return 0;
+  });
+  if (ret < 0)
+    return ret;
+
+  position_ = next;
+
+  return 0;
+}
+
+int TailIteratorImpl::Next(std::chrono::milliseconds timeout,
+    uint64_t *position, std::string *data)
+{
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::chrono::milliseconds backoff(1);
+
+  while (true) {
+    if (!entries_.empty()) {
+      *position = entries_.front().first;
+      data->swap(entries_.front().second);
+      entries_.pop_front();
+      return 0;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto remaining = std::max(std::chrono::milliseconds(0),
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+
+    if (position_ < tail_) {
+      const uint64_t prev = position_;
+      int ret = ReadAhead();
+      if (ret)
+        return ret;
+
+      if (position_ > prev || !entries_.empty()) {
+        hole_ = false;
+        backoff = std::chrono::milliseconds(1);
+        continue;
+      }
+
+      // the writer that was handed the position may have failed
+      const std::chrono::milliseconds hole_timeout(
+          log_->options.tail_hole_timeout_ms);
+      if (!hole_) {
+        hole_ = true;
+        hole_since_ = now;
+      } else if (hole_timeout.count() > 0 &&
+          now - hole_since_ >= hole_timeout) {
+        ret = log_->Fill(position_);
+        if (ret && ret != -EROFS)
+          return ret;
+        hole_ = false;
+        continue;
+      }
+
+      if (remaining.count() == 0)
+        return -ETIMEDOUT;
+
+      std::this_thread::sleep_for(std::min(backoff, remaining));
+      backoff = std::min(backoff * 2, max_hole_poll_interval);
+      continue;
+    }
+
+    // every position that was handed out has been returned
+    uint64_t tail;
+    int ret = log_->WaitForTail(position_, remaining, &tail);
+    if (ret && ret != -ETIMEDOUT)
+      return ret;
+    tail_ = std::max(tail_, tail);
+    if (ret)
+      return ret;
+  }
+}
+
+int LogImpl::OpenTailIterator(uint64_t start, TailIterator **iterator)
+{
+  *iterator = new TailIteratorImpl(this, start);
+  return 0;
+}
+
+}
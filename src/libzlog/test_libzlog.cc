@@ -1,7 +1,122 @@
+#include <cstdint>
 #include <numeric>
 #include <deque>
+#include <future>
+#include <set>
+#include <thread>
 #include "test_libzlog.h"
+#include "zlog/backend.h"
 #include "zlog/stream.h"
+#include "libzlog/log_impl.h"
+#include "libzlog/shmseqr.h"
+
+// a sequencer that holds asynchronous requests until the test answers them,
+// and forwards everything else to the sequencer it stands in for. like a
+// remote sequencer, requests outstanding when it's destroyed fail with -EIO.
+class HeldSeqrClient : public zlog::SeqrClient {
+ public:
+  HeldSeqrClient(std::shared_ptr<zlog::SeqrClient> seqr, uint64_t epoch) :
+    SeqrClient("", "", epoch), seqr_(seqr)
+  {}
+
+  ~HeldSeqrClient() {
+    Complete(-EIO);
+  }
+
+  void Connect() override {}
+
+  int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t *position, bool next) override {
+    return seqr_->CheckTail(epoch, meta, name, position, next);
+  }
+
+  int CheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, std::vector<uint64_t>& positions,
+      size_t count) override {
+    std::chrono::milliseconds delay;
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      delay = delay_;
+    }
+    std::this_thread::sleep_for(delay);
+    return seqr_->CheckTail(epoch, meta, name, positions, count);
+  }
+
+  void AsyncCheckTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, size_t count,
+      CheckTailCallback callback) override {
+    std::unique_lock<std::mutex> l(lock_);
+    if (fail_) {
+      const int ret = fail_;
+      l.unlock();
+      callback(ret, 0);
+      return;
+    }
+    held_.push_back(Request{epoch, meta, name, count, callback});
+  }
+
+  int WaitForTail(uint64_t epoch,
+      const std::map<std::string, std::string>& meta,
+      const std::string& name, uint64_t after,
+      std::chrono::milliseconds timeout, uint64_t *tail) override {
+    return -EOPNOTSUPP;
+  }
+
+  size_t Held() {
+    std::lock_guard<std::mutex> l(lock_);
+    return held_.size();
+  }
+
+  // fail later requests with ret instead of holding them
+  void FailWith(int ret) {
+    std::lock_guard<std::mutex> l(lock_);
+    fail_ = ret;
+  }
+
+  // delay synchronous requests for a block of positions, which widens the
+  // window in which other clients find a lease exhausted
+  void Delay(std::chrono::milliseconds delay) {
+    std::lock_guard<std::mutex> l(lock_);
+    delay_ = delay;
+  }
+
+  // answer up to max held requests, with positions from the forwarded
+  // sequencer when ret is zero
+  void Complete(int ret, size_t max = SIZE_MAX) {
+    std::deque<Request> requests;
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      while (!held_.empty() && requests.size() < max) {
+        requests.push_back(std::move(held_.front()));
+        held_.pop_front();
+      }
+    }
+    for (auto& r : requests) {
+      if (ret)
+        r.callback(ret, 0);
+      else
+        seqr_->AsyncCheckTail(r.epoch, r.meta, r.name, r.count, r.callback);
+    }
+  }
+
+ private:
+  struct Request {
+    uint64_t epoch;
+    std::map<std::string, std::string> meta;
+    std::string name;
+    size_t count;
+    CheckTailCallback callback;
+  };
+
+  const std::shared_ptr<zlog::SeqrClient> seqr_;
+  std::mutex lock_;
+  std::deque<Request> held_;
+  int fail_ = 0;
+  std::chrono::milliseconds delay_{0};
+};
 
 struct aio_state {
   zlog::AioCompletion *c;
@@ -103,6 +218,426 @@ TEST_P(LibZLogTest, Aio) {
   }
 }
 
+TEST_P(LibZLogTest, AppendBatch) {
+  std::vector<zlog::Slice> batch;
+  int ret = log->AppendBatch(batch, nullptr);
+  ASSERT_EQ(ret, -EINVAL);
+
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 150; i++) {
+    std::stringstream ss;
+    ss << "data." << i;
+    inputs.push_back(ss.str());
+  }
+  for (const auto& input : inputs) {
+    batch.emplace_back(input);
+  }
+
+  std::vector<uint64_t> positions;
+  ret = log->AppendBatch(batch, &positions);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(positions.size(), inputs.size());
+
+  std::set<uint64_t> unique(positions.begin(), positions.end());
+  ASSERT_EQ(unique.size(), positions.size());
+
+  for (size_t i = 0; i < positions.size(); i++) {
+    std::string output;
+    ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+
+  // later appends land after the batch
+  uint64_t pos;
+  ret = log->Append(zlog::Slice(), &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(pos, *unique.rbegin());
+}
+
+TEST_P(LibZLogTest, AppendBatchRetry) {
+  // make a few of the positions the batch will receive read-only so that only
+  // those entries have to be retried.
+  uint64_t tail;
+  int ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  ret = log->Fill(tail + 1);
+  ASSERT_EQ(ret, 0);
+  ret = log->Fill(tail + 3);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<std::string> inputs = {"a", "b", "c", "d", "e"};
+  std::vector<zlog::Slice> batch(inputs.begin(), inputs.end());
+
+  std::vector<uint64_t> positions;
+  ret = log->AppendBatch(batch, &positions);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(positions.size(), inputs.size());
+
+  ASSERT_EQ(positions[0], tail);
+  ASSERT_EQ(positions[2], tail + 2);
+  ASSERT_EQ(positions[4], tail + 4);
+  ASSERT_GT(positions[1], tail + 4);
+  ASSERT_GT(positions[3], tail + 4);
+
+  for (size_t i = 0; i < positions.size(); i++) {
+    std::string output;
+    ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+}
+
+TEST_P(LibZLogTest, AioAppendBatch) {
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 20; i++) {
+    std::stringstream ss;
+    ss << "data." << i;
+    inputs.push_back(ss.str());
+  }
+
+  std::vector<uint64_t> positions;
+  auto c = zlog::Log::aio_create_completion();
+  {
+    // the entries are copied, so the caller's slices may go away
+    std::vector<zlog::Slice> batch(inputs.begin(), inputs.end());
+    int ret = log->AioAppendBatch(c, batch, &positions);
+    ASSERT_EQ(ret, 0);
+  }
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  delete c;
+
+  ASSERT_EQ(positions.size(), inputs.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    std::string output;
+    int ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+}
+
+// the sequencer is replaced while appends wait on it. the requests keep it
+// alive, and the ones that fail because it went away are retried.
+TEST_P(LibZLogTest, AioAppendSeqrChange) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto held = std::make_shared<HeldSeqrClient>(
+      impl->striper.GetSnapshot()->seqr, impl->striper.Epoch());
+  impl->striper.SetSequencer(held);
+  std::weak_ptr<HeldSeqrClient> weak = held;
+
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 15; i++)
+    inputs.push_back("data." + std::to_string(i));
+
+  std::vector<uint64_t> positions(10);
+  std::vector<zlog::AioCompletion*> completions;
+  for (size_t i = 0; i < positions.size(); i++) {
+    auto c = zlog::Log::aio_create_completion();
+    int ret = log->AioAppend(c, zlog::Slice(inputs[i]), &positions[i]);
+    ASSERT_EQ(ret, 0);
+    completions.push_back(c);
+  }
+
+  std::vector<uint64_t> batch_positions;
+  auto batch_c = zlog::Log::aio_create_completion();
+  {
+    std::vector<zlog::Slice> batch(inputs.begin() + positions.size(),
+        inputs.end());
+    int ret = log->AioAppendBatch(batch_c, batch, &batch_positions);
+    ASSERT_EQ(ret, 0);
+  }
+  ASSERT_EQ(held->Held(), 11u);
+  held.reset();
+
+  // a new layout replaces the sequencer
+  int ret = impl->SetStripeWidth(impl->StripeWidth() + 1);
+  ASSERT_EQ(ret, 0);
+
+  held = weak.lock();
+  ASSERT_TRUE(held != nullptr);
+  ASSERT_NE(impl->striper.GetSnapshot()->seqr, held);
+  ASSERT_EQ(held->Held(), 11u);
+
+  // the old sequencer fails some of the requests, and hands out stale
+  // positions for the rest
+  held->Complete(-EIO, 6);
+  held->Complete(0);
+  held.reset();
+
+  for (auto c : completions) {
+    c->WaitForComplete();
+    ASSERT_EQ(c->ReturnValue(), 0);
+    delete c;
+  }
+  batch_c->WaitForComplete();
+  ASSERT_EQ(batch_c->ReturnValue(), 0);
+  delete batch_c;
+
+  positions.insert(positions.end(), batch_positions.begin(),
+      batch_positions.end());
+  ASSERT_EQ(positions.size(), inputs.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    std::string output;
+    ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+}
+
+// the log is closed while an append backs off from a sequencer that isn't
+// ready. the append fails instead of being left incomplete.
+TEST_P(LibZLogTest, AioAppendShutdown) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto held = std::make_shared<HeldSeqrClient>(
+      impl->striper.GetSnapshot()->seqr, impl->striper.Epoch());
+  held->FailWith(-EAGAIN);
+  impl->striper.SetSequencer(held);
+  held.reset();
+
+  auto c = zlog::Log::aio_create_completion();
+  int ret = log->AioAppend(c, zlog::Slice("data"));
+  ASSERT_EQ(ret, 0);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  delete log;
+  log = nullptr;
+
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), -ESHUTDOWN);
+  delete c;
+}
+
+// the sequencer fails the request for the last entry of a batch. the batch
+// fails, and the positions of the entries that were written are returned.
+TEST_P(LibZLogTest, AioAppendBatchError) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto held = std::make_shared<HeldSeqrClient>(
+      impl->striper.GetSnapshot()->seqr, impl->striper.Epoch());
+  impl->striper.SetSequencer(held);
+
+  // the positions are requested in two groups, and the second one is for the
+  // last entry
+  std::vector<std::string> inputs;
+  for (size_t i = 0; i <= zlog::SeqrClient::max_batch_positions; i++)
+    inputs.push_back("data." + std::to_string(i));
+  std::vector<zlog::Slice> batch(inputs.begin(), inputs.end());
+
+  std::vector<uint64_t> positions;
+  auto c = zlog::Log::aio_create_completion();
+  int ret = log->AioAppendBatch(c, batch, &positions);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(held->Held(), 2u);
+
+  held->Complete(0, 1);
+  held->Complete(-EIO);
+
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), -EIO);
+  delete c;
+
+  ASSERT_EQ(positions.size(), inputs.size());
+  ASSERT_EQ(positions.back(), zlog::Log::invalid_position);
+  for (size_t i = 0; i + 1 < positions.size(); i++) {
+    std::string output;
+    ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+}
+
+TEST_P(LibZLogLeaseTest, Append) {
+  uint64_t tail;
+  int ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  // a single writer takes consecutive positions from its leases
+  std::vector<std::string> inputs;
+  for (uint64_t i = 0; i < 20; i++) {
+    std::stringstream ss;
+    ss << "data." << i;
+    inputs.push_back(ss.str());
+
+    uint64_t pos;
+    ret = log->Append(zlog::Slice(inputs.back()), &pos);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(pos, tail + i);
+  }
+
+  for (uint64_t i = 0; i < inputs.size(); i++) {
+    std::string output;
+    ret = log->Read(tail + i, &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+
+  // the sequencer is ahead by the unused part of the last lease
+  uint64_t new_tail;
+  ret = log->CheckTail(&new_tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(new_tail, tail + 24);
+}
+
+TEST_P(LibZLogLeaseTest, AioAppend) {
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 100; i++) {
+    std::stringstream ss;
+    ss << "data." << i;
+    inputs.push_back(ss.str());
+  }
+
+  std::vector<uint64_t> positions(inputs.size());
+  std::vector<zlog::AioCompletion*> completions;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    auto c = zlog::Log::aio_create_completion();
+    int ret = log->AioAppend(c, zlog::Slice(inputs[i]), &positions[i]);
+    ASSERT_EQ(ret, 0);
+    completions.push_back(c);
+  }
+
+  for (auto c : completions) {
+    c->WaitForComplete();
+    ASSERT_EQ(c->ReturnValue(), 0);
+    delete c;
+  }
+
+  std::set<uint64_t> unique(positions.begin(), positions.end());
+  ASSERT_EQ(unique.size(), positions.size());
+
+  for (size_t i = 0; i < positions.size(); i++) {
+    std::string output;
+    int ret = log->Read(positions[i], &output);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(output, inputs[i]);
+  }
+}
+
+// writers that find the lease exhausted at the same time share one refill.
+// a lease of their own would replace the refilled lease and leave the rest of
+// it as holes to be filled.
+TEST_P(LibZLogLeaseTest, AppendThreads) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto held = std::make_shared<HeldSeqrClient>(
+      impl->striper.GetSnapshot()->seqr, impl->striper.Epoch());
+  held->Delay(std::chrono::milliseconds(1));
+  impl->striper.SetSequencer(held);
+
+  uint64_t tail;
+  int ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<std::vector<uint64_t>> positions(8);
+  std::vector<std::thread> threads;
+  std::atomic<int> errors(0);
+  for (auto& pos : positions) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 50; i++) {
+        uint64_t p;
+        if (log->Append(zlog::Slice("a"), &p))
+          errors++;
+        else
+          pos.push_back(p);
+      }
+    });
+  }
+
+  for (auto& t : threads)
+    t.join();
+  ASSERT_EQ(errors, 0);
+
+  // wait for any fills queued when a lease was replaced
+  std::promise<void> done;
+  impl->QueueFinisher([&done] { done.set_value(); });
+  done.get_future().wait();
+
+  std::set<uint64_t> unique;
+  for (auto& pos : positions)
+    unique.insert(pos.begin(), pos.end());
+  ASSERT_EQ(unique.size(), (size_t)400);
+
+  // only the unused part of the current lease is past the appends
+  uint64_t new_tail;
+  ret = log->CheckTail(&new_tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_LT(new_tail, tail + 400 + 8);
+
+  int filled = 0;
+  for (uint64_t p = tail; p < new_tail; p++) {
+    std::string output;
+    ret = log->Read(p, &output);
+    if (ret == -ENODATA)
+      filled++;
+    else if (ret != -ENOENT)
+      ASSERT_EQ(ret, 0);
+  }
+  ASSERT_EQ(filled, 0);
+}
+
+// a new sequencer starts after the cut, and hands out the unused part of the
+// lease again. the positions aren't filled, so appends to them don't collide.
+TEST_P(LibZLogLeaseTest, SeqrChange) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  uint64_t pos;
+  int ret = log->Append(zlog::Slice("a"), &pos);
+  ASSERT_EQ(ret, 0);
+
+  ret = impl->SetStripeWidth(impl->StripeWidth() + 1);
+  ASSERT_EQ(ret, 0);
+
+  // wait for any fills queued when the lease was dropped
+  std::promise<void> done;
+  impl->QueueFinisher([&done] { done.set_value(); });
+  done.get_future().wait();
+
+  for (uint64_t p = pos + 1; p < pos + 8; p++) {
+    std::string output;
+    ret = log->Read(p, &output);
+    ASSERT_EQ(ret, -ENOENT);
+  }
+
+  uint64_t pos2;
+  ret = log->Append(zlog::Slice("b"), &pos2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos2, pos + 1);
+}
+
+TEST_P(LibZLogLeaseTest, FillOnClose) {
+  if (backend() != "lmdb") {
+    std::cout << "FillOnClose test not enabled for "
+      << backend() << " backend" << std::endl;
+    return;
+  }
+
+  uint64_t pos;
+  int ret = log->Append(zlog::Slice("a"), &pos);
+  ASSERT_EQ(ret, 0);
+
+  // batches of more than one entry don't use the lease. this one lands after
+  // it, so the unused part of the lease is a set of holes rather than the end
+  // of the log.
+  std::vector<zlog::Slice> batch = {zlog::Slice("b"), zlog::Slice("c")};
+  std::vector<uint64_t> positions;
+  ret = log->AppendBatch(batch, &positions);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(positions[0], pos + 8);
+
+  // the holes are filled when the log is closed
+  ret = reopen();
+  ASSERT_EQ(ret, 0);
+
+  for (uint64_t p = pos + 1; p < pos + 8; p++) {
+    std::string output;
+    ret = log->Read(p, &output);
+    ASSERT_EQ(ret, -ENODATA);
+  }
+}
+
 /*
  * Use a log name other than `mylog` below because the test fixture
  * automatically creates a log with that name before the test is run. The other
@@ -153,6 +688,90 @@ TEST_P(LibZLogTest, Aio) {
 //  delete log;
 //}
 
+void LibZLogShmTest::TearDown() {
+  std::string shm_name;
+  if (log) {
+    auto impl = static_cast<zlog::LogImpl*>(log);
+    shm_name = impl->striper.LatestView().second.shm_name();
+  }
+  LibZLogTest::TearDown();
+  if (!shm_name.empty())
+    zlog::ShmSeqrClient::Unlink(shm_name);
+}
+
+TEST_P(LibZLogShmTest, Append) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  ASSERT_TRUE(impl->striper.LatestView().second.has_shm_name());
+
+  uint64_t tail;
+  int ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, (uint64_t)0);
+
+  for (uint64_t i = 0; i < 10; i++) {
+    uint64_t pos;
+    ret = log->Append(zlog::Slice("a"), &pos);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(pos, i);
+  }
+
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, (uint64_t)10);
+}
+
+// a second client of the log shares the sequencer without a new cut, and a
+// cut initializes the sequencer from the log
+TEST_P(LibZLogShmTest, SharedWriters) {
+  if (!lowlevel()) {
+    std::cout << "SharedWriters test requires a shared backend" << std::endl;
+    return;
+  }
+
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  const uint64_t epoch = impl->striper.Epoch();
+
+  zlog::Log *log2;
+  int ret = zlog::Log::OpenWithBackend(options, impl->backend,
+      "mylog", &log2);
+  ASSERT_EQ(ret, 0);
+  auto impl2 = static_cast<zlog::LogImpl*>(log2);
+  ASSERT_EQ(impl2->striper.Epoch(), epoch);
+
+  std::set<uint64_t> positions;
+  for (int i = 0; i < 10; i++) {
+    uint64_t pos;
+    ret = (i % 2 ? log : log2)->Append(zlog::Slice("a"), &pos);
+    ASSERT_EQ(ret, 0);
+    positions.insert(pos);
+  }
+  ASSERT_EQ(positions.size(), (size_t)10);
+  ASSERT_EQ(*positions.rbegin(), (uint64_t)9);
+
+  uint64_t tail;
+  ret = log2->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, (uint64_t)10);
+
+  // positions handed out but not written are reused after a cut
+  ret = impl->CheckTail(&tail, nullptr, true);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, (uint64_t)10);
+
+  ret = impl->ProposeShmMode();
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(impl->striper.Epoch(), epoch);
+
+  // the second client notices the new cut
+  uint64_t pos;
+  ret = log2->Append(zlog::Slice("a"), &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, (uint64_t)10);
+  ASSERT_EQ(impl2->striper.Epoch(), impl->striper.Epoch());
+
+  delete log2;
+}
+
 TEST_P(LibZLogTest, CheckTail) {
   uint64_t pos;
   int ret = log->CheckTail(&pos);
@@ -164,6 +783,141 @@ TEST_P(LibZLogTest, CheckTail) {
   ASSERT_EQ(pos, (unsigned)0);
 }
 
+TEST_P(LibZLogTest, WaitForTail) {
+  uint64_t tail;
+  int ret = log->WaitForTail(0, std::chrono::milliseconds(10), &tail);
+  ASSERT_EQ(ret, -ETIMEDOUT);
+  ASSERT_EQ(tail, (unsigned)0);
+
+  uint64_t pos;
+  ret = log->Append(zlog::Slice("a"), &pos);
+  ASSERT_EQ(ret, 0);
+
+  // already past
+  ret = log->WaitForTail(pos, std::chrono::milliseconds(0), &tail);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, pos + 1);
+
+  // woken by an append
+  std::thread appender([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    uint64_t pos2;
+    ASSERT_EQ(log->Append(zlog::Slice("b"), &pos2), 0);
+  });
+  ret = log->WaitForTail(pos + 1, std::chrono::seconds(10), &tail);
+  appender.join();
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tail, pos + 2);
+}
+
+TEST_P(LibZLogTest, TailIterator) {
+  std::vector<uint64_t> positions;
+  for (int i = 0; i < 5; i++) {
+    uint64_t pos;
+    int ret = log->Append(zlog::Slice("entry." + std::to_string(i)), &pos);
+    ASSERT_EQ(ret, 0);
+    positions.push_back(pos);
+  }
+
+  // a trimmed position is skipped
+  int ret = log->Trim(positions[2]);
+  ASSERT_EQ(ret, 0);
+
+  zlog::TailIterator *it;
+  ret = log->OpenTailIterator(positions[1], &it);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(it->Position(), positions[1]);
+
+  for (int i : {1, 3, 4}) {
+    uint64_t pos;
+    std::string data;
+    ret = it->Next(std::chrono::milliseconds(0), &pos, &data);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(pos, positions[i]);
+    ASSERT_EQ(data, "entry." + std::to_string(i));
+  }
+
+  // caught up with the tail
+  uint64_t pos;
+  std::string data;
+  ret = it->Next(std::chrono::milliseconds(10), &pos, &data);
+  ASSERT_EQ(ret, -ETIMEDOUT);
+  ASSERT_EQ(it->Position(), positions[4] + 1);
+
+  // woken by an append
+  std::thread appender([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    int ret = log->Append(zlog::Slice("entry.5"));
+    ASSERT_EQ(ret, 0);
+  });
+  ret = it->Next(std::chrono::seconds(10), &pos, &data);
+  appender.join();
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(data, "entry.5");
+
+  delete it;
+
+  // a position handed out to a writer that never writes it is filled
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  uint64_t hole;
+  ret = impl->CheckTail(&hole, nullptr, true);
+  ASSERT_EQ(ret, 0);
+  ret = log->Append(zlog::Slice("entry.6"));
+  ASSERT_EQ(ret, 0);
+
+  auto opts = options;
+  opts.tail_hole_timeout_ms = 50;
+  zlog::Log *log2;
+  ret = zlog::Log::OpenWithBackend(opts, impl->backend, "mylog", &log2);
+  ASSERT_EQ(ret, 0);
+
+  ret = log2->OpenTailIterator(hole, &it);
+  ASSERT_EQ(ret, 0);
+
+  ret = it->Next(std::chrono::milliseconds(5), &pos, &data);
+  ASSERT_EQ(ret, -ETIMEDOUT);
+  ASSERT_EQ(it->Position(), hole);
+
+  ret = it->Next(std::chrono::seconds(10), &pos, &data);
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(pos, hole);
+  ASSERT_EQ(data, "entry.6");
+
+  ret = log2->Read(hole, &data);
+  ASSERT_EQ(ret, -ENODATA);
+
+  delete it;
+  delete log2;
+}
+
+TEST_P(LibZLogTest, CheckTails) {
+  std::vector<uint64_t> tails;
+  int ret = zlog::CheckTails({}, &tails);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(tails.empty());
+
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  zlog::Log *log2;
+  ret = zlog::Log::CreateWithBackend(options, impl->backend,
+      "CheckTails", &log2);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 3; i++) {
+    ret = log->Append(zlog::Slice("a"));
+    ASSERT_EQ(ret, 0);
+  }
+  for (int i = 0; i < 5; i++) {
+    ret = log2->Append(zlog::Slice("a"));
+    ASSERT_EQ(ret, 0);
+  }
+
+  ret = zlog::CheckTails({log, log2, log}, &tails);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(tails, std::vector<uint64_t>({3, 5, 3}));
+
+  delete log2;
+}
+
 TEST_P(LibZLogTest, Append) {
   uint64_t tail;
   int ret = log->CheckTail(&tail);
@@ -192,6 +946,428 @@ TEST_P(LibZLogTest, Append) {
   ASSERT_GT(pos2, pos);
 }
 
+// appenders use the view and sequencer snapshots while new views replace them
+TEST_P(LibZLogTest, AppendViewChange) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  std::vector<std::vector<uint64_t>> positions(4);
+  std::vector<std::thread> threads;
+  std::atomic<int> errors(0);
+  for (auto& pos : positions) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 200; i++) {
+        uint64_t p;
+        if (log->Append(zlog::Slice("a"), &p))
+          errors++;
+        else
+          pos.push_back(p);
+      }
+    });
+  }
+
+  const uint64_t epoch = impl->striper.Epoch();
+  for (int i = 0; i < 5; i++) {
+    int ret = impl->ExtendMap();
+    ASSERT_EQ(ret, 0);
+  }
+  ASSERT_GE(impl->striper.Epoch(), epoch + 5);
+
+  for (auto& t : threads)
+    t.join();
+  ASSERT_EQ(errors, 0);
+
+  std::set<uint64_t> unique;
+  for (auto& pos : positions)
+    unique.insert(pos.begin(), pos.end());
+  ASSERT_EQ(unique.size(), (size_t)800);
+}
+
+// the map is extended in the background ahead of the appends, and the
+// extensions keep the sequencer. without it each new stripe stalls an append.
+TEST_P(LibZLogTest, AppendExtendsAhead) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  for (int distance : {0, 30}) {
+    auto stats = zlog::CreateCacheStatistics();
+
+    auto opts = options;
+    opts.width = 2;
+    opts.entries_per_object = 10;
+    opts.map_extend_distance = distance;
+    opts.statistics = stats.get();
+
+    zlog::Log *log2;
+    int ret = zlog::Log::CreateWithBackend(opts, impl->backend,
+        "extend-ahead-" + std::to_string(distance), &log2);
+    ASSERT_EQ(ret, 0);
+    auto impl2 = static_cast<zlog::LogImpl*>(log2);
+
+    const auto seqr = impl2->striper.GetSnapshot()->seqr;
+    const uint64_t epoch = impl2->striper.Epoch();
+
+    for (int i = 0; i < 100; i++) {
+      ret = log2->Append(zlog::Slice("a"));
+      ASSERT_EQ(ret, 0);
+      // let a queued extension finish before the next append
+      while (impl2->extending)
+        std::this_thread::yield();
+    }
+
+    // 100 positions span 5 stripes
+    ASSERT_GE(impl2->striper.Epoch(), epoch + 4);
+    ASSERT_EQ(impl2->striper.GetSnapshot()->seqr, seqr);
+
+    if (distance)
+      ASSERT_EQ(stats->getTickerCount(zlog::MAP_EXTEND_STALLS), 0u);
+    else
+      ASSERT_GE(stats->getTickerCount(zlog::MAP_EXTEND_STALLS), 4u);
+
+    delete log2;
+  }
+}
+
+// a cut finds the max position in the stripes before the empty stripes that
+// extended the log
+TEST_P(LibZLogTest, CreateCut) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  auto stats = zlog::CreateCacheStatistics();
+
+  auto opts = options;
+  opts.map_extend_distance = 0;
+  opts.statistics = stats.get();
+
+  zlog::Log *log2;
+  int ret = zlog::Log::CreateWithBackend(opts, impl->backend, "cut", &log2);
+  ASSERT_EQ(ret, 0);
+  auto impl2 = static_cast<zlog::LogImpl*>(log2);
+
+  uint64_t epoch, maxpos;
+  bool empty;
+  ret = impl2->CreateCut(&epoch, &maxpos, &empty);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(empty);
+
+  uint64_t pos;
+  for (int i = 0; i < 25; i++) {
+    ret = log2->Append(zlog::Slice("a"), &pos);
+    ASSERT_EQ(ret, 0);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    ret = impl2->ExtendMap();
+    ASSERT_EQ(ret, 0);
+  }
+
+  ret = impl2->CreateCut(&epoch, &maxpos, &empty);
+  ASSERT_EQ(ret, 0);
+  ASSERT_FALSE(empty);
+  ASSERT_EQ(maxpos, pos);
+  ASSERT_EQ(impl2->striper.Epoch(), epoch);
+
+  // both cuts are timed
+  auto cuts = stats->getHistogramString(zlog::CUT_SEAL_MICROS);
+  ASSERT_EQ(cuts.find("Count: 2 "), 0u);
+
+  delete log2;
+}
+
+// extended views are collapsed into a range, and positions in every view of
+// the range still map to the objects they were written to
+TEST_P(LibZLogTest, ReadExtendedViews) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  std::map<uint64_t, std::string> entries;
+  for (int i = 0; i < 10; i++) {
+    for (int j = 0; j < 3; j++) {
+      const std::string data = "entry." + std::to_string(i) + "." +
+        std::to_string(j);
+      uint64_t pos;
+      int ret = log->Append(zlog::Slice(data), &pos);
+      ASSERT_EQ(ret, 0);
+      entries.emplace(pos, data);
+    }
+    int ret = impl->ExtendMap();
+    ASSERT_EQ(ret, 0);
+  }
+
+  for (auto& entry : entries) {
+    std::string data;
+    int ret = log->Read(entry.first, &data);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(data, entry.second);
+  }
+
+  // positions past the appended entries are in later views of the range
+  const auto conf = impl->striper.GetCurrent();
+  ASSERT_GT(conf.minpos, entries.rbegin()->first);
+
+  const uint64_t pos = conf.minpos - 1;
+  int ret = log->Fill(pos);
+  ASSERT_EQ(ret, 0);
+
+  std::string data;
+  ret = log->Read(pos, &data);
+  ASSERT_EQ(ret, -ENODATA);
+}
+
+// views are read in batches, and a client opening the log starts from the
+// checkpoint of the views
+TEST_P(LibZLogTest, ViewCheckpoint) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto opts = options;
+  opts.map_extend_distance = 0;
+  opts.view_checkpoint_interval = 10;
+
+  zlog::Log *log2;
+  int ret = zlog::Log::CreateWithBackend(opts, impl->backend, "ckpt", &log2);
+  ASSERT_EQ(ret, 0);
+  auto impl2 = static_cast<zlog::LogImpl*>(log2);
+
+  std::map<uint64_t, std::string> entries;
+  for (int i = 0; i < 25; i++) {
+    const std::string data = "entry." + std::to_string(i);
+    uint64_t pos;
+    ret = log2->Append(zlog::Slice(data), &pos);
+    ASSERT_EQ(ret, 0);
+    entries.emplace(pos, data);
+    ret = impl2->ExtendMap();
+    ASSERT_EQ(ret, 0);
+  }
+
+  const uint64_t epoch = impl2->striper.Epoch();
+  ASSERT_GE(epoch, 25u);
+
+  std::map<uint64_t, std::string> views;
+  ret = impl->backend->ReadViews(impl2->hoid, 0, 5, views);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(views.size(), 5u);
+  ASSERT_EQ(views.begin()->first, 0u);
+
+  views.clear();
+  ret = impl->backend->ReadViews(impl2->hoid, 1, 1000, views);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(views.size(), epoch);
+  ASSERT_EQ(views.rbegin()->first, epoch);
+
+  // the checkpoint is written in the background
+  std::string data;
+  while (true) {
+    ret = impl->backend->ReadViewCheckpoint(impl2->hoid, &data);
+    if (ret != -ENOENT)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (ret == -EOPNOTSUPP) {
+    std::cout << "ViewCheckpoint test not enabled for "
+      << backend() << " backend" << std::endl;
+    delete log2;
+    return;
+  }
+  ASSERT_EQ(ret, 0);
+
+  zlog_proto::ViewCheckpoint checkpoint;
+  ASSERT_TRUE(checkpoint.ParseFromString(data));
+  ASSERT_EQ(checkpoint.epoch() % 10, 0u);
+
+  // the checkpoint maps the positions written before it was taken
+  std::string hoid, prefix;
+  ret = impl->backend->OpenLog("ckpt", hoid, prefix);
+  ASSERT_EQ(ret, 0);
+
+  Striper striper(prefix);
+  ret = striper.LoadCheckpoint(data);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(striper.Epoch(), checkpoint.epoch());
+  ASSERT_EQ(striper.LoadCheckpoint(data), -EEXIST);
+
+  for (auto& entry : entries) {
+    auto mapping = striper.MapPosition(entry.first);
+    if (!mapping)
+      break;
+    auto expected = impl2->striper.MapPosition(entry.first);
+    ASSERT_TRUE(expected);
+    ASSERT_EQ(*mapping->oid, *expected->oid);
+  }
+
+  zlog::Log *log3;
+  ret = zlog::Log::OpenWithBackend(opts, impl->backend, "ckpt", &log3);
+  ASSERT_EQ(ret, 0);
+  auto impl3 = static_cast<zlog::LogImpl*>(log3);
+  ASSERT_GE(impl3->striper.Epoch(), epoch);
+
+  for (auto& entry : entries) {
+    ret = log3->Read(entry.first, &data);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(data, entry.second);
+  }
+
+  uint64_t pos;
+  ret = log3->Append(zlog::Slice("a"), &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(pos, entries.rbegin()->first);
+
+  delete log3;
+  delete log2;
+}
+
+// a new layout starts at the next position, and the positions written before
+// it keep their mapping
+TEST_P(LibZLogTest, SetStripeWidth) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  ASSERT_EQ(impl->SetStripeWidth(0), -EINVAL);
+
+  std::map<uint64_t, std::string> entries;
+  auto append = [&](int count) {
+    for (int i = 0; i < count; i++) {
+      const std::string data = "entry." + std::to_string(entries.size());
+      uint64_t pos;
+      int ret = log->Append(zlog::Slice(data), &pos);
+      ASSERT_EQ(ret, 0);
+      entries.emplace(pos, data);
+    }
+  };
+
+  append(25);
+
+  int ret = impl->SetStripeWidth(3);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log->StripeWidth(), 3);
+  ASSERT_EQ(impl->striper.GetCurrent().minpos, entries.rbegin()->first + 1);
+
+  append(25);
+
+  // the latest stripes are empty after the map is extended
+  ret = impl->ExtendMap();
+  ASSERT_EQ(ret, 0);
+  ret = impl->ExtendMap();
+  ASSERT_EQ(ret, 0);
+
+  ret = impl->SetStripeWidth(5);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log->StripeWidth(), 5);
+  ASSERT_EQ(impl->striper.GetCurrent().minpos, entries.rbegin()->first + 1);
+
+  append(25);
+
+  auto mapping = impl->striper.MapPosition(entries.rbegin()->first);
+  ASSERT_TRUE(mapping);
+  ASSERT_EQ(mapping->width, 5u);
+
+  for (auto& entry : entries) {
+    std::string data;
+    ret = log->Read(entry.first, &data);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(data, entry.second);
+  }
+
+  // the ranges replaced by the new layouts aren't in the checkpoint
+  std::string hoid, prefix;
+  ret = impl->backend->OpenLog("mylog", hoid, prefix);
+  ASSERT_EQ(ret, 0);
+
+  std::string checkpoint;
+  ret = impl->striper.Checkpoint(&checkpoint);
+  ASSERT_EQ(ret, 0);
+
+  Striper striper(prefix);
+  ret = striper.LoadCheckpoint(checkpoint);
+  ASSERT_EQ(ret, 0);
+
+  // the log may be extended in the background after the checkpoint
+  auto mapping2 = striper.MapPosition(entries.rbegin()->first);
+  ASSERT_TRUE(mapping2);
+  ASSERT_EQ(mapping2->width, 5u);
+  ASSERT_EQ(*mapping2->oid, *mapping->oid);
+
+  // a client opening the log maps the positions the same way
+  zlog::Log *log2;
+  ret = zlog::Log::OpenWithBackend(options, impl->backend, "mylog", &log2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log2->StripeWidth(), 5);
+
+  for (auto& entry : entries) {
+    std::string data;
+    ret = log2->Read(entry.first, &data);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(data, entry.second);
+  }
+
+  delete log2;
+}
+
+// the stripe is widened while appends exceed the rate for each object
+TEST_P(LibZLogTest, WidenStripe) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  auto opts = options;
+  opts.width = 2;
+  opts.stripe_widen_rate = 1;
+  opts.stripe_widen_max_width = 8;
+  opts.stripe_widen_interval_ms = 10;
+
+  zlog::Log *log2;
+  int ret = zlog::Log::CreateWithBackend(opts, impl->backend, "widen", &log2);
+  ASSERT_EQ(ret, 0);
+
+  const auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::seconds(10);
+  while (log2->StripeWidth() < 8 &&
+      std::chrono::steady_clock::now() < deadline) {
+    ret = log2->Append(zlog::Slice("a"));
+    ASSERT_EQ(ret, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(log2->StripeWidth(), 8);
+
+  delete log2;
+}
+
+// a client learns about a new view without an operation failing with a stale
+// epoch
+TEST_P(LibZLogTest, WatchViews) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  uint64_t cookie;
+  int ret = impl->backend->WatchViews(impl->hoid, [] {}, &cookie);
+  if (ret == -EOPNOTSUPP) {
+    std::cout << "WatchViews test not enabled for "
+      << backend() << " backend" << std::endl;
+    return;
+  }
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(impl->backend->UnwatchViews(cookie), 0);
+  ASSERT_EQ(impl->backend->UnwatchViews(cookie), -ENOENT);
+
+  zlog::Log *log2;
+  ret = zlog::Log::CreateWithBackend(options, impl->backend, "watch", &log2);
+  ASSERT_EQ(ret, 0);
+  auto impl2 = static_cast<zlog::LogImpl*>(log2);
+
+  zlog::Log *log3;
+  ret = zlog::Log::OpenWithBackend(options, impl->backend, "watch", &log3);
+  ASSERT_EQ(ret, 0);
+  auto impl3 = static_cast<zlog::LogImpl*>(log3);
+
+  for (int i = 0; i < 3; i++) {
+    ret = impl2->ExtendMap();
+    ASSERT_EQ(ret, 0);
+
+    const uint64_t epoch = impl2->striper.Epoch();
+    const auto deadline = std::chrono::steady_clock::now() +
+      std::chrono::seconds(10);
+    while (impl3->striper.Epoch() < epoch &&
+        std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(impl3->striper.Epoch(), epoch);
+  }
+
+  delete log3;
+  delete log2;
+}
+
 TEST_P(LibZLogTest, Fill) {
   int ret = log->Fill(0);
   ASSERT_EQ(ret, 0);
@@ -217,6 +1393,94 @@ TEST_P(LibZLogTest, Fill) {
   ASSERT_EQ(ret, 0);
 }
 
+TEST_P(LibZLogTest, ReadRange) {
+  auto impl = static_cast<zlog::LogImpl*>(log);
+
+  // position -> expected return value and entry
+  std::map<uint64_t, std::pair<int, std::string>> expected;
+  auto append = [&](int count) {
+    for (int i = 0; i < count; i++) {
+      const std::string data = "entry." + std::to_string(expected.size());
+      uint64_t pos;
+      int ret = log->Append(zlog::Slice(data), &pos);
+      ASSERT_EQ(ret, 0);
+      expected[pos] = std::make_pair(0, data);
+    }
+  };
+
+  append(30);
+
+  int ret = log->Trim(3);
+  ASSERT_EQ(ret, 0);
+  expected[3] = std::make_pair(-ENODATA, "");
+
+  // positions after the tail are unwritten, except for a filled one
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  ret = log->Fill(tail + 5);
+  ASSERT_EQ(ret, 0);
+  expected[tail + 5] = std::make_pair(-ENODATA, "");
+
+  // the rest of the log is in another layout
+  ret = impl->SetStripeWidth(3);
+  ASSERT_EQ(ret, 0);
+  append(30);
+
+  // the end of the range is past the mapped log, and the range spans more
+  // than one read of each object
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  const uint64_t end = tail + 3000;
+  ASSERT_GT(end, impl->striper.GetSnapshot()->MaxPosition());
+
+  auto check = [&](zlog::Log *log, uint64_t begin, uint64_t end) {
+    uint64_t next = begin;
+    int ret = log->ReadRange(begin, end,
+        [&](uint64_t position, int ret, const zlog::Slice& data) {
+      EXPECT_EQ(position, next);
+      next++;
+      auto it = expected.find(position);
+      if (it == expected.end()) {
+        EXPECT_EQ(ret, -ENOENT);
+      } else {
+        EXPECT_EQ(ret, it->second.first);
+        EXPECT_EQ(data.ToString(), it->second.second);
+      }
+      return 0;
+    });
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(next, end);
+  };
+
+  check(log, 0, end);
+  check(log, 7, 42);
+  check(log, tail, tail);
+
+  ret = log->ReadRange(1, 0, [](uint64_t, int, const zlog::Slice&) {
+    return 0;
+  });
+  ASSERT_EQ(ret, -EINVAL);
+
+  // the callback stops the read
+  uint64_t calls = 0;
+  ret = log->ReadRange(0, end, [&](uint64_t position, int, const zlog::Slice&) {
+    calls++;
+    return position == 10 ? -ECANCELED : 0;
+  });
+  ASSERT_EQ(ret, -ECANCELED);
+  ASSERT_EQ(calls, 11u);
+
+  // one read in flight at a time
+  auto opts = options;
+  opts.read_range_window = 1;
+  zlog::Log *log2;
+  ret = zlog::Log::OpenWithBackend(opts, impl->backend, "mylog", &log2);
+  ASSERT_EQ(ret, 0);
+  check(log2, 0, end);
+  delete log2;
+}
+
 TEST_P(LibZLogTest, Read) {
   std::string entry;
   int ret = log->Read(0, &entry);
@@ -261,6 +1525,89 @@ TEST_P(LibZLogTest, Read) {
   ASSERT_EQ(ret, -ENODATA);
 }
 
+TEST_P(LibZLogTest, ReadPinned) {
+  zlog::PinnedSlice entry;
+  int ret = log->ReadPinned(0, &entry);
+  ASSERT_EQ(ret, -ENOENT);
+
+  ret = log->Fill(0);
+  ASSERT_EQ(ret, 0);
+  ret = log->ReadPinned(0, &entry);
+  ASSERT_EQ(ret, -ENODATA);
+
+  std::vector<uint64_t> positions;
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 10; i++) {
+    inputs.push_back("pinned." + std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(zlog::Slice(inputs.back()), &pos);
+    ASSERT_EQ(ret, 0);
+    positions.push_back(pos);
+  }
+
+  std::vector<zlog::PinnedSlice> entries(positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    ret = log->ReadPinned(positions[i], &entries[i]);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(entries[i].ToString(), inputs[i]);
+  }
+
+  // the pinned entries stay valid while the log changes
+  for (int i = 0; i < 10; i++) {
+    ret = log->Append(zlog::Slice("other"));
+    ASSERT_EQ(ret, 0);
+  }
+  ret = log->Trim(positions[0]);
+  ASSERT_EQ(ret, 0);
+
+  for (size_t i = 0; i < positions.size(); i++) {
+    ASSERT_EQ(entries[i].ToString(), inputs[i]);
+  }
+
+  ret = log->ReadPinned(positions[0], &entry);
+  ASSERT_EQ(ret, -ENODATA);
+  ret = log->ReadPinned(positions[1], &entry);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(entry.ToString(), inputs[1]);
+
+  // a copy shares the pin
+  zlog::PinnedSlice copy = entries[2];
+  entries[2].Reset();
+  ASSERT_TRUE(entries[2].empty());
+  ASSERT_EQ(copy.ToString(), inputs[2]);
+
+  // without the cache the entries are pinned by the backend
+  auto impl = static_cast<zlog::LogImpl*>(log);
+  auto opts = options;
+  opts.cache_size = 0;
+  zlog::Log *log2;
+  ret = zlog::Log::OpenWithBackend(opts, impl->backend, "mylog", &log2);
+  ASSERT_EQ(ret, 0);
+
+  for (size_t i = 1; i < positions.size(); i++) {
+    ret = log2->ReadPinned(positions[i], &entries[i]);
+    ASSERT_EQ(ret, 0);
+  }
+  ret = log2->ReadPinned(positions[0], &entry);
+  ASSERT_EQ(ret, -ENODATA);
+
+  ret = log2->Trim(positions[1]);
+  ASSERT_EQ(ret, 0);
+  for (int i = 0; i < 10; i++) {
+    ret = log2->Append(zlog::Slice("other"));
+    ASSERT_EQ(ret, 0);
+  }
+
+  for (size_t i = 1; i < positions.size(); i++) {
+    ASSERT_EQ(entries[i].ToString(), inputs[i]);
+  }
+
+  entries.clear();
+  entry.Reset();
+  copy.Reset();
+  delete log2;
+}
+
 TEST_P(LibZLogTest, Trim) {
   // can trim empty spot
   int ret = log->Trim(55);
@@ -29,6 +29,25 @@ class LibZLogTest : public ::testing::TestWithParam<std::tuple<bool, bool>> {
   }
 };
 
+// C++ API with positions leased from the sequencer
+class LibZLogLeaseTest : public LibZLogTest {
+ protected:
+  LibZLogLeaseTest() {
+    options.seqr_lease_size = 8;
+  }
+};
+
+// C++ API with a shared-memory sequencer
+class LibZLogShmTest : public LibZLogTest {
+ protected:
+  LibZLogShmTest() {
+    options.seqr_shm = true;
+  }
+
+  // removes the segment
+  void TearDown() override;
+};
+
 // C API
 class LibZLogCAPITest : public ::testing::TestWithParam<std::tuple<bool, bool>> {
  protected:
@@ -180,6 +180,10 @@ static inline void AsmVolatilePause() {
 // Returns -1 if not available on this platform
 extern int PhysicalCoreID();
 
+// Pins the calling thread to a CPU. Returns 0 on success, a negative error
+// code on failure, or -ENOTSUP if not available on this platform.
+extern int SetThreadAffinity(int cpu);
+
 typedef pthread_once_t OnceType;
 #define LEVELDB_ONCE_INIT PTHREAD_ONCE_INIT
 extern void InitOnce(OnceType* once, void (*initializer)());
@@ -1,16 +1,25 @@
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <cstdlib>
 #include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/program_options.hpp>
+#include <CivetServer.h>
 #include "proto/zlog.pb.h"
 #include "libzlog/log_impl.h"
+#include "libseq/seqr_frame.h"
+#include "monitoring/histogram.h"
+#include "port/port_posix.h"
+#include "util/core_local.h"
 
 namespace po = boost::program_options;
 
@@ -20,6 +29,12 @@ static std::string iops_logfile;
 
 static int report_sec;
 
+static int init_threads;
+
+static bool create_logs;
+
+static int server_port;
+
 #if __APPLE__
 static uint64_t get_time()
 {
@@ -41,13 +56,6 @@ static uint64_t get_time(void)
 }
 #endif
 
-template <class T>
-inline void hash_combine(std::size_t& seed, const T& v)
-{
-  std::hash<T> hasher;
-  seed ^= hasher(v) + 0x9e3779b9 + (seed<<6) + (seed>>2);
-}
-
 /*
  * TODO: currently the sequencer uses "pool" as a way to identify log state. But
  * now with pluggable storage backends, the "pool" concept is not generic. Until
@@ -58,25 +66,8 @@ inline void hash_combine(std::size_t& seed, const T& v)
  */
 typedef std::map<std::string, std::string> meta_t;
 
-namespace std
-{
-  template<> struct hash<std::pair<meta_t, std::string>>
-  {
-    typedef std::pair<meta_t, std::string> argument_type;
-    typedef std::size_t result_type;
-    result_type operator()(argument_type const& s) const
-    {
-      result_type seed(std::hash<std::string>{}(s.second));
-      for (auto e : s.first) {
-        hash_combine(seed, e.first);
-        hash_combine(seed, e.second);
-      }
-      return seed;
-    }
-  };
-}
-
-static meta_t get_meta(zlog_proto::MSeqRequest& req)
+template <typename M>
+static meta_t get_meta(const M& req)
 {
   meta_t meta;
   for (int i = 0; i < req.meta_size(); i++) {
@@ -86,6 +77,97 @@ static meta_t get_meta(zlog_proto::MSeqRequest& req)
   return meta;
 }
 
+/*
+ * Compare the meta in a request to a log's meta without building a map.
+ * Clients serialize the meta from an ordered map, so the pairs are compared
+ * in order and we only fall back to building a map when that fails.
+ */
+template <typename M>
+static bool meta_equal(const meta_t& meta, const M& req)
+{
+  if ((size_t)req.meta_size() != meta.size())
+    return get_meta(req) == meta;
+  int i = 0;
+  for (auto it = meta.begin(); it != meta.end(); it++, i++) {
+    const auto& kv = req.meta(i);
+    if (kv.key() != it->first || kv.val() != it->second)
+      return get_meta(req) == meta;
+  }
+  return true;
+}
+
+/*
+ * Server statistics. Counters and histograms are kept per core, like
+ * StatisticsImpl, so updating them on the request path doesn't contend, and
+ * the per-core values are only summed when the metrics are read. Statistics
+ * are only collected when the metrics endpoint is enabled.
+ */
+class ServerStats {
+ public:
+  enum Ticker : uint32_t {
+    SESSIONS_OPENED,
+    SESSIONS_CLOSED,
+    STALE_EPOCH_REPLIES,
+    INIT_LOG_REPLIES,
+    HELD_REQUESTS,
+    TICKER_MAX
+  };
+
+  // service times are in nanoseconds, and log init times in microseconds
+  enum Histogram : uint32_t {
+    V1_REQUEST,
+    REGISTER,
+    CHECK_TAIL,
+    WAIT_TAIL,
+    MULTI_CHECK_TAIL,
+    LOG_INIT,
+    HISTOGRAM_MAX
+  };
+
+  void tick(Ticker ticker, uint64_t count = 1) {
+    per_core_.Access()->tickers[ticker].fetch_add(count,
+        std::memory_order_relaxed);
+  }
+
+  void measure(Histogram histogram, uint64_t value) {
+    per_core_.Access()->histograms[histogram].Add(value);
+  }
+
+  uint64_t ticker(Ticker ticker) const {
+    uint64_t res = 0;
+    for (size_t i = 0; i < per_core_.Size(); i++)
+      res += per_core_.AccessAtCore(i)->tickers[ticker].load(
+          std::memory_order_relaxed);
+    return res;
+  }
+
+  void histogram(Histogram histogram, zlog::HistogramImpl *res) const {
+    for (size_t i = 0; i < per_core_.Size(); i++)
+      res->Merge(per_core_.AccessAtCore(i)->histograms[histogram]);
+  }
+
+ private:
+  struct Data {
+    std::atomic_uint_fast64_t tickers[TICKER_MAX] = {{0}};
+    zlog::HistogramImpl histograms[HISTOGRAM_MAX];
+    char padding[CACHE_LINE_SIZE -
+      (TICKER_MAX * sizeof(std::atomic_uint_fast64_t) +
+       HISTOGRAM_MAX * sizeof(zlog::HistogramImpl)) % CACHE_LINE_SIZE];
+  };
+
+  static_assert(sizeof(Data) % CACHE_LINE_SIZE == 0, "Expected cache aligned");
+
+  zlog::CoreLocalArray<Data> per_core_;
+};
+
+static ServerStats *server_stats;
+
+static inline void record_tick(ServerStats::Ticker ticker)
+{
+  if (server_stats)
+    server_stats->tick(ticker);
+}
+
 /*
  * The sequence tracks the current sequence number. A read() returns the next
  * tail value, that is, the value returned from the next call to next(). So,
@@ -97,7 +179,7 @@ class Sequence {
   Sequence(uint64_t seq, meta_t meta,
       std::string name, uint64_t epoch) :
     seq_(seq), meta_(meta), name_(name),
-    epoch_(epoch)
+    epoch_(epoch), num_waiters_(0)
   {}
 
   uint64_t read() {
@@ -106,17 +188,63 @@ class Sequence {
 
   uint64_t next() {
     uint64_t prev = seq_.fetch_add(1);
+    if (num_waiters_)
+      wake_waiters();
     return prev;
   }
 
-  void next(std::vector<uint64_t>& positions, int count) {
+  // reserve count positions and return the first
+  uint64_t next(int count) {
     assert(count > 0);
     uint64_t prev = seq_.fetch_add(count);
+    if (num_waiters_)
+      wake_waiters();
+    return prev;
+  }
+
+  void next(std::vector<uint64_t>& positions, int count) {
+    uint64_t prev = next(count);
     for (uint64_t i = 0; i < (uint64_t)count; i++) {
       positions.push_back(prev + i);
     }
   }
 
+  /*
+   * A waiter is woken, once, with the tail when the tail moves past its
+   * position. Waking must not block because it runs with the waiter lock
+   * held, on the thread that moved the tail.
+   */
+  struct Waiter {
+    uint64_t after;
+    std::function<void(uint64_t)> wake;
+  };
+
+  /*
+   * Add a waiter, which is woken right away if the tail is already past its
+   * position. The tail is read after the waiter is counted, and next() reads
+   * the count after it moves the tail, so one of them sees the other.
+   */
+  void wait(std::shared_ptr<Waiter> waiter) {
+    std::lock_guard<std::mutex> l(waiters_lock_);
+    waiters_.emplace(waiter->after, waiter);
+    num_waiters_++;
+    wake_waiters_locked(read());
+  }
+
+  // remove a waiter that hasn't been woken. returns false if it was woken.
+  bool cancel_wait(const std::shared_ptr<Waiter>& waiter) {
+    std::lock_guard<std::mutex> l(waiters_lock_);
+    auto range = waiters_.equal_range(waiter->after);
+    for (auto it = range.first; it != range.second; it++) {
+      if (it->second == waiter) {
+        waiters_.erase(it);
+        num_waiters_--;
+        return true;
+      }
+    }
+    return false;
+  }
+
   /*
    * the lock used limits concurrent queries and updates related to the
    * streaming interface. the actual next position is still atomic with
@@ -211,12 +339,10 @@ class Sequence {
     return 0;
   }
 
-  inline int match(const meta_t& meta,
-      const std::string& name,
-      const uint64_t epoch) const {
-    if (meta != meta_ || name != name_)
+  inline int match(const zlog_proto::MSeqRequest& req) const {
+    if (req.name() != name_ || !meta_equal(meta_, req))
       return -EINVAL;
-    if (epoch < epoch_)
+    if (req.epoch() < epoch_)
       return -ERANGE;
     return 0;
   }
@@ -225,10 +351,36 @@ class Sequence {
     streams_.swap(ptrs);
   }
 
+  uint64_t epoch() const {
+    return epoch_;
+  }
+
+  const meta_t& meta() const {
+    return meta_;
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
  private:
   typedef std::deque<uint64_t> stream_backpointers_t;
   typedef std::map<uint64_t, stream_backpointers_t> stream_index_t;
 
+  void wake_waiters() {
+    std::lock_guard<std::mutex> l(waiters_lock_);
+    wake_waiters_locked(read());
+  }
+
+  void wake_waiters_locked(uint64_t tail) {
+    auto end = waiters_.lower_bound(tail);
+    for (auto it = waiters_.begin(); it != end; it++) {
+      it->second->wake(tail);
+      num_waiters_--;
+    }
+    waiters_.erase(waiters_.begin(), end);
+  }
+
   std::mutex lock_;
   std::atomic<uint64_t> seq_;
   meta_t meta_;
@@ -236,78 +388,172 @@ class Sequence {
   uint64_t epoch_;
 
   stream_index_t streams_;
+
+  // waiters ordered by position
+  std::mutex waiters_lock_;
+  std::atomic<int> num_waiters_;
+  std::multimap<uint64_t, std::shared_ptr<Waiter>> waiters_;
 };
 
 class LogManager {
  public:
-  LogManager() {
-    thread_ = std::thread(&LogManager::Run, this);
+  LogManager() :
+    logs_initializing_(0),
+    logs_initialized_(0),
+    init_failures_(0)
+  {
+    for (int i = 0; i < init_threads; i++)
+      init_threads_.emplace_back(&LogManager::Run, this);
     if (report_sec > 0)
       bench_thread_ = std::thread(&LogManager::BenchMonitor, this);
   }
 
+  /*
+   * Called once a log that was queued for initialization is ready, or with
+   * NULL if its initialization failed. It runs on an initialization thread.
+   */
+  typedef std::function<void(Sequence*)> init_waiter_t;
+
   /*
    * Read and optionally increment the log sequence number.
+   *
+   * Logs are spread over a fixed set of shards by name, and only the shard
+   * lock is taken to find an initialized log. The meta of the request is
+   * compared to the meta of the log rather than being hashed.
    */
-  int ReadSequence(const meta_t& meta, const std::string& name,
-      uint64_t epoch, bool increment, std::vector<uint64_t>& positions,
-      int count, const std::vector<uint64_t>& stream_ids,
+  int ReadSequence(const zlog_proto::MSeqRequest& req,
+      std::vector<uint64_t>& positions,
+      const std::vector<uint64_t>& stream_ids,
       std::vector<std::vector<uint64_t>>& stream_backpointers,
       Sequence **cached_seq)
   {
-    std::unique_lock<std::mutex> g(lock_);
-
-    auto it = logs_.find(std::make_pair(meta, name));
-
-    if (it == logs_.end()) {
-      QueueLogInit(meta, name);
-      return -EAGAIN;
+    Sequence *seq = FindLog(req);
+    if (!seq) {
+      seq = QueueLogInit(get_meta(req), req.name(), nullptr);
+      if (!seq)
+        return -EAGAIN;
     }
 
-    if (epoch < it->second.epoch)
+    if (req.epoch() < seq->epoch())
       return -ERANGE;
 
+    const int count = req.count();
     if (stream_ids.size() == 0) {
-      if (increment)
-        it->second.seq->next(positions, count);
+      if (req.next())
+        seq->next(positions, count);
       else {
         assert(count == 1);
-        uint64_t seq = it->second.seq->read();
-        positions.push_back(seq);
+        positions.push_back(seq->read());
       }
     } else {
       int ret = 0;
-      uint64_t seq;
+      uint64_t pos;
       assert(count == 1);
-      if (increment)
-        ret = it->second.seq->stream_next(stream_ids, stream_backpointers, &seq);
+      if (req.next())
+        ret = seq->stream_next(stream_ids, stream_backpointers, &pos);
       else
-        ret = it->second.seq->stream_read(stream_ids, stream_backpointers, &seq);
+        ret = seq->stream_read(stream_ids, stream_backpointers, &pos);
       if (ret)
         return ret;
-      positions.push_back(seq);
+      positions.push_back(pos);
     }
 
-    *cached_seq = it->second.seq;
+    *cached_seq = seq;
 
     return 0;
   }
 
- private:
-  struct Log {
-    Log() {}
-    Log(uint64_t pos, uint64_t epoch,
-        meta_t meta, std::string name,
-        std::map<uint64_t, std::deque<uint64_t>>& ptrs) :
-      seq(new Sequence(pos, meta, name, epoch)), epoch(epoch)
+  /*
+   * Find the log named in a version 2 registration, which is otherwise
+   * handled like a request for a log that isn't initialized yet.
+   */
+  int RegisterLog(const zlog_proto::MSeqRegister& req, Sequence **pseq) {
+    Sequence *seq = FindLog(req);
+    if (!seq) {
+      seq = QueueLogInit(get_meta(req), req.name(), nullptr);
+      if (!seq)
+        return -EAGAIN;
+    }
+    *pseq = seq;
+    return 0;
+  }
+
+  /*
+   * Call the waiter once a log that a request missed has been initialized.
+   * The log is returned instead if it has been initialized in the meantime.
+   */
+  Sequence *WaitForLog(const meta_t& meta, const std::string& name,
+      init_waiter_t waiter) {
+    return QueueLogInit(meta, name, std::move(waiter));
+  }
+
+  struct InitStats {
+    uint64_t pending;
+    uint64_t initializing;
+    uint64_t held_requests;
+    uint64_t initialized;
+    uint64_t failures;
+  };
+
+  /*
+   * Logs waiting to be initialized or being initialized, and the requests
+   * that are held until they are.
+   */
+  void ReadInitStats(InitStats *stats) {
     {
-      seq->set_streams(ptrs);
+      std::lock_guard<std::mutex> g(lock_);
+      stats->pending = pending_logs_.size();
+      stats->held_requests = 0;
+      for (auto& waiters : init_waiters_)
+        stats->held_requests += waiters.second.size();
     }
+    stats->initializing = logs_initializing_;
+    stats->initialized = logs_initialized_;
+    stats->failures = init_failures_;
+  }
 
-    Sequence *seq;
-    uint64_t epoch;
+  /*
+   * The tail of each initialized log. Sequences are never freed, so the
+   * pointers identify logs across calls.
+   */
+  void ReadTails(std::vector<std::pair<Sequence*, uint64_t>>& tails) {
+    for (size_t i = 0; i < num_shards; i++) {
+      auto& shard = shards_[i];
+      std::lock_guard<std::mutex> g(shard.lock);
+      for (auto it = shard.logs.begin(); it != shard.logs.end(); it++)
+        tails.emplace_back(it->second, it->second->read());
+    }
+  }
+
+ private:
+  template <typename M>
+  Sequence *FindLog(const M& req) {
+    auto& shard = shard_of(req.name());
+    std::lock_guard<std::mutex> g(shard.lock);
+    auto range = shard.logs.equal_range(req.name());
+    for (auto it = range.first; it != range.second; it++) {
+      if (meta_equal(it->second->meta(), req))
+        return it->second;
+    }
+    return NULL;
+  }
+
+  /*
+   * Sequences are never removed from a shard once they are initialized, so
+   * pointers handed out to sessions remain valid.
+   */
+  struct Shard {
+    std::mutex lock;
+    std::unordered_multimap<std::string, Sequence*> logs;
   };
 
+  static const size_t num_shards = 64;
+
+  Shard& shard_of(const std::string& name) {
+    return shards_[std::hash<std::string>{}(name) % num_shards];
+  }
+
+  std::mutex backends_lock_;
   std::map<std::string, std::shared_ptr<zlog::Backend>> loaded_backends_;
 
   /*
@@ -335,13 +581,16 @@ class LogManager {
     // never actually unload a loaded backend. This is silly, but figuring out
     // the proper linking etc... is becoming a time suck. This will 'work' for
     // now.
-    bool extra_ref = loaded_backends_.find(scheme) == loaded_backends_.end();
-
     std::shared_ptr<zlog::Backend> backend;
     zlog::LogImpl *log;
     int ret = zlog::LogImpl::Open(scheme, name, meta, &log, &backend);
-    if (extra_ref && backend)
+    if (ret == -ENOENT && create_logs && backend)
+      ret = CreateLog(backend, name, &log);
+    if (backend) {
+      std::lock_guard<std::mutex> g(backends_lock_);
+      if (loaded_backends_.find(scheme) == loaded_backends_.end())
         loaded_backends_[scheme] = backend;
+    }
     if (ret) {
       std::cerr << "failed to open log " << ret << std::endl;
       return ret;
@@ -426,11 +675,115 @@ class LogManager {
   }
 
   /*
-   * Queue a log to be initialized.
+   * Create a log with the default options that is served by this sequencer.
+   * This lets a benchmark drive the sequencer with a backend that can't be
+   * shared between processes, such as the RAM backend (see --create-logs).
    */
-  void QueueLogInit(const meta_t& meta, const std::string& name) {
-    pending_logs_.insert(std::make_pair(meta, name));
-    cond_.notify_one();
+  static int CreateLog(std::shared_ptr<zlog::Backend> backend,
+      const std::string& name, zlog::LogImpl **logpp) {
+    zlog::Options options;
+    auto view = Striper::InitViewData(options.width,
+        options.entries_per_object, options.max_entry_size);
+    view.set_host("localhost");
+    view.set_port(std::to_string(server_port));
+
+    std::string data;
+    if (!view.SerializeToString(&data)) {
+      std::cerr << "failed to serialize view" << std::endl;
+      return -EIO;
+    }
+
+    int ret = backend->CreateLog(name, data);
+    if (ret && ret != -EEXIST) {
+      std::cerr << "failed to create log " << ret << std::endl;
+      return ret;
+    }
+
+    std::string hoid;
+    std::string prefix;
+    ret = backend->OpenLog(name, hoid, prefix);
+    if (ret)
+      return ret;
+
+    std::unique_ptr<zlog::LogImpl> log(
+        new zlog::LogImpl(backend, name, hoid, prefix, options));
+
+    ret = log->UpdateView();
+    if (ret)
+      return ret;
+
+    *logpp = log.release();
+
+    return 0;
+  }
+
+  /*
+   * Queue a log to be initialized, along with an optional waiter. If the log
+   * has been published since the caller missed in the index it is returned
+   * instead, and the waiter isn't queued.
+   */
+  Sequence *QueueLogInit(const meta_t& meta, const std::string& name,
+      init_waiter_t waiter) {
+    std::lock_guard<std::mutex> g(lock_);
+
+    {
+      auto& shard = shard_of(name);
+      std::lock_guard<std::mutex> sg(shard.lock);
+      auto range = shard.logs.equal_range(name);
+      for (auto it = range.first; it != range.second; it++) {
+        if (it->second->meta() == meta)
+          return it->second;
+      }
+    }
+
+    auto key = std::make_pair(meta, name);
+    pending_logs_.insert(key);
+    if (waiter)
+      init_waiters_[key].push_back(std::move(waiter));
+    cond_.notify_all();
+
+    return NULL;
+  }
+
+  /*
+   * Remove a log from the pending set and call its waiters. Waiters are
+   * queued under the same lock after checking the index, so a waiter is
+   * either called here or finds the published log itself.
+   */
+  void FinishLogInit(const std::pair<meta_t, std::string>& key,
+      Sequence *seq) {
+    std::vector<init_waiter_t> waiters;
+    {
+      std::unique_lock<std::mutex> g(lock_);
+      assert(pending_logs_.count(key) == 1);
+      initializing_.erase(key);
+      pending_logs_.erase(key);
+      auto it = init_waiters_.find(key);
+      if (it != init_waiters_.end()) {
+        waiters.swap(it->second);
+        init_waiters_.erase(it);
+      }
+    }
+
+    for (auto& waiter : waiters)
+      waiter(seq);
+  }
+
+  /*
+   * Sum of the sequence numbers of all initialized logs.
+   */
+  void ReadTotals(uint64_t *pseq, uint64_t *pnum_logs) {
+    uint64_t seq = 0;
+    uint64_t num_logs = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+      auto& shard = shards_[i];
+      std::lock_guard<std::mutex> g(shard.lock);
+      for (auto it = shard.logs.begin(); it != shard.logs.end(); it++)
+        seq += it->second->read();
+      num_logs += shard.logs.size();
+    }
+    *pseq = seq;
+    *pnum_logs = num_logs;
   }
 
   /*
@@ -456,18 +809,8 @@ class LogManager {
       uint64_t num_logs_start;
 
       // starting state of all the current sequences
-      {
-        std::unique_lock<std::mutex> g(lock_);
-
-        start_ns = get_time();
-        start_seq = 0;
-
-        for (auto it = logs_.begin(); it != logs_.end(); it++) {
-          start_seq += it->second.seq->read();
-        }
-
-        num_logs_start = logs_.size();
-      }
+      start_ns = get_time();
+      ReadTotals(&start_seq, &num_logs_start);
 
       assert(report_sec > 0);
       sleep(report_sec);
@@ -477,18 +820,8 @@ class LogManager {
       uint64_t num_logs;
 
       // ending state of all the current sequences
-      {
-        std::unique_lock<std::mutex> g(lock_);
-
-        end_seq = 0;
-        num_logs = logs_.size();
-
-        for (auto it = logs_.begin(); it != logs_.end(); it++) {
-          end_seq += it->second.seq->read();
-        }
-
-        end_ns = get_time();
-      }
+      ReadTotals(&end_seq, &num_logs);
+      end_ns = get_time();
 
       uint64_t elapsed_ns = end_ns - start_ns;
       uint64_t total_seqs = end_seq - start_seq;
@@ -507,6 +840,12 @@ class LogManager {
         }
       } else
         std::cout << "seqr rate = " << rate << " seqs/sec (warn: log count change)" << std::endl;
+
+      if (logs_initializing_ > 0) {
+        std::cout << "seqr init: " << logs_initializing_ << " initializing, "
+          << logs_initialized_ << " initialized, "
+          << init_failures_ << " failed" << std::endl;
+      }
     }
 
     if (fd != -1) {
@@ -515,63 +854,116 @@ class LogManager {
     }
   }
 
+  /*
+   * Log initialization workers. Each log is initialized by one worker, and
+   * several logs are initialized in parallel, so a log with an expensive
+   * initialization doesn't hold up the others. Logs that are initialized are
+   * served throughout.
+   */
   void Run() {
     for (;;) {
-      meta_t meta;
-      std::string name;
+      std::pair<meta_t, std::string> key;
 
       {
         std::unique_lock<std::mutex> g(lock_);
-        while (pending_logs_.empty())
-          cond_.wait(g);
-        auto it = pending_logs_.begin();
-        assert(it != pending_logs_.end());
-        meta = it->first;
-        name = it->second;
+        auto it = pending_logs_.end();
+        cond_.wait(g, [&] {
+          for (it = pending_logs_.begin(); it != pending_logs_.end(); it++) {
+            if (initializing_.count(*it) == 0)
+              return true;
+          }
+          return false;
+        });
+        key = *it;
+        initializing_.insert(key);
       }
 
+      const meta_t& meta = key.first;
+      const std::string& name = key.second;
+
+      logs_initializing_++;
+
       uint64_t position;
       // assignment to only for uniitialized use error. InitLog always sets
       // epoch when it returns zero, so epoch use below in the next block is
       // safe.
       uint64_t epoch = 0;
       std::map<uint64_t, std::deque<uint64_t>> ptrs;
+      const uint64_t start_ns = get_time();
       int ret = InitLog(meta, name, &epoch, &position, ptrs);
+      if (server_stats)
+        server_stats->measure(ServerStats::LOG_INIT,
+            (get_time() - start_ns) / 1000);
+
+      logs_initializing_--;
+
       if (ret) {
-        std::unique_lock<std::mutex> g(lock_);
-        pending_logs_.erase(std::make_pair(meta, name));
+        init_failures_++;
         std::cerr << "failed to init log" << std::endl;
+        FinishLogInit(key, NULL);
         continue;
       }
 
+      Sequence *seq = new Sequence(position, meta, name, epoch);
+      seq->set_streams(ptrs);
+
+      // publish the log before it is removed from the pending set so that a
+      // request that misses in the index can't queue it again
       {
-        std::unique_lock<std::mutex> g(lock_);
-        std::pair<meta_t, std::string> key = std::make_pair(meta, name);
-        assert(pending_logs_.count(key) == 1);
-        pending_logs_.erase(key);
-        assert(logs_.count(key) == 0);
-        Log log(position, epoch, meta, name, ptrs);
-        logs_[key] = log;
+        auto& shard = shard_of(name);
+        std::lock_guard<std::mutex> g(shard.lock);
+        shard.logs.insert(std::make_pair(name, seq));
       }
+
+      logs_initialized_++;
+
+      FinishLogInit(key, seq);
     }
   }
 
-  std::thread thread_;
+  std::vector<std::thread> init_threads_;
   std::thread bench_thread_;
+  Shard shards_[num_shards];
+
+  // protects the set of logs waiting to be initialized, and the subset of
+  // those assigned to a worker
   std::mutex lock_;
   std::condition_variable cond_;
-  std::unordered_map<std::pair<meta_t, std::string>, LogManager::Log > logs_;
   std::set<std::pair<meta_t, std::string> > pending_logs_;
+  std::set<std::pair<meta_t, std::string> > initializing_;
+  std::map<std::pair<meta_t, std::string>,
+    std::vector<init_waiter_t>> init_waiters_;
+
+  // initialization progress
+  std::atomic<uint64_t> logs_initializing_;
+  std::atomic<uint64_t> logs_initialized_;
+  std::atomic<uint64_t> init_failures_;
 };
 
 static LogManager *log_mgr;
 
-class Session {
+/*
+ * A session is owned by its outstanding operations and by the requests whose
+ * replies it is holding back, and is freed when the last of them completes.
+ * The handlers of a session run on its strand, including those that send a
+ * held reply, which are posted by other threads.
+ */
+class Session : public std::enable_shared_from_this<Session> {
  public:
   Session(boost::asio::io_service& io_service)
-    : socket_(io_service)
+    : io_service_(io_service), socket_(io_service), strand_(io_service)
   {
     cached_seq = NULL;
+    in_size_ = 0;
+    reading_ = false;
+    writing_ = false;
+    closed_ = false;
+    started_ = false;
+  }
+
+  ~Session() {
+    if (started_)
+      record_tick(ServerStats::SESSIONS_CLOSED);
   }
 
   boost::asio::ip::tcp::socket& socket() {
@@ -579,59 +971,156 @@ class Session {
   }
 
   void start() {
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(buffer_, sizeof(uint32_t)),
-        boost::bind(&Session::handle_hdr, this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+    started_ = true;
+    record_tick(ServerStats::SESSIONS_OPENED);
+    read();
   }
 
  private:
-  void handle_hdr(const boost::system::error_code& err, size_t size) {
+  /*
+   * Requests are read in chunks of whatever is available. Every complete
+   * message in the input is handled before replying, and the replies are
+   * collected and sent in a single write, so requests that a client pipelines
+   * on the connection are answered together.
+   */
+  void read() {
+    auto self(shared_from_this());
+    reading_ = true;
+    socket_.async_read_some(
+        boost::asio::buffer(in_ + in_size_, sizeof(in_) - in_size_),
+        strand_.wrap([this, self](const boost::system::error_code& err,
+            size_t size) {
+          handle_read(err, size);
+        }));
+  }
+
+  // closing the socket completes the outstanding operations
+  void close() {
+    closed_ = true;
+    boost::system::error_code err;
+    socket_.close(err);
+  }
+
+  void handle_read(const boost::system::error_code& err, size_t size) {
+    reading_ = false;
     if (err) {
-      delete this;
+      close();
       return;
     }
 
-    uint32_t tmp;
-    memcpy(&tmp, (void*)buffer_, sizeof(tmp));
-    uint32_t msg_size = ntohl(tmp);
+    in_size_ += size;
 
-    if (msg_size > sizeof(buffer_)) {
-      std::cerr << "message is too large" << std::endl;
-      delete this;
-      return;
+    size_t offset = 0;
+    while (in_size_ - offset >= sizeof(uint32_t)) {
+      uint32_t tmp;
+      memcpy(&tmp, in_ + offset, sizeof(tmp));
+      uint32_t msg_size = ntohl(tmp);
+
+      // version 2 messages are flagged in the length word
+      const bool frame = msg_size & zlog::seqr_frame::v2_flag;
+      msg_size &= ~zlog::seqr_frame::v2_flag;
+
+      if (msg_size > max_msg_size) {
+        std::cerr << "message is too large" << std::endl;
+        close();
+        return;
+      }
+
+      if (in_size_ - offset - sizeof(tmp) < msg_size)
+        break;
+
+      const char *msg = in_ + offset + sizeof(tmp);
+      const uint64_t start_ns = server_stats ? get_time() : 0;
+      bool ok = frame ? handle_frame(msg, msg_size) :
+        handle_msg(msg, msg_size);
+      if (!ok) {
+        close();
+        return;
+      }
+      if (server_stats) {
+        server_stats->measure(service_histogram(frame ? msg[0] : 0),
+            get_time() - start_ns);
+      }
+
+      offset += sizeof(tmp) + msg_size;
     }
 
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(buffer_, msg_size),
-        boost::bind(&Session::handle_msg, this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+    // keep the start of a partial message for the next read
+    in_size_ -= offset;
+    memmove(in_, in_ + offset, in_size_);
+
+    flush();
   }
 
-  void handle_msg(const boost::system::error_code& err, size_t size) {
-    if (err) {
-      delete this;
+  // frames that fail to decode aren't measured, so the type is known
+  static ServerStats::Histogram service_histogram(uint8_t type) {
+    namespace frame = zlog::seqr_frame;
+    switch (type) {
+      case frame::REGISTER:
+        return ServerStats::REGISTER;
+      case frame::CHECK_TAIL:
+        return ServerStats::CHECK_TAIL;
+      case frame::WAIT_TAIL:
+        return ServerStats::WAIT_TAIL;
+      case frame::MULTI_CHECK_TAIL:
+        return ServerStats::MULTI_CHECK_TAIL;
+      default:
+        return ServerStats::V1_REQUEST;
+    }
+  }
+
+  /*
+   * Write the replies that have been collected, and resume reading once they
+   * have all been written, so a client that doesn't read its replies can't
+   * make the session buffer them without bound. A reply that was held back
+   * may be written while a read is outstanding.
+   */
+  void flush() {
+    if (closed_ || writing_)
+      return;
+
+    if (out_.empty()) {
+      if (!reading_)
+        read();
       return;
     }
 
+    auto self(shared_from_this());
+    writing_ = true;
+    write_buf_.swap(out_);
+    boost::asio::async_write(socket_,
+        boost::asio::buffer(write_buf_),
+        strand_.wrap([this, self](const boost::system::error_code& err,
+            size_t size) {
+          handle_reply(err, size);
+        }));
+  }
+
+  /*
+   * Handle a version 1 message. A request for a log that isn't initialized
+   * yet is held until the sequencer has initialized the log, and is then
+   * handled again. Requests without an id are answered with INIT_LOG right
+   * away instead, because the client expects the replies in order.
+   */
+  bool handle_msg(const char *msg, size_t size, bool hold = true) {
     req_.Clear();
 
-    if (!req_.ParseFromArray(buffer_, size)) {
+    if (!req_.ParseFromArray(msg, size)) {
       std::cerr << "failed to parse message" << std::endl;
-      delete this;
-      return;
+      return false;
     }
 
     if (!req_.IsInitialized()) {
       std::cerr << "received incomplete message" << std::endl;
-      delete this;
-      return;
+      return false;
     }
 
     reply_.Clear();
 
+    // clients match replies to pipelined requests by id
+    if (req_.has_id())
+      reply_.set_id(req_.id());
+
     /*
      * Try to do a fast sequencer read. The basic idea is that for a
      * particular session a client will likely be referencing the same log
@@ -662,8 +1151,7 @@ class Session {
         req_.stream_ids().end());
 
     if (cached_seq) {
-      auto meta = get_meta(req_);
-      ret = cached_seq->match(meta, req_.name(), req_.epoch());
+      ret = cached_seq->match(req_);
       if (!ret) {
         /*
          * If this request doesn't contain any stream ids then we are only
@@ -722,26 +1210,32 @@ class Session {
       } else {
         if (req_.count() > 1)
           assert(req_.next());
-        auto meta = get_meta(req_);
-        ret = log_mgr->ReadSequence(meta, req_.name(),
-            req_.epoch(), req_.next(), positions, req_.count(),
+        ret = log_mgr->ReadSequence(req_, positions,
             stream_ids, stream_backpointers, &cached_seq);
       }
     } else {
       if (req_.count() > 1)
         assert(req_.next());
-      auto meta = get_meta(req_);
-      ret = log_mgr->ReadSequence(meta, req_.name(),
-          req_.epoch(), req_.next(), positions, req_.count(),
+      ret = log_mgr->ReadSequence(req_, positions,
           stream_ids, stream_backpointers, &cached_seq);
     }
 
-    if (ret == -EAGAIN)
+    if (ret == -EAGAIN && hold && req_.has_id()) {
+      if (hold_msg(msg, size))
+        return true;
+      // the log was initialized in the meantime
+      return handle_msg(msg, size);
+    }
+
+    if (ret == -EAGAIN) {
       reply_.set_status(zlog_proto::MSeqReply::INIT_LOG);
-    else if (ret == -ERANGE)
+      record_tick(ServerStats::INIT_LOG_REPLIES);
+    } else if (ret == -ERANGE) {
       reply_.set_status(zlog_proto::MSeqReply::STALE_EPOCH);
-    else
+      record_tick(ServerStats::STALE_EPOCH_REPLIES);
+    } else {
       assert(!ret);
+    }
 
     for (std::vector<uint64_t>::const_iterator it = positions.begin();
          it != positions.end(); it++) {
@@ -766,60 +1260,320 @@ class Session {
     assert(reply_.IsInitialized());
 
     uint32_t msg_size = reply_.ByteSize();
-    assert(msg_size < sizeof(buffer_));
-    if (!reply_.SerializeToArray(buffer_, msg_size)) {
+    uint32_t be_msg_size = htonl(msg_size);
+
+    const size_t offset = out_.size();
+    out_.resize(offset + sizeof(be_msg_size) + msg_size);
+    memcpy(&out_[offset], &be_msg_size, sizeof(be_msg_size));
+    if (!reply_.SerializeToArray(&out_[offset + sizeof(be_msg_size)],
+          msg_size)) {
       std::cerr << "failed to serialize message" << std::endl;
       exit(1);
     }
 
-    // scatter/gather buffers
-    std::vector<boost::asio::const_buffer> out;
-    be_msg_size_ = htonl(msg_size);
-    out.push_back(boost::asio::buffer(&be_msg_size_, sizeof(be_msg_size_)));
-    out.push_back(boost::asio::buffer(buffer_, msg_size));
+    return true;
+  }
 
-    boost::asio::async_write(socket_, out,
-        boost::bind(&Session::handle_reply, this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+  /*
+   * Hold a version 1 request until the log it names is initialized. The
+   * request is copied, and handled again on the strand. Returns false if the
+   * log has already been initialized.
+   */
+  bool hold_msg(const char *msg, size_t size) {
+    auto self(shared_from_this());
+    auto copy = std::make_shared<std::string>(msg, size);
+    Sequence *seq = log_mgr->WaitForLog(get_meta(req_), req_.name(),
+        [this, self, copy](Sequence *seq) {
+      strand_.post([this, self, copy, seq] {
+        if (closed_)
+          return;
+        if (!handle_msg(copy->data(), copy->size(), seq != NULL)) {
+          close();
+          return;
+        }
+        flush();
+      });
+    });
+    if (seq)
+      return false;
+    record_tick(ServerStats::HELD_REQUESTS);
+    return true;
+  }
+
+  /*
+   * Handle a version 2 message. A log is registered once per session and is
+   * then referred to by its handle, an index into the session's table of
+   * registered logs. The table holds the same sequence objects that are
+   * cached by version 1 requests, and they are never freed.
+   */
+  bool handle_frame(const char *msg, size_t size) {
+    namespace frame = zlog::seqr_frame;
+
+    uint8_t type;
+    frame::Reply reply;
+    if (!frame::DecodeHeader(msg, size, &type, &reply.id)) {
+      std::cerr << "received incomplete frame" << std::endl;
+      return false;
+    }
+
+    reply.status = zlog_proto::MSeqReply::OK;
+    reply.value = 0;
+
+    if (type == frame::REGISTER) {
+      reply.type = frame::REGISTER;
+
+      zlog_proto::MSeqRegister req;
+      const size_t hdr_size = frame::header_size - 4;
+      if (!req.ParseFromArray(msg + hdr_size, size - hdr_size) ||
+          !req.IsInitialized()) {
+        std::cerr << "failed to parse register message" << std::endl;
+        return false;
+      }
+
+      Sequence *seq;
+      int ret = log_mgr->RegisterLog(req, &seq);
+      if (ret == -EAGAIN) {
+        // the reply is sent when the log is ready
+        auto self(shared_from_this());
+        const uint64_t id = reply.id;
+        seq = log_mgr->WaitForLog(get_meta(req), req.name(),
+            [this, self, id](Sequence *seq) {
+          strand_.post([this, self, id, seq] {
+            frame::Reply reply;
+            reply.type = frame::REGISTER;
+            reply.id = id;
+            register_reply(seq, &reply);
+            add_reply(reply);
+            flush();
+          });
+        });
+        if (!seq) {
+          record_tick(ServerStats::HELD_REQUESTS);
+          return true;
+        }
+      } else {
+        assert(!ret);
+      }
+      register_reply(seq, &reply);
+    } else if (type == frame::CHECK_TAIL) {
+      reply.type = frame::CHECK_TAIL;
+
+      frame::CheckTail req;
+      if (!frame::DecodeCheckTail(msg, size, &req) ||
+          req.handle >= handles_.size() ||
+          req.count == 0 || req.count >= 100 ||
+          (!req.next && req.count != 1)) {
+        std::cerr << "invalid check tail frame" << std::endl;
+        return false;
+      }
+
+      Sequence *seq = handles_[req.handle];
+      if (req.epoch < seq->epoch()) {
+        reply.status = zlog_proto::MSeqReply::STALE_EPOCH;
+        record_tick(ServerStats::STALE_EPOCH_REPLIES);
+      } else if (req.next)
+        reply.value = seq->next(req.count);
+      else
+        reply.value = seq->read();
+    } else if (type == frame::MULTI_CHECK_TAIL) {
+      return handle_multi_check_tail(msg, size, reply.id);
+    } else if (type == frame::WAIT_TAIL) {
+      reply.type = frame::WAIT_TAIL;
+
+      frame::WaitTail req;
+      if (!frame::DecodeWaitTail(msg, size, &req) ||
+          req.handle >= handles_.size()) {
+        std::cerr << "invalid wait tail frame" << std::endl;
+        return false;
+      }
+
+      Sequence *seq = handles_[req.handle];
+      if (req.epoch < seq->epoch()) {
+        reply.status = zlog_proto::MSeqReply::STALE_EPOCH;
+        record_tick(ServerStats::STALE_EPOCH_REPLIES);
+      } else {
+        reply.value = seq->read();
+        if (reply.value <= req.after && req.timeout_ms > 0) {
+          wait_for_tail(seq, reply.id, req.after,
+              std::min(req.timeout_ms, max_wait_ms));
+          return true;
+        }
+      }
+    } else {
+      std::cerr << "unknown frame type " << (int)type << std::endl;
+      return false;
+    }
+
+    add_reply(reply);
+
+    return true;
+  }
+
+  /*
+   * The entries refer to logs by handle, so they are resolved without a
+   * lookup in the index, and the results are encoded in place in a single
+   * reply.
+   */
+  bool handle_multi_check_tail(const char *msg, size_t size, uint64_t id) {
+    namespace frame = zlog::seqr_frame;
+
+    uint32_t num;
+    if (!frame::DecodeMultiCheckTail(msg, size, &num)) {
+      std::cerr << "invalid multi check tail frame" << std::endl;
+      return false;
+    }
+
+    const size_t offset = out_.size();
+    out_.resize(offset + frame::multi_reply_size(num));
+    char *out = &out_[offset];
+    frame::EncodeReply(out, frame::Reply{frame::MULTI_CHECK_TAIL, id,
+        zlog_proto::MSeqReply::OK, num});
+
+    for (uint32_t i = 0; i < num; i++) {
+      frame::CheckTail req;
+      frame::DecodeMultiEntry(msg, i, &req);
+      if (req.handle >= handles_.size() ||
+          req.count == 0 || req.count >= 100 ||
+          (!req.next && req.count != 1)) {
+        std::cerr << "invalid multi check tail entry" << std::endl;
+        return false;
+      }
+
+      Sequence *seq = handles_[req.handle];
+      if (req.epoch < seq->epoch()) {
+        frame::EncodeMultiReplyEntry(out, i,
+            zlog_proto::MSeqReply::STALE_EPOCH, 0);
+        record_tick(ServerStats::STALE_EPOCH_REPLIES);
+      } else {
+        const uint64_t value = req.next ? seq->next(req.count) : seq->read();
+        frame::EncodeMultiReplyEntry(out, i, zlog_proto::MSeqReply::OK, value);
+      }
+    }
+
+    return true;
+  }
+
+  void register_reply(Sequence *seq, zlog::seqr_frame::Reply *reply) {
+    if (!seq) {
+      reply->status = zlog_proto::MSeqReply::INIT_LOG;
+      reply->value = 0;
+      record_tick(ServerStats::INIT_LOG_REPLIES);
+      return;
+    }
+    reply->status = zlog_proto::MSeqReply::OK;
+    auto it = std::find(handles_.begin(), handles_.end(), seq);
+    reply->value = it - handles_.begin();
+    if (it == handles_.end())
+      handles_.push_back(seq);
+  }
+
+  void add_reply(const zlog::seqr_frame::Reply& reply) {
+    const size_t offset = out_.size();
+    out_.resize(offset + zlog::seqr_frame::reply_size);
+    zlog::seqr_frame::EncodeReply(&out_[offset], reply);
+  }
+
+  /*
+   * Hold a WAIT_TAIL reply until the tail moves past after or the timer
+   * expires. The reply is sent by whichever removes the waiter from the
+   * sequence first.
+   */
+  void wait_for_tail(Sequence *seq, uint64_t id, uint64_t after,
+      uint32_t timeout_ms) {
+    namespace frame = zlog::seqr_frame;
+
+    auto self(shared_from_this());
+    auto timer = std::make_shared<boost::asio::steady_timer>(io_service_);
+    auto waiter = std::make_shared<Sequence::Waiter>();
+
+    waiter->after = after;
+    waiter->wake = [this, self, id, timer](uint64_t tail) {
+      strand_.post([this, self, id, timer, tail] {
+        timer->cancel();
+        add_reply(frame::Reply{frame::WAIT_TAIL, id,
+            zlog_proto::MSeqReply::OK, tail});
+        flush();
+      });
+    };
+
+    timer->expires_from_now(std::chrono::milliseconds(timeout_ms));
+    timer->async_wait(strand_.wrap([this, self, seq, id, waiter](
+            const boost::system::error_code& err) {
+      if (err || !seq->cancel_wait(waiter))
+        return;
+      add_reply(frame::Reply{frame::WAIT_TAIL, id,
+          zlog_proto::MSeqReply::OK, seq->read()});
+      flush();
+    }));
+
+    seq->wait(waiter);
   }
 
   void handle_reply(const boost::system::error_code& err, size_t size) {
+    writing_ = false;
     if (err) {
-      delete this;
+      close();
       return;
     }
 
-    start();
+    write_buf_.clear();
+    flush();
   }
 
+  boost::asio::io_service& io_service_;
   boost::asio::ip::tcp::socket socket_;
+  boost::asio::io_service::strand strand_;
+
+  static const size_t max_msg_size = 1024;
 
-  char buffer_[1024];
-  uint32_t be_msg_size_;
+  // longest that a WAIT_TAIL reply is held
+  static const uint32_t max_wait_ms = 60000;
+
+  char in_[16384];
+  size_t in_size_;
+  std::vector<char> out_;
+  std::vector<char> write_buf_;
+  bool reading_;
+  bool writing_;
+  bool closed_;
+  bool started_;
 
   zlog_proto::MSeqRequest req_;
   zlog_proto::MSeqReply reply_;
 
   Sequence *cached_seq;
+
+  std::vector<Sequence*> handles_;
 };
 
+/*
+ * In the shared engine every thread runs a single event loop that accepts on
+ * one listener, and a session may be handled by any of the threads. In the
+ * reactor engine each thread runs its own event loop and listener, bound to
+ * the same port with SO_REUSEPORT so that the kernel spreads connections over
+ * the listeners, and a session stays on the loop that accepted it.
+ */
 class Server {
  public:
-  Server(short port, std::size_t nthreads)
-    : acceptor_(io_service_,
-        boost::asio::ip::tcp::endpoint(
-          boost::asio::ip::tcp::v4(), port)),
-      nthreads_(nthreads)
+  Server(short port, std::size_t nthreads, bool reactor, bool cpu_affinity) :
+    nthreads_(nthreads), cpu_affinity_(cpu_affinity)
   {
-    acceptor_.set_option(boost::asio::ip::tcp::no_delay(true));
-    start_accept();
+    const size_t nloops = reactor ? nthreads : 1;
+    for (size_t i = 0; i < nloops; i++) {
+      loops_.emplace_back(new Loop);
+      listen(*loops_.back(), port, reactor);
+    }
   }
 
   void run() {
     std::vector<std::thread> threads;
     for (std::size_t i = 0; i < nthreads_; i++) {
-      std::thread thread([&]{ io_service_.run(); });
+      auto& loop = *loops_[i % loops_.size()];
+      std::thread thread([this, i, &loop] {
+        if (cpu_affinity_)
+          pin_thread(i);
+        loop.io_service.run();
+      });
       threads.push_back(std::move(thread));
     }
 
@@ -828,25 +1582,206 @@ class Server {
   }
 
  private:
-  void start_accept() {
-    Session* new_session = new Session(io_service_);
-    acceptor_.async_accept(new_session->socket(),
-        boost::bind(&Server::handle_accept, this, new_session,
+  struct Loop {
+    Loop() : acceptor(io_service) {}
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::acceptor acceptor;
+  };
+
+  void listen(Loop& loop, short port, bool reuse_port) {
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::tcp::v4(), port);
+    auto& acceptor = loop.acceptor;
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+      typedef boost::asio::detail::socket_option::boolean<
+        SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+      acceptor.set_option(reuse_port_option(true));
+#else
+      std::cerr << "reactor engine requires SO_REUSEPORT" << std::endl;
+      exit(EXIT_FAILURE);
+#endif
+    }
+    acceptor.set_option(boost::asio::ip::tcp::no_delay(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    start_accept(loop);
+  }
+
+  void pin_thread(size_t index) {
+    unsigned ncpus = std::thread::hardware_concurrency();
+    int cpu = ncpus ? index % ncpus : index;
+    int ret = zlog::port::SetThreadAffinity(cpu);
+    if (ret)
+      std::cerr << "failed to set cpu affinity " << ret << std::endl;
+  }
+
+  void start_accept(Loop& loop) {
+    auto new_session = std::make_shared<Session>(loop.io_service);
+    loop.acceptor.async_accept(new_session->socket(),
+        boost::bind(&Server::handle_accept, this, &loop, new_session,
           boost::asio::placeholders::error));
   }
 
-  void handle_accept(Session* new_session,
+  void handle_accept(Loop *loop, std::shared_ptr<Session> new_session,
       const boost::system::error_code& error) {
     if (!error)
       new_session->start();
-    else
-      delete new_session;
-    start_accept();
+    start_accept(*loop);
   }
 
-  boost::asio::io_service io_service_;
-  boost::asio::ip::tcp::acceptor acceptor_;
+  std::vector<std::unique_ptr<Loop>> loops_;
   std::size_t nthreads_;
+  const bool cpu_affinity_;
+};
+
+/*
+ * Serves the server statistics at /metrics in the Prometheus text format.
+ * The rate of each log is computed from the change in its tail since the
+ * previous request, so it is only reported once a log has been seen by an
+ * earlier request.
+ */
+class MetricsHandler : public CivetHandler {
+ public:
+  MetricsHandler() : last_ns_(0) {}
+
+  bool handleGet(CivetServer *server, struct mg_connection *conn) {
+    std::stringstream out;
+
+    const uint64_t opened = server_stats->ticker(ServerStats::SESSIONS_OPENED);
+    const uint64_t closed = server_stats->ticker(ServerStats::SESSIONS_CLOSED);
+    put(out, "zlog_seqr_sessions", "gauge", opened - closed);
+    put(out, "zlog_seqr_sessions_opened_total", "counter", opened);
+    put(out, "zlog_seqr_stale_epoch_replies_total", "counter",
+        server_stats->ticker(ServerStats::STALE_EPOCH_REPLIES));
+    put(out, "zlog_seqr_init_log_replies_total", "counter",
+        server_stats->ticker(ServerStats::INIT_LOG_REPLIES));
+    put(out, "zlog_seqr_held_requests_total", "counter",
+        server_stats->ticker(ServerStats::HELD_REQUESTS));
+
+    LogManager::InitStats init;
+    log_mgr->ReadInitStats(&init);
+    put(out, "zlog_seqr_held_requests", "gauge", init.held_requests);
+    put(out, "zlog_seqr_logs_pending_init", "gauge", init.pending);
+    put(out, "zlog_seqr_logs_initializing", "gauge", init.initializing);
+    put(out, "zlog_seqr_log_inits_total", "counter", init.initialized);
+    put(out, "zlog_seqr_log_init_failures_total", "counter", init.failures);
+
+    out << "# TYPE zlog_seqr_request_ns summary\n";
+    put_summary(out, "zlog_seqr_request_ns", "type=\"v1\"",
+        ServerStats::V1_REQUEST);
+    put_summary(out, "zlog_seqr_request_ns", "type=\"register\"",
+        ServerStats::REGISTER);
+    put_summary(out, "zlog_seqr_request_ns", "type=\"check_tail\"",
+        ServerStats::CHECK_TAIL);
+    put_summary(out, "zlog_seqr_request_ns", "type=\"wait_tail\"",
+        ServerStats::WAIT_TAIL);
+    put_summary(out, "zlog_seqr_request_ns", "type=\"multi_check_tail\"",
+        ServerStats::MULTI_CHECK_TAIL);
+
+    out << "# TYPE zlog_seqr_log_init_us summary\n";
+    put_summary(out, "zlog_seqr_log_init_us", "", ServerStats::LOG_INIT);
+
+    put_logs(out);
+
+    const std::string body = out.str();
+
+    mg_printf(conn,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n");
+
+    mg_printf(conn, "Content-Length: %lu\r\n\r\n",
+        static_cast<unsigned long>(body.size()));
+
+    mg_write(conn, body.data(), body.size());
+
+    return true;
+  }
+
+ private:
+  static void put(std::stringstream& out, const char *name,
+      const char *type, uint64_t value) {
+    out << "# TYPE " << name << " " << type << "\n"
+      << name << " " << value << "\n";
+  }
+
+  static void put_summary(std::stringstream& out, const char *name,
+      const std::string& labels, ServerStats::Histogram type) {
+    zlog::HistogramImpl hist;
+    server_stats->histogram(type, &hist);
+    const std::string sep = labels.empty() ? "" : ",";
+    for (double q : {50.0, 95.0, 99.0, 99.9}) {
+      out << name << "{" << labels << sep << "quantile=\"" << q / 100
+        << "\"} " << (hist.num() ? hist.Percentile(q) : 0) << "\n";
+    }
+    const std::string brace = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << brace << " "
+      << (uint64_t)(hist.Average() * hist.num()) << "\n";
+    out << name << "_count" << brace << " " << hist.num() << "\n";
+  }
+
+  // label values escape backslash, quote and newline
+  static std::string escape(const std::string& value) {
+    std::string res;
+    for (char c : value) {
+      if (c == '\\' || c == '"')
+        res.push_back('\\');
+      if (c == '\n')
+        res.append("\\n");
+      else
+        res.push_back(c);
+    }
+    return res;
+  }
+
+  // the tails and the time are read under the lock, so that concurrent
+  // scrapes compute rates from samples taken in the order they are stored
+  void put_logs(std::stringstream& out) {
+    std::lock_guard<std::mutex> l(lock_);
+
+    std::vector<std::pair<Sequence*, uint64_t>> tails;
+    log_mgr->ReadTails(tails);
+    const uint64_t now_ns = get_time();
+
+    std::vector<std::string> labels;
+    for (auto& tail : tails) {
+      const auto& meta = tail.first->meta();
+      auto scheme = meta.find("scheme");
+      labels.push_back("log=\"" + escape(tail.first->name()) +
+          "\",scheme=\"" + (scheme == meta.end() ? "" :
+            escape(scheme->second)) + "\"");
+    }
+
+    out << "# TYPE zlog_seqr_log_tail gauge\n";
+    for (size_t i = 0; i < tails.size(); i++)
+      out << "zlog_seqr_log_tail{" << labels[i] << "} "
+        << tails[i].second << "\n";
+
+    out << "# TYPE zlog_seqr_log_positions_per_sec gauge\n";
+    const uint64_t elapsed_ns = now_ns - last_ns_;
+    for (size_t i = 0; i < tails.size(); i++) {
+      auto last = last_tails_.find(tails[i].first);
+      if (last == last_tails_.end() || now_ns <= last_ns_ ||
+          tails[i].second < last->second)
+        continue;
+      const double rate = (double)(tails[i].second - last->second) *
+        1000000000.0 / (double)elapsed_ns;
+      out << "zlog_seqr_log_positions_per_sec{" << labels[i] << "} "
+        << rate << "\n";
+    }
+
+    last_ns_ = now_ns;
+    last_tails_.clear();
+    for (auto& tail : tails)
+      last_tails_.insert(tail);
+  }
+
+  // handlers run on the civetweb worker threads
+  std::mutex lock_;
+  uint64_t last_ns_;
+  std::map<Sequence*, uint64_t> last_tails_;
 };
 
 int main(int argc, char* argv[])
@@ -854,24 +1789,46 @@ int main(int argc, char* argv[])
   int port;
   std::string host;
   int nthreads;
+  std::string engine;
+  bool cpu_affinity;
+  std::string http;
 
   po::options_description desc("Allowed options");
   desc.add_options()
     ("port", po::value<int>(&port)->required(), "Server port")
     ("nthreads", po::value<int>(&nthreads)->default_value(1), "Num threads")
+    ("engine", po::value<std::string>(&engine)->default_value("shared"), "Threading engine (shared, reactor)")
+    ("cpu-affinity", po::bool_switch(&cpu_affinity)->default_value(false), "Pin threads to cpus")
     ("report-sec", po::value<int>(&report_sec)->default_value(0), "Time between rate reports")
     ("daemon,d", "Run in background")
     ("streams", po::bool_switch(&stream_support)->default_value(false), "support streams")
     ("iops-logfile", po::value<std::string>(&iops_logfile)->default_value(""), "iops log file")
+    ("init-threads", po::value<int>(&init_threads)->default_value(4), "Logs initialized in parallel")
+    ("create-logs", po::bool_switch(&create_logs)->default_value(false), "Create logs that don't exist (benchmarking)")
+    ("http", po::value<std::string>(&http)->default_value(""), "Serve metrics on this port at /metrics")
   ;
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
   po::notify(vm);
 
+  server_port = port;
+
   if (nthreads <= 0 || nthreads > 64)
     nthreads = 1;
 
+  if (init_threads <= 0)
+    init_threads = 1;
+
+  if (engine != "shared" && engine != "reactor") {
+    std::cerr << "unknown engine " << engine << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  const bool reactor = engine == "reactor";
+
+  if (!http.empty())
+    server_stats = new ServerStats;
+
   Server *s;
 
   if (vm.count("daemon")) {
@@ -884,7 +1841,7 @@ int main(int argc, char* argv[])
       exit(EXIT_SUCCESS);
     }
 
-    s = new Server(port, nthreads);
+    s = new Server(port, nthreads, reactor, cpu_affinity);
 
     pid_t sid = setsid();
     if (sid < 0) {
@@ -897,11 +1854,24 @@ int main(int argc, char* argv[])
     close(1);
     close(2);
   } else {
-    s = new Server(port, nthreads);
+    s = new Server(port, nthreads, reactor, cpu_affinity);
   }
 
   log_mgr = new LogManager();
 
+  // started after the fork, which doesn't copy the civetweb threads
+  std::unique_ptr<CivetServer> http_server;
+  MetricsHandler metrics_handler;
+  if (!http.empty()) {
+    try {
+      http_server.reset(new CivetServer({"listening_ports", http}));
+    } catch (const std::exception& e) {
+      std::cerr << "failed to start metrics server: " << e.what() << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    http_server->addHandler("/metrics", &metrics_handler);
+  }
+
   s->run();
 
   return 0;
@@ -208,13 +208,13 @@ int CephBackend::OpenLog(const std::string& name,
 }
 
 int CephBackend::ReadViews(const std::string& hoid,
-    uint64_t epoch, std::map<uint64_t, std::string>& out)
+    uint64_t epoch, uint32_t max_views, std::map<uint64_t, std::string>& out)
 {
   std::map<uint64_t, std::string> tmp;
 
   // read views starting with specified epoch
   librados::ObjectReadOperation op;
-  zlog::cls_zlog_read_view(op, epoch);
+  zlog::cls_zlog_read_view(op, epoch, max_views);
   ::ceph::bufferlist bl;
   int ret = ioctx_->operate(hoid, &op, &bl);
   if (ret)
@@ -246,9 +246,94 @@ int CephBackend::ProposeView(const std::string& hoid,
   librados::ObjectWriteOperation op;
   zlog::cls_zlog_create_view(op, epoch, bl);
   int ret = ioctx_->operate(hoid, &op);
+  if (ret)
+    return ret;
+
+  // the watchers are notified without waiting for their acknowledgements
+  ::ceph::bufferlist notify_bl;
+  auto c = librados::Rados::aio_create_completion();
+  ioctx_->aio_notify(hoid, c, notify_bl, 10000, nullptr);
+  c->release();
+
+  return 0;
+}
+
+int CephBackend::WatchViews(const std::string& hoid,
+    std::function<void()> callback, uint64_t *cookie)
+{
+  std::unique_ptr<ViewsWatch> watch(new ViewsWatch(ioctx_, hoid,
+        std::move(callback)));
+
+  uint64_t handle;
+  int ret = ioctx_->watch2(hoid, &handle, watch.get());
+  if (ret)
+    return ret;
+
+  std::lock_guard<std::mutex> lk(watch_lock_);
+  watches_.emplace(handle, std::move(watch));
+  *cookie = handle;
+
+  return 0;
+}
+
+// notifications that are already queued are delivered before the watch
+// context is freed
+int CephBackend::UnwatchViews(uint64_t cookie)
+{
+  std::unique_ptr<ViewsWatch> watch;
+  {
+    std::lock_guard<std::mutex> lk(watch_lock_);
+    auto it = watches_.find(cookie);
+    if (it == watches_.end())
+      return -ENOENT;
+    watch = std::move(it->second);
+    watches_.erase(it);
+  }
+
+  int ret = ioctx_->unwatch2(cookie);
+  librados::Rados(*ioctx_).watch_flush();
+
   return ret;
 }
 
+void CephBackend::ViewsWatch::handle_notify(uint64_t notify_id,
+    uint64_t cookie, uint64_t notifier_id, ::ceph::bufferlist& bl)
+{
+  ::ceph::bufferlist reply;
+  ioctx_->notify_ack(hoid_, notify_id, cookie, reply);
+  callback_();
+}
+
+// notifications may have been missed before the watch failed, and later
+// changes are found when an operation fails with a stale epoch
+void CephBackend::ViewsWatch::handle_error(uint64_t cookie, int err)
+{
+  callback_();
+}
+
+// the checkpoint is kept in its own object so that rewriting it doesn't touch
+// the head object that holds the views.
+int CephBackend::WriteViewCheckpoint(const std::string& hoid,
+    const std::string& data)
+{
+  ::ceph::bufferlist bl;
+  bl.append(data.c_str(), data.size());
+  return ioctx_->write_full(hoid + ".view_checkpoint", bl);
+}
+
+int CephBackend::ReadViewCheckpoint(const std::string& hoid,
+    std::string *data)
+{
+  ::ceph::bufferlist bl;
+  int ret = ioctx_->read(hoid + ".view_checkpoint", bl, 0, 0);
+  if (ret < 0)
+    return ret;
+
+  data->assign(bl.c_str(), bl.length());
+
+  return 0;
+}
+
 int CephBackend::Read(const std::string& oid, uint64_t epoch,
     uint64_t position, uint32_t stride, uint32_t max_size, std::string *data)
 {
@@ -265,6 +350,55 @@ int CephBackend::Read(const std::string& oid, uint64_t epoch,
   return 0;
 }
 
+void CephBackend::PrepareRangeRead(librados::ObjectReadOperation& op,
+    RangeReadContext *c, uint64_t epoch, uint64_t position, uint32_t count,
+    uint32_t stride, uint32_t max_size)
+{
+  c->bls.resize(count);
+  c->rvs.assign(count, 0);
+  for (uint32_t i = 0; i < count; i++) {
+    zlog::cls_zlog_read(op, epoch, position + (uint64_t)i * stride, stride,
+        max_size, &c->bls[i], &c->rvs[i]);
+    op.set_op_flags2(librados::OP_FAILOK);
+  }
+}
+
+int CephBackend::FinishRangeRead(RangeReadContext *c, int ret)
+{
+  if (ret)
+    return ret;
+
+  for (auto rv : c->rvs) {
+    if (rv == -ESPIPE)
+      return rv;
+  }
+
+  c->results->swap(c->rvs);
+  c->data->resize(c->bls.size());
+  for (size_t i = 0; i < c->bls.size(); i++) {
+    if ((*c->results)[i] == 0)
+      (*c->data)[i].assign(c->bls[i].c_str(), c->bls[i].length());
+  }
+
+  return 0;
+}
+
+int CephBackend::ReadRange(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+    std::vector<int> *results, std::vector<std::string> *data)
+{
+  RangeReadContext c;
+  c.results = results;
+  c.data = data;
+
+  librados::ObjectReadOperation op;
+  PrepareRangeRead(op, &c, epoch, position, count, stride, max_size);
+
+  int ret = ioctx_->operate(oid, &op, NULL);
+
+  return FinishRangeRead(&c, ret);
+}
+
 int CephBackend::Write(const std::string& oid, const Slice& data,
           uint64_t epoch, uint64_t position, uint32_t stride, uint32_t max_size)
 {
@@ -338,6 +472,26 @@ int CephBackend::AioRead(const std::string& oid, uint64_t epoch,
   return ioctx_->aio_operate(oid, c->c, &op, &c->bl);
 }
 
+int CephBackend::AioReadRange(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+    std::vector<int> *results, std::vector<std::string> *data, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  RangeReadContext *c = new RangeReadContext;
+  c->arg = arg;
+  c->cb = callback;
+  c->results = results;
+  c->data = data;
+  c->c = librados::Rados::aio_create_completion(c,
+      NULL, CephBackend::aio_safe_cb_read_range);
+  assert(c->c);
+
+  librados::ObjectReadOperation op;
+  PrepareRangeRead(op, c, epoch, position, count, stride, max_size);
+
+  return ioctx_->aio_operate(oid, c->c, &op, NULL);
+}
+
 int CephBackend::AioWrite(const std::string& oid, uint64_t epoch,
     uint64_t position, uint32_t stride, uint32_t max_size,
     const Slice& data, void *arg,
@@ -360,6 +514,41 @@ int CephBackend::AioWrite(const std::string& oid, uint64_t epoch,
   return ioctx_->aio_operate(oid, c->c, &op);
 }
 
+int CephBackend::AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  AioContext *c = new AioContext;
+  c->arg = arg;
+  c->cb = callback;
+  c->data = NULL;
+  c->c = librados::Rados::aio_create_completion(c,
+      NULL, CephBackend::aio_safe_cb_append);
+  assert(c->c);
+
+  librados::ObjectWriteOperation op;
+  zlog::cls_zlog_seal(op, epoch);
+
+  return ioctx_->aio_operate(oid, c->c, &op);
+}
+
+int CephBackend::AioMaxPos(const std::string& oid, uint64_t epoch,
+    uint64_t *pos, bool *empty, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  AioContext *c = new AioContext;
+  c->arg = arg;
+  c->cb = callback;
+  c->data = NULL;
+  c->c = librados::Rados::aio_create_completion(c,
+      NULL, CephBackend::aio_safe_cb_max_pos);
+  assert(c->c);
+
+  librados::ObjectReadOperation op;
+  zlog::cls_zlog_max_position(op, epoch, pos, empty, &c->rv);
+
+  return ioctx_->aio_operate(oid, c->c, &op, NULL);
+}
+
 std::string CephBackend::LinkObjectName(const std::string& name)
 {
   std::stringstream ss;
@@ -416,6 +605,30 @@ void CephBackend::aio_safe_cb_read(librados::completion_t cb, void *arg)
   delete c;
 }
 
+void CephBackend::aio_safe_cb_max_pos(librados::completion_t cb, void *arg)
+{
+  AioContext *c = (AioContext*)arg;
+  librados::AioCompletion *rc = c->c;
+  int ret = rc->get_return_value();
+  rc->release();
+  if (ret == 0 && c->rv < 0)
+    ret = c->rv;
+  c->cb(c->arg, ret);
+  delete c;
+}
+
+void CephBackend::aio_safe_cb_read_range(librados::completion_t cb,
+    void *arg)
+{
+  RangeReadContext *c = (RangeReadContext*)arg;
+  librados::AioCompletion *rc = c->c;
+  int ret = rc->get_return_value();
+  rc->release();
+  ret = FinishRangeRead(c, ret);
+  c->cb(c->arg, ret);
+  delete c;
+}
+
 extern "C" Backend *__backend_allocate(void)
 {
   auto b = new CephBackend();
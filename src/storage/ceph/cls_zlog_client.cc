@@ -19,6 +19,20 @@ void cls_zlog_read(librados::ObjectReadOperation& op, uint64_t epoch,
   op.exec("zlog", "entry_read", bl);
 }
 
+void cls_zlog_read(librados::ObjectReadOperation& op, uint64_t epoch,
+    uint64_t position, uint32_t stride, uint32_t max_size,
+    ceph::bufferlist *data, int *pret)
+{
+  ceph::bufferlist bl;
+  zlog_ceph_proto::ReadEntry call;
+  call.set_epoch(epoch);
+  call.set_pos(position);
+  call.set_stride(stride);
+  call.set_max_size(max_size);
+  encode(bl, call);
+  op.exec("zlog", "entry_read", bl, data, pret);
+}
+
 void cls_zlog_write(librados::ObjectWriteOperation& op, uint64_t epoch,
     uint64_t position, uint32_t stride, uint32_t max_size,
     ceph::bufferlist& data)
@@ -9,6 +9,12 @@ namespace zlog {
   void cls_zlog_read(librados::ObjectReadOperation& op, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size);
 
+  // a read that sets its own result, so that many reads can be made in one
+  // operation
+  void cls_zlog_read(librados::ObjectReadOperation& op, uint64_t epoch,
+      uint64_t position, uint32_t stride, uint32_t max_size,
+      ceph::bufferlist *data, int *pret);
+
   void cls_zlog_write(librados::ObjectWriteOperation& op, uint64_t epoch,
       uint64_t position, uint32_t stride, uint32_t max_size,
       ceph::bufferlist& data);
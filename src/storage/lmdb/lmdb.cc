@@ -1,4 +1,11 @@
 #include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
 #include <lmdb.h>
 #include "zlog/backend.h"
 #include "zlog/backend/lmdb.h"
@@ -60,7 +67,7 @@ int LMDBBackend::CreateLog(const std::string& name,
   auto txn = NewTransaction();
 
   MDB_val val;
-  std::string oid_key = ObjectKey(name);
+  auto oid_key = ObjectKey(name);
   int ret = txn.Get(oid_key, val);
   if (!ret) {
     txn.Abort();
@@ -99,7 +106,7 @@ int LMDBBackend::OpenLog(const std::string& name,
   auto txn = NewTransaction();
 
   MDB_val val;
-  std::string oid_key = ObjectKey(name);
+  auto oid_key = ObjectKey(name);
   int ret = txn.Get(oid_key, val);
   if (ret) {
     txn.Abort();
@@ -115,12 +122,12 @@ int LMDBBackend::OpenLog(const std::string& name,
 }
 
 int LMDBBackend::ReadViews(const std::string& hoid, uint64_t epoch,
-    std::map<uint64_t, std::string>& views)
+    uint32_t max_views, std::map<uint64_t, std::string>& views)
 {
   auto txn = NewTransaction(true);
 
   MDB_val val;
-  std::string oid_key = ObjectKey(hoid);
+  auto oid_key = ObjectKey(hoid);
   int ret = txn.Get(oid_key, val);
   if (ret) {
     txn.Abort();
@@ -135,15 +142,19 @@ int LMDBBackend::ReadViews(const std::string& hoid, uint64_t epoch,
     return 0;
   }
 
-  std::string proj_key = ProjectionKey(hoid, epoch);
-  ret = txn.Get(proj_key, val);
-  if (ret) {
-    txn.Abort();
-    return ret;
-  }
+  const uint64_t latest_epoch = proj_obj->latest_epoch;
+  for (uint64_t e = epoch; e <= latest_epoch &&
+      views.size() < max_views; e++) {
+    std::string proj_key = ProjectionKey(hoid, e);
+    ret = txn.Get(proj_key, val);
+    if (ret) {
+      txn.Abort();
+      return ret;
+    }
 
-  views.emplace(epoch,
-      std::string((const char *)val.mv_data, val.mv_size));
+    views.emplace(e,
+        std::string((const char *)val.mv_data, val.mv_size));
+  }
 
   ret = txn.Commit();
   if (ret)
@@ -158,7 +169,7 @@ int LMDBBackend::ProposeView(const std::string& hoid,
   auto txn = NewTransaction();
 
   MDB_val val;
-  std::string oid_key = ObjectKey(hoid);
+  auto oid_key = ObjectKey(hoid);
   int ret = txn.Get(oid_key, val);
   if (ret) {
     if (ret == -ENOENT) {
@@ -175,7 +186,10 @@ int LMDBBackend::ProposeView(const std::string& hoid,
 
   ProjectionObject *proj_obj = (ProjectionObject*)val.mv_data;
   assert(val.mv_size == sizeof(*proj_obj));
-  assert(epoch == (proj_obj->latest_epoch + 1));
+  if (epoch != (proj_obj->latest_epoch + 1)) {
+    txn.Abort();
+    return -EINVAL;
+  }
 
   // write new projection
   MDB_val proj_val;
@@ -198,9 +212,193 @@ int LMDBBackend::ProposeView(const std::string& hoid,
   }
 
   txn.Commit();
+
+  NotifyViews(hoid);
+
+  return 0;
+}
+
+// the name of the file in the database directory that is rewritten when a
+// view is proposed
+static const char *views_file_name = "views";
+
+int LMDBBackend::WatchViews(const std::string& hoid,
+    std::function<void()> callback, uint64_t *cookie)
+{
+  std::lock_guard<std::mutex> lk(watch_lock);
+
+  if (views_file_fd < 0) {
+    int ret = StartViewsFileWatch();
+    if (ret)
+      return ret;
+  }
+
+  *cookie = next_watch_cookie++;
+  watches.emplace(*cookie, std::make_pair(hoid, std::move(callback)));
+
+  return 0;
+}
+
+int LMDBBackend::UnwatchViews(uint64_t cookie)
+{
+  std::lock_guard<std::mutex> lk(watch_lock);
+  return watches.erase(cookie) ? 0 : -ENOENT;
+}
+
+// a change reported through the views file may be one made in this process,
+// in which case the watches are notified twice
+void LMDBBackend::NotifyViews(const std::string& hoid)
+{
+  {
+    std::lock_guard<std::mutex> lk(watch_lock);
+    for (auto& watch : watches) {
+      if (watch.second.first == hoid)
+        watch.second.second();
+    }
+  }
+
+#ifdef __linux__
+  const auto path = options.at("path") + "/" + views_file_name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  ssize_t ret = write(fd, hoid.data(), hoid.size());
+  (void)ret;
+  close(fd);
+#endif
+}
+
+// without inotify only the changes made in this process are reported
+int LMDBBackend::StartViewsFileWatch()
+{
+#ifdef __linux__
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  if (inotify_add_watch(fd, options.at("path").c_str(), IN_CLOSE_WRITE) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  int stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  views_file_fd = fd;
+  views_file_stop_fd = stop_fd;
+  views_file_thread = std::thread(&LMDBBackend::WatchViewsFile, this);
+#endif
   return 0;
 }
 
+void LMDBBackend::StopViewsFileWatch()
+{
+#ifdef __linux__
+  if (views_file_fd < 0)
+    return;
+
+  uint64_t val = 1;
+  ssize_t ret = write(views_file_stop_fd, &val, sizeof(val));
+  (void)ret;
+  views_file_thread.join();
+
+  close(views_file_fd);
+  close(views_file_stop_fd);
+  views_file_fd = -1;
+  views_file_stop_fd = -1;
+#endif
+}
+
+// every watch is notified when the views file is rewritten, since the file
+// may have been rewritten again before it's read
+void LMDBBackend::WatchViewsFile()
+{
+#ifdef __linux__
+  alignas(struct inotify_event) char buf[4096];
+
+  while (true) {
+    struct pollfd fds[2];
+    fds[0].fd = views_file_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = views_file_stop_fd;
+    fds[1].events = POLLIN;
+
+    int ret = poll(fds, 2, -1);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "views file poll error " << errno << std::endl;
+      return;
+    }
+
+    if (fds[1].revents)
+      return;
+
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(views_file_fd, buf, sizeof(buf))) > 0) {
+      for (char *p = buf; p < buf + len; ) {
+        auto event = reinterpret_cast<const struct inotify_event*>(p);
+        if (event->len && strcmp(event->name, views_file_name) == 0)
+          changed = true;
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    }
+
+    if (changed) {
+      std::lock_guard<std::mutex> lk(watch_lock);
+      for (auto& watch : watches)
+        watch.second.second();
+    }
+  }
+#endif
+}
+
+int LMDBBackend::WriteViewCheckpoint(const std::string& hoid,
+    const std::string& data)
+{
+  auto txn = NewTransaction();
+
+  MDB_val val;
+  int ret = txn.Get(ObjectKey(hoid), val);
+  if (ret) {
+    txn.Abort();
+    return ret;
+  }
+
+  val.mv_data = (void*)data.data();
+  val.mv_size = data.size();
+  ret = txn.Put(ViewCheckpointKey(hoid), val, false);
+  if (ret) {
+    txn.Abort();
+    return ret;
+  }
+
+  return txn.Commit();
+}
+
+int LMDBBackend::ReadViewCheckpoint(const std::string& hoid,
+    std::string *data)
+{
+  auto txn = NewTransaction(true);
+
+  MDB_val val;
+  int ret = txn.Get(ViewCheckpointKey(hoid), val);
+  if (ret) {
+    txn.Abort();
+    return ret;
+  }
+
+  data->assign((const char *)val.mv_data, val.mv_size);
+
+  return txn.Commit();
+}
+
 int LMDBBackend::Write(const std::string& oid, const Slice& data,
     uint64_t epoch, uint64_t position, uint32_t stride, uint32_t max_size)
 {
@@ -226,21 +424,17 @@ int LMDBBackend::Write(const std::string& oid, const Slice& data,
     pos = maxpos->maxpos;
   }
 
+  // the entry is written directly into space reserved in the database
   LogEntry entry;
-  const size_t size = sizeof(entry) + data.size();
-  std::vector<unsigned char> blob;
-  blob.reserve(size);
-  blob.insert(blob.end(), (unsigned char *)&entry,
-      ((unsigned char *)&entry) + sizeof(entry));
-  blob.insert(blob.end(), (unsigned char *)data.data(),
-      ((unsigned char *)data.data()) + data.size());
-
-  std::string key = LogEntryKey(oid, position);
-  ret = txn.Put(key, blob, true);
+  MDB_val val;
+  auto key = LogEntryKey(oid, position);
+  ret = txn.Reserve(key, sizeof(entry) + data.size(), val);
   if (ret == -EEXIST) {
     txn.Abort();
     return -EROFS;
   }
+  memcpy(val.mv_data, &entry, sizeof(entry));
+  memcpy((char*)val.mv_data + sizeof(entry), data.data(), data.size());
 
   // update max pos
   LogMaxPos new_maxpos;
@@ -269,7 +463,7 @@ int LMDBBackend::Read(const std::string& oid, uint64_t epoch,
   }
 
   MDB_val val;
-  std::string key = LogEntryKey(oid, position);
+  auto key = LogEntryKey(oid, position);
   ret = txn.Get(key, val);
   if (ret == -ENOENT) {
     txn.Abort();
@@ -294,6 +488,135 @@ int LMDBBackend::Read(const std::string& oid, uint64_t epoch,
   return 0;
 }
 
+MDB_txn *LMDBBackend::NewPinTransaction()
+{
+  MDB_txn *txn = nullptr;
+  {
+    std::lock_guard<std::mutex> lk(pin_txns_lock);
+    if (!pin_txns.empty()) {
+      txn = pin_txns.back();
+      pin_txns.pop_back();
+    }
+  }
+
+  if (txn) {
+    int ret = mdb_txn_renew(txn);
+    if (ret == 0)
+      return txn;
+    mdb_txn_abort(txn);
+  }
+
+  int ret = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+  if (ret) {
+    ZLOG_LMDB_ASSERT(ret, ret == MDB_READERS_FULL);
+    return nullptr;
+  }
+
+  return txn;
+}
+
+void LMDBBackend::ReleasePinTransaction(MDB_txn *txn)
+{
+  mdb_txn_reset(txn);
+
+  std::lock_guard<std::mutex> lk(pin_txns_lock);
+  if (pin_txns.size() < max_pin_txns) {
+    pin_txns.push_back(txn);
+    return;
+  }
+
+  mdb_txn_abort(txn);
+}
+
+// the value stays in the memory map while the read transaction is open, so
+// the pin holds the transaction rather than a copy of the entry. pages of the
+// snapshot aren't reused by writers while a pin is held, so pins should be
+// short-lived. without a free reader slot the entry is copied.
+int LMDBBackend::ReadPinned(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t stride, uint32_t max_size,
+    PinnedSlice *data)
+{
+  MDB_txn *pin_txn = NewPinTransaction();
+  if (!pin_txn) {
+    return Backend::ReadPinned(oid, epoch, position, stride, max_size,
+        data);
+  }
+
+  Transaction txn(pin_txn, this);
+
+  int ret = CheckEpoch(txn, epoch, oid);
+  if (ret) {
+    ReleasePinTransaction(txn.Release());
+    return ret;
+  }
+
+  MDB_val val;
+  auto key = LogEntryKey(oid, position);
+  ret = txn.Get(key, val);
+  if (ret == -ENOENT) {
+    ReleasePinTransaction(txn.Release());
+    return ret;
+  }
+
+  LogEntry *entry = (LogEntry*)val.mv_data;
+  if (entry->trimmed || entry->invalidated) {
+    ReleasePinTransaction(txn.Release());
+    return -ENODATA;
+  }
+
+  const char *blob = (const char *)val.mv_data + sizeof(*entry);
+  std::shared_ptr<const void> pin(txn.Release(),
+      [this](const void *p) {
+        ReleasePinTransaction((MDB_txn*)p);
+      });
+  *data = PinnedSlice(blob, val.mv_size - sizeof(*entry), std::move(pin));
+
+  return 0;
+}
+
+// the entries are read in one read-only transaction. the keys of an object's
+// entries don't sort by position, so each entry is looked up rather than
+// scanned with a cursor.
+int LMDBBackend::ReadRange(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+    std::vector<int> *results, std::vector<std::string> *data)
+{
+  auto txn = NewTransaction(true);
+
+  int ret = CheckEpoch(txn, epoch, oid);
+  if (ret) {
+    txn.Abort();
+    return ret;
+  }
+
+  results->assign(count, -ENOENT);
+  data->assign(count, std::string());
+
+  for (uint32_t i = 0; i < count; i++) {
+    MDB_val val;
+    auto key = LogEntryKey(oid, position + (uint64_t)i * stride);
+    ret = txn.Get(key, val);
+    if (ret == -ENOENT)
+      continue;
+
+    LogEntry *entry = (LogEntry*)val.mv_data;
+    if (entry->trimmed || entry->invalidated) {
+      (*results)[i] = -ENODATA;
+      continue;
+    }
+
+    const char *blob = (const char *)val.mv_data + sizeof(*entry);
+    (*results)[i] = 0;
+    (*data)[i].assign(blob, val.mv_size - sizeof(*entry));
+  }
+
+  ret = txn.Commit();
+  if (ret)
+    return ret;
+
+  return 0;
+}
+
 int LMDBBackend::Trim(const std::string& oid, uint64_t epoch,
     uint64_t position, uint32_t stride, uint32_t max_size)
 {
@@ -308,7 +631,7 @@ int LMDBBackend::Trim(const std::string& oid, uint64_t epoch,
   LogEntry entry;
 
   MDB_val val;
-  std::string key = LogEntryKey(oid, position);
+  auto key = LogEntryKey(oid, position);
   ret = txn.Get(key, val);
   if (!ret) {
     assert(val.mv_size >= sizeof(entry));
@@ -347,7 +670,7 @@ int LMDBBackend::Fill(const std::string& oid, uint64_t epoch,
   LogEntry entry;
 
   MDB_val val;
-  std::string key = LogEntryKey(oid, position);
+  auto key = LogEntryKey(oid, position);
   ret = txn.Get(key, val);
   if (!ret) {
     assert(val.mv_size >= sizeof(entry));
@@ -399,6 +722,23 @@ int LMDBBackend::AioRead(const std::string& oid, uint64_t epoch,
   return 0;
 }
 
+int LMDBBackend::AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  int ret = Seal(oid, epoch);
+  callback(arg, ret);
+  return 0;
+}
+
+int LMDBBackend::AioMaxPos(const std::string& oid, uint64_t epoch,
+    uint64_t *pos, bool *empty, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  int ret = MaxPos(oid, epoch, pos, empty);
+  callback(arg, ret);
+  return 0;
+}
+
 int LMDBBackend::CheckEpoch(Transaction& txn, uint64_t epoch,
     const std::string& oid, bool eq)
 {
@@ -526,7 +866,12 @@ void LMDBBackend::Init(const std::string& path)
 
 void LMDBBackend::Close()
 {
+  StopViewsFileWatch();
   closed = true;
+  for (auto txn : pin_txns) {
+    mdb_txn_abort(txn);
+  }
+  pin_txns.clear();
   mdb_env_sync(env, 1);
   mdb_env_close(env);
 }
@@ -53,7 +53,7 @@ int RAMBackend::OpenLog(const std::string& name,
 }
 
 int RAMBackend::ReadViews(const std::string& hoid, uint64_t epoch,
-    std::map<uint64_t, std::string>& views)
+    uint32_t max_views, std::map<uint64_t, std::string>& views)
 {
   std::lock_guard<std::mutex> lk(lock_);
 
@@ -67,34 +67,103 @@ int RAMBackend::ReadViews(const std::string& hoid, uint64_t epoch,
     return 0;
   }
 
-  auto it2 = proj_obj.projections.find(epoch);
-  if (it2 == proj_obj.projections.end())
-    return -ENOENT;
-
-  views.emplace(epoch, it2->second);
+  for (uint64_t e = epoch; e <= proj_obj.latest_epoch &&
+      views.size() < max_views; e++) {
+    auto it2 = proj_obj.projections.find(e);
+    if (it2 == proj_obj.projections.end())
+      return -ENOENT;
+    views.emplace(e, it2->second);
+  }
 
   return 0;
 }
 
 int RAMBackend::ProposeView(const std::string& hoid,
     uint64_t epoch, const std::string& view)
+{
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+
+    auto it = objects_.find(hoid);
+    if (it == objects_.end()) {
+      assert(epoch == 0);
+    }
+
+    ProjectionObject& proj_obj = boost::get<ProjectionObject>(it->second);
+    if (epoch != (proj_obj.latest_epoch + 1)) {
+      return -EINVAL;
+    }
+
+    auto ret = proj_obj.projections.emplace(epoch, view);
+    if (!ret.second) {
+      return -EEXIST;
+    }
+
+    proj_obj.latest_epoch = epoch;
+  }
+
+  NotifyViews(hoid);
+
+  return 0;
+}
+
+int RAMBackend::WatchViews(const std::string& hoid,
+    std::function<void()> callback, uint64_t *cookie)
+{
+  std::lock_guard<std::mutex> lk(watch_lock_);
+  *cookie = next_watch_cookie_++;
+  watches_.emplace(*cookie, std::make_pair(hoid, std::move(callback)));
+  return 0;
+}
+
+int RAMBackend::UnwatchViews(uint64_t cookie)
+{
+  std::lock_guard<std::mutex> lk(watch_lock_);
+  return watches_.erase(cookie) ? 0 : -ENOENT;
+}
+
+void RAMBackend::NotifyViews(const std::string& hoid)
+{
+  std::lock_guard<std::mutex> lk(watch_lock_);
+  for (auto& watch : watches_) {
+    if (watch.second.first == hoid)
+      watch.second.second();
+  }
+}
+
+int RAMBackend::WriteViewCheckpoint(const std::string& hoid,
+    const std::string& data)
 {
   std::lock_guard<std::mutex> lk(lock_);
 
   auto it = objects_.find(hoid);
   if (it == objects_.end()) {
-    assert(epoch == 0);
+    return -ENOENT;
   }
 
-  ProjectionObject& proj_obj = boost::get<ProjectionObject>(it->second);
-  assert(epoch == (proj_obj.latest_epoch + 1));
+  auto& proj_obj = boost::get<ProjectionObject>(it->second);
+  proj_obj.has_view_checkpoint = true;
+  proj_obj.view_checkpoint = data;
 
-  auto ret = proj_obj.projections.emplace(epoch, view);
-  if (!ret.second) {
-    return -EEXIST;
+  return 0;
+}
+
+int RAMBackend::ReadViewCheckpoint(const std::string& hoid,
+    std::string *data)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  auto it = objects_.find(hoid);
+  if (it == objects_.end()) {
+    return -ENOENT;
+  }
+
+  auto& proj_obj = boost::get<ProjectionObject>(it->second);
+  if (!proj_obj.has_view_checkpoint) {
+    return -ENOENT;
   }
 
-  proj_obj.latest_epoch = epoch;
+  data->assign(proj_obj.view_checkpoint);
 
   return 0;
 }
@@ -120,13 +189,76 @@ int RAMBackend::Read(const std::string& oid, uint64_t epoch,
     if (entry.trimmed || entry.invalidated)
       return -ENODATA;
 
-    data->assign(entry.data);
+    data->assign(*entry.data);
     return 0;
   } else {
     return -ENOENT;
   }
 }
 
+int RAMBackend::ReadPinned(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t stride, uint32_t max_size,
+    PinnedSlice *data)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  LogObject *lobj = nullptr;
+  int ret = CheckEpoch(epoch, oid, false, lobj);
+  if (ret) {
+    return ret;
+  }
+
+  if (!lobj)
+    return -ENOENT;
+
+  const auto it = lobj->entries.find(position);
+  if (it == lobj->entries.end())
+    return -ENOENT;
+
+  const LogEntry& entry = it->second;
+  if (entry.trimmed || entry.invalidated)
+    return -ENODATA;
+
+  *data = PinnedSlice(entry.data);
+  return 0;
+}
+
+// the entries are read under one acquisition of the lock
+int RAMBackend::ReadRange(const std::string& oid, uint64_t epoch,
+    uint64_t position, uint32_t count, uint32_t stride, uint32_t max_size,
+    std::vector<int> *results, std::vector<std::string> *data)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  LogObject *lobj = nullptr;
+  int ret = CheckEpoch(epoch, oid, false, lobj);
+  if (ret) {
+    return ret;
+  }
+
+  results->assign(count, -ENOENT);
+  data->assign(count, std::string());
+  if (!lobj)
+    return 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    const auto it = lobj->entries.find(position + (uint64_t)i * stride);
+    if (it == lobj->entries.end())
+      continue;
+
+    const LogEntry& entry = it->second;
+    if (entry.trimmed || entry.invalidated) {
+      (*results)[i] = -ENODATA;
+      continue;
+    }
+
+    (*results)[i] = 0;
+    (*data)[i].assign(*entry.data);
+  }
+
+  return 0;
+}
+
 int RAMBackend::Write(const std::string& oid, const Slice& data,
     uint64_t epoch, uint64_t position, uint32_t stride, uint32_t max_size)
 {
@@ -143,17 +275,17 @@ int RAMBackend::Write(const std::string& oid, const Slice& data,
     lobj = &boost::get<LogObject>(ret.first->second);
   }
 
-  auto it = lobj->entries.find(position);
-  if (it == lobj->entries.end()) {
-    // TODO: more efficent!
-    LogEntry entry;
-    entry.data = data.ToString();
-    lobj->entries.emplace(position, entry);
-    lobj->maxpos = std::max(lobj->maxpos, position);
-    return 0;
-  } else {
+  // the entry is constructed in place and the data copied once
+  auto ret2 = lobj->entries.emplace(std::piecewise_construct,
+      std::forward_as_tuple(position), std::forward_as_tuple());
+  if (!ret2.second) {
     return -EROFS;
   }
+
+  ret2.first->second.data = std::make_shared<const std::string>(data.data(),
+      data.size());
+  lobj->maxpos = std::max(lobj->maxpos, position);
+  return 0;
 }
 
 int RAMBackend::Trim(const std::string& oid, uint64_t epoch,
@@ -181,7 +313,7 @@ int RAMBackend::Trim(const std::string& oid, uint64_t epoch,
   } else {
     auto& entry = it->second;
     entry.trimmed = true;
-    entry.data.clear();
+    entry.data.reset();
   }
 
   return 0;
@@ -281,6 +413,23 @@ int RAMBackend::AioRead(const std::string& oid, uint64_t epoch,
   return 0;
 }
 
+int RAMBackend::AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  int ret = Seal(oid, epoch);
+  callback(arg, ret);
+  return 0;
+}
+
+int RAMBackend::AioMaxPos(const std::string& oid, uint64_t epoch,
+    uint64_t *pos, bool *empty, void *arg,
+    std::function<void(void*, int)> callback)
+{
+  int ret = MaxPos(oid, epoch, pos, empty);
+  callback(arg, ret);
+  return 0;
+}
+
 
 int RAMBackend::CheckEpoch(uint64_t epoch, const std::string& oid,
     bool eq, LogObject*& lobj)
@@ -0,0 +1,242 @@
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include "gtest/gtest.h"
+#include "zlog/log.h"
+#include "include/zlog/backend/ram.h"
+#include "port/stack_trace.h"
+#include <google/protobuf/stubs/common.h>
+
+// This test replaces the global allocator, so it is built as its own program
+// rather than with the backend test suites.
+
+// heap allocations made by the current thread are counted while enabled
+static thread_local bool count_allocs = false;
+static std::atomic<uint64_t> num_allocs(0);
+
+void *operator new(size_t size)
+{
+  if (count_allocs)
+    num_allocs++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+// suspends counting on this thread for its lifetime
+struct UncountedScope {
+  UncountedScope() : prev(count_allocs) { count_allocs = false; }
+  ~UncountedScope() { count_allocs = prev; }
+  const bool prev;
+};
+
+// forwards to a backend without counting its allocations. storing an entry
+// allocates in the in-memory backend by design.
+class UncountedBackend : public zlog::Backend {
+ public:
+  explicit UncountedBackend(std::shared_ptr<zlog::Backend> backend) :
+    backend_(backend)
+  {}
+
+  int Initialize(const std::map<std::string, std::string>& opts) override {
+    UncountedScope s;
+    return backend_->Initialize(opts);
+  }
+
+  std::map<std::string, std::string> meta() override {
+    UncountedScope s;
+    return backend_->meta();
+  }
+
+  int CreateLog(const std::string& name,
+      const std::string& initial_view) override {
+    UncountedScope s;
+    return backend_->CreateLog(name, initial_view);
+  }
+
+  int OpenLog(const std::string& name, std::string& hoid,
+      std::string& prefix) override {
+    UncountedScope s;
+    return backend_->OpenLog(name, hoid, prefix);
+  }
+
+  int ReadViews(const std::string& hoid, uint64_t epoch, uint32_t max_views,
+      std::map<uint64_t, std::string>& views) override {
+    UncountedScope s;
+    return backend_->ReadViews(hoid, epoch, max_views, views);
+  }
+
+  int ProposeView(const std::string& hoid, uint64_t epoch,
+      const std::string& view) override {
+    UncountedScope s;
+    return backend_->ProposeView(hoid, epoch, view);
+  }
+
+  int WatchViews(const std::string& hoid, std::function<void()> callback,
+      uint64_t *cookie) override {
+    UncountedScope s;
+    return backend_->WatchViews(hoid, callback, cookie);
+  }
+
+  int UnwatchViews(uint64_t cookie) override {
+    UncountedScope s;
+    return backend_->UnwatchViews(cookie);
+  }
+
+  int WriteViewCheckpoint(const std::string& hoid,
+      const std::string& data) override {
+    UncountedScope s;
+    return backend_->WriteViewCheckpoint(hoid, data);
+  }
+
+  int ReadViewCheckpoint(const std::string& hoid,
+      std::string *data) override {
+    UncountedScope s;
+    return backend_->ReadViewCheckpoint(hoid, data);
+  }
+
+  int Read(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size, std::string *data) override {
+    UncountedScope s;
+    return backend_->Read(oid, epoch, position, stride, max_size, data);
+  }
+
+  int ReadPinned(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size,
+      zlog::PinnedSlice *data) override {
+    UncountedScope s;
+    return backend_->ReadPinned(oid, epoch, position, stride, max_size, data);
+  }
+
+  int ReadRange(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data) override {
+    UncountedScope s;
+    return backend_->ReadRange(oid, epoch, position, count, stride, max_size,
+        results, data);
+  }
+
+  int Write(const std::string& oid, const zlog::Slice& data, uint64_t epoch,
+      uint64_t position, uint32_t stride, uint32_t max_size) override {
+    UncountedScope s;
+    return backend_->Write(oid, data, epoch, position, stride, max_size);
+  }
+
+  int Fill(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size) override {
+    UncountedScope s;
+    return backend_->Fill(oid, epoch, position, stride, max_size);
+  }
+
+  int Trim(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size) override {
+    UncountedScope s;
+    return backend_->Trim(oid, epoch, position, stride, max_size);
+  }
+
+  int Seal(const std::string& oid, uint64_t epoch) override {
+    UncountedScope s;
+    return backend_->Seal(oid, epoch);
+  }
+
+  int MaxPos(const std::string& oid, uint64_t epoch, uint64_t *pos,
+      bool *empty) override {
+    UncountedScope s;
+    return backend_->MaxPos(oid, epoch, pos, empty);
+  }
+
+  int AioRead(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size, std::string *data, void *arg,
+      std::function<void(void*, int)> callback) override {
+    UncountedScope s;
+    return backend_->AioRead(oid, epoch, position, stride, max_size, data,
+        arg, callback);
+  }
+
+  int AioReadRange(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t count, uint32_t stride, uint32_t max_size,
+      std::vector<int> *results, std::vector<std::string> *data, void *arg,
+      std::function<void(void*, int)> callback) override {
+    UncountedScope s;
+    return backend_->AioReadRange(oid, epoch, position, count, stride,
+        max_size, results, data, arg, callback);
+  }
+
+  int AioWrite(const std::string& oid, uint64_t epoch, uint64_t position,
+      uint32_t stride, uint32_t max_size, const zlog::Slice& data, void *arg,
+      std::function<void(void*, int)> callback) override {
+    UncountedScope s;
+    return backend_->AioWrite(oid, epoch, position, stride, max_size, data,
+        arg, callback);
+  }
+
+  int AioSeal(const std::string& oid, uint64_t epoch, void *arg,
+      std::function<void(void*, int)> callback) override {
+    UncountedScope s;
+    return backend_->AioSeal(oid, epoch, arg, callback);
+  }
+
+  int AioMaxPos(const std::string& oid, uint64_t epoch, uint64_t *pos,
+      bool *empty, void *arg,
+      std::function<void(void*, int)> callback) override {
+    UncountedScope s;
+    return backend_->AioMaxPos(oid, epoch, pos, empty, arg, callback);
+  }
+
+ private:
+  std::shared_ptr<zlog::Backend> backend_;
+};
+
+// once the log is warmed up, an append doesn't allocate outside of the
+// backend. the cache is disabled because it keeps a copy of each entry.
+TEST(RAMAllocationsTest, Append) {
+  auto backend = std::make_shared<UncountedBackend>(
+      std::make_shared<zlog::storage::ram::RAMBackend>());
+
+  zlog::Options opts;
+  opts.cache_size = 0;
+
+  // long enough that the object names aren't stored inline
+  const std::string name(64, 'a');
+
+  zlog::Log *log;
+  int ret = zlog::Log::CreateWithBackend(opts, backend, name, &log);
+  ASSERT_EQ(ret, 0);
+
+  const std::string input(64, 'b');
+
+  for (int i = 0; i < 50; i++) {
+    ret = log->Append(zlog::Slice(input));
+    ASSERT_EQ(ret, 0);
+  }
+
+  num_allocs = 0;
+  count_allocs = true;
+  for (int i = 0; i < 100; i++) {
+    ret = log->Append(zlog::Slice(input));
+    if (ret)
+      break;
+  }
+  count_allocs = false;
+  ASSERT_EQ(ret, 0);
+
+  EXPECT_EQ(num_allocs, 0u);
+
+  delete log;
+}
+
+int main(int argc, char **argv)
+{
+  rocksdb::port::InstallStackTraceHandler();
+  ::testing::InitGoogleTest(&argc, argv);
+  int ret = RUN_ALL_TESTS();
+  google::protobuf::ShutdownProtobufLibrary();
+  return ret;
+}
@@ -62,6 +62,16 @@ INSTANTIATE_TEST_CASE_P(Level, LibZLogTest,
       std::make_tuple(true, true),
       std::make_tuple(false, true)));
 
+INSTANTIATE_TEST_CASE_P(Level, LibZLogLeaseTest,
+    ::testing::Values(
+      std::make_tuple(true, true),
+      std::make_tuple(false, true)));
+
+INSTANTIATE_TEST_CASE_P(Level, LibZLogShmTest,
+    ::testing::Values(
+      std::make_tuple(true, true),
+      std::make_tuple(false, true)));
+
 INSTANTIATE_TEST_CASE_P(LevelCAPI, LibZLogCAPITest,
     ::testing::Values(
       std::make_tuple(false, true)));